@@ -0,0 +1,229 @@
+// 微基准：子弹推进、每tick状态帧编码、按连接查房间。直接包含服务器源码调用同一套函数，
+// 不开网络也不起tick线程。编译：gcc -O2 -march=native -o bench bench.c -lpthread
+#define TANKS_NO_MAIN
+#include "server.c"
+
+#define BENCH_ROUNDS 5
+#define BENCH_CONNECTIONS 4096
+#define BENCH_MAX_ROOMS 4096
+
+// 查找结果累加到这里，防止编译器把循环优化掉
+volatile uintptr_t bench_sink;
+
+// 只建房间对象和地图，不进房间池也不调度
+Room *bench_room(int width, int height, int players, int radius) {
+    map_width = width;
+    map_height = height;
+    players_per_room = players;
+    view_radius = radius;
+    
+    Room *room = aligned_alloc(CACHE_LINE_SIZE, sizeof(Room));
+    if (!room) {
+        perror("Failed to allocate room");
+        exit(EXIT_FAILURE);
+    }
+    memset(room, 0, sizeof(Room));
+    room->active = 1;
+    if (room_configure(room) < 0) {
+        perror("Failed to allocate room map");
+        exit(EXIT_FAILURE);
+    }
+    
+    room->map_seed = 1;
+    init_map(room);
+    return room;
+}
+
+void bench_free_room(Room *room) {
+    grid_free(&room->map);
+    grid_free(&room->tank_at);
+    room_history_free(room);
+    free(room);
+}
+
+// 多轮取最快的一轮，减少调度和频率变化的干扰
+void report(const char *name, const char *params, double best_ns) {
+    printf("%-20s %-32s %10.1f ns/op\n", name, params, best_ns);
+}
+
+void fill_bullets(Room *room, int count, unsigned int *seed) {
+    BulletSet *bullets = &room->game.bullets;
+    
+    for (int i = 0; i < count; i++) {
+        if (bullets->active & BULLET_BIT(i)) continue;
+        bullets->active |= BULLET_BIT(i);
+        bullets->x[i] = 1 + rand_r(seed) % (room->width - 2);
+        bullets->y[i] = 1 + rand_r(seed) % (room->height - 2);
+        bullets->direction[i] = rand_r(seed) % 4;
+        bullets->owner_id[i] = 1;
+    }
+}
+
+// 空地图上的子弹能飞很久；每一批推进batch步之后在计时之外补满
+void bench_update_bullets(int size, int count) {
+    const int batch = 64, batches = 2000;
+    unsigned int seed = 1;
+    Room *room = bench_room(size, size, 2, 0);
+    
+    for (int y = 1; y < size - 1; y++) {
+        for (int x = 1; x < size - 1; x++) {
+            GRID_CELL(&room->map, x, y) = EMPTY;
+        }
+    }
+    
+    double best = 0;
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        long long total = 0;
+        for (int b = 0; b < batches; b++) {
+            room->game.bullets.active = 0;
+            fill_bullets(room, count, &seed);
+            
+            long long start = monotonic_ns();
+            for (int i = 0; i < batch; i++) {
+                update_bullets(room);
+            }
+            total += monotonic_ns() - start;
+        }
+        double per_op = (double)total / (batches * batch);
+        if (round == 0 || per_op < best) best = per_op;
+    }
+    
+    char params[64];
+    snprintf(params, sizeof(params), "map %d, %d bullets", size, count);
+    report("update_bullets", params, best);
+    bench_free_room(room);
+}
+
+// 每个tick随机移动所有坦克、偶尔射击，所有观看者都确认了上一帧；只计send_game_update本身。
+// 连接槽位没有激活，帧编码之后入队直接失败，不计发送
+void bench_send_game_update(int size, int players, int radius) {
+    const int ticks = 2000;
+    unsigned int seed = 1;
+    Room *room = bench_room(size, size, players, radius);
+    
+    for (int i = 0; i < room->max_players; i++) {
+        char name[USERNAME_MAX];
+        snprintf(name, sizeof(name), "bench%d", i);
+        player_join(room, BENCH_CONNECTIONS - 1 - i, name);
+    }
+    
+    double best = 0;
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        long long total = 0;
+        for (int t = 0; t < ticks; t++) {
+            for (int i = 0; i < room->game.player_count; i++) {
+                move_tank(room, i, rand_r(&seed) % 4);
+                if (rand_r(&seed) % 8 == 0) shoot(room, i, room->tick);
+            }
+            room_advance(room);
+            if (room->game.game_over) {
+                room_new_round(room);
+            }
+            for (int i = 0; i < room->game.player_count; i++) {
+                room->views[i].acked_tick = room->tick - 1;
+            }
+            
+            long long start = monotonic_ns();
+            send_game_update(room);
+            total += monotonic_ns() - start;
+        }
+        double per_op = (double)total / ticks;
+        if (round == 0 || per_op < best) best = per_op;
+    }
+    
+    char params[64];
+    snprintf(params, sizeof(params), "map %d, %d players, radius %d", size, room->max_players, radius);
+    report("send_game_update", params, best);
+    bench_free_room(room);
+}
+
+// 房间真正从房间池里取，连接随机绑定到各个房间的槽位上。房间池在main里按最大规模只建一次，
+// 各规模按递增顺序调用，在已经取到的房间上继续补足
+void bench_find_room(int rooms) {
+    const int lookups = 1 << 20;
+    unsigned int seed = 1;
+    static Room *list[BENCH_MAX_ROOMS];
+    static int count = 0;
+    
+    while (count < rooms) {
+        Room *room = room_acquire();
+        if (!room) break;
+        list[count++] = room;
+    }
+    
+    for (int fd = 0; fd < BENCH_CONNECTIONS; fd++) {
+        Room *room = list[rand_r(&seed) % count];
+        session_bind(fd, room->id, fd % room->max_players);
+    }
+    
+    int fds[1024];
+    for (int i = 0; i < 1024; i++) {
+        fds[i] = rand_r(&seed) % BENCH_CONNECTIONS;
+    }
+    
+    double best = 0;
+    uintptr_t sink = 0;
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        long long start = monotonic_ns();
+        for (int i = 0; i < lookups; i++) {
+            sink += (uintptr_t)find_room_for_client(fds[i & 1023]);
+        }
+        double per_op = (double)(monotonic_ns() - start) / lookups;
+        if (round == 0 || per_op < best) best = per_op;
+    }
+    
+    bench_sink = sink;
+    
+    char params[64];
+    snprintf(params, sizeof(params), "%d rooms", count);
+    report("find_room_for_client", params, best);
+}
+
+int main(int argc, char *argv[]) {
+    const char *only = argc > 1 ? argv[1] : NULL;
+    
+    tick_rate = DEFAULT_TICK_RATE;
+    tick_interval_ns = 1000000000LL / tick_rate;
+    keyframe_interval_ticks = (unsigned int)tick_rate * KEYFRAME_INTERVAL_MS / 1000;
+    fire_cooldown_ticks = ((unsigned int)tick_rate * FIRE_COOLDOWN_MS + 999) / 1000;
+    
+    // room_acquire会调度房间，给它一个不运行的tick worker；换图请求进后台线程池
+    tick_worker_count = 1;
+    pthread_mutex_init(&tick_workers[0].mutex, NULL);
+    pthread_cond_init(&tick_workers[0].cond, NULL);
+    init_thread_pool(1);
+    alloc_connections(BENCH_CONNECTIONS);
+    
+    printf("sizeof(Room) = %zu bytes\n\n", sizeof(Room));
+    
+    if (!only || strcmp(only, "bullets") == 0) {
+        bench_update_bullets(64, 8);
+        bench_update_bullets(64, 32);
+        bench_update_bullets(64, MAX_BULLETS);
+        bench_update_bullets(256, MAX_BULLETS);
+    }
+    
+    if (!only || strcmp(only, "update") == 0) {
+        bench_send_game_update(20, 4, 0);
+        bench_send_game_update(64, 16, 0);
+        bench_send_game_update(64, 16, 1);
+        bench_send_game_update(256, 64, 0);
+        bench_send_game_update(256, 64, 8);
+    }
+    
+    if (!only || strcmp(only, "rooms") == 0) {
+        // 前面的基准改过地图尺寸和人数，房间池用服务器默认配置
+        map_width = DEFAULT_MAP_SIZE;
+        map_height = DEFAULT_MAP_SIZE;
+        players_per_room = DEFAULT_PLAYERS;
+        view_radius = DEFAULT_VIEW_RADIUS;
+        init_room_pool(BENCH_MAX_ROOMS);
+        
+        bench_find_room(1);
+        bench_find_room(64);
+        bench_find_room(1024);
+        bench_find_room(4096);
+    }
+    
+    return 0;
+}
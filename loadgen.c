@@ -0,0 +1,540 @@
+// 无界面的压测客户端：开N条连接登录进房间，按设定的频率随机移动和射击，
+// 统计状态帧的到达间隔和抖动，以及输入从发出到快照里回显出序号的延迟。
+// 包含服务器源码复用协议常量和直方图，编译：gcc -O2 -o loadgen loadgen.c -lpthread
+#define TANKS_NO_MAIN
+#include "server.c"
+
+#include <limits.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include <sys/resource.h>
+
+#define BOT_IN_BUFFER (MAX_FRAME_PAYLOAD + FRAME_HEADER_SIZE)
+#define BOT_OUT_BUFFER 4096
+#define SEQ_WINDOW 256
+#define MAX_LOAD_THREADS 64
+
+#define BEHAVIOR_IDLE 0
+#define BEHAVIOR_WANDER 1
+#define BEHAVIOR_FIGHT 2
+
+typedef struct {
+    int fd;
+    int my_index;
+    char username[USERNAME_MAX];
+    unsigned char *in_buf;
+    int in_len;
+    unsigned char out_buf[BOT_OUT_BUFFER];
+    int out_len;
+    unsigned int last_tick;
+    unsigned int input_seq;
+    unsigned int echoed_seq;
+    // 按序号取模记下每条输入的发出时间，回显时对上序号才算
+    unsigned int sent_seq[SEQ_WINDOW];
+    long long sent_ns[SEQ_WINDOW];
+    long long last_frame_ns;
+    long long next_move_ns;
+    long long next_shoot_ns;
+} Bot;
+
+// 每个线程一份，只由该线程写，主线程每秒汇总
+typedef struct {
+    Histogram interval;
+    Histogram jitter;
+    Histogram echo;
+    _Atomic unsigned long long connected;
+    _Atomic unsigned long long frames;
+    _Atomic unsigned long long keyframes;
+    _Atomic unsigned long long deltas;
+    _Atomic unsigned long long bytes_in;
+    _Atomic unsigned long long inputs_sent;
+    _Atomic unsigned long long inputs_dropped;
+    _Atomic unsigned long long disconnects;
+} __attribute__((aligned(CACHE_LINE_SIZE))) LoadStats;
+
+typedef struct {
+    int index;
+    pthread_t thread;
+    Bot *bots;
+    int bot_count;
+    int first_bot;
+    unsigned int seed;
+    LoadStats stats;
+} LoadThread;
+
+struct sockaddr_in server_addr;
+int behavior = BEHAVIOR_FIGHT;
+double move_rate = 5;
+double shoot_rate = 1;
+int expected_rate = DEFAULT_TICK_RATE;
+_Atomic int load_stop;
+LoadThread load_threads[MAX_LOAD_THREADS];
+int load_thread_count = 4;
+
+unsigned int read_varint_at(const unsigned char *buffer, int len, int *offset) {
+    unsigned int value = 0;
+    
+    for (int shift = 0; shift < 35 && *offset < len; shift += 7) {
+        unsigned char byte = buffer[(*offset)++];
+        value |= (unsigned int)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) return value;
+    }
+    
+    *offset = len + 1;
+    return 0;
+}
+
+// 下一次动作的时间在平均间隔的0.5到1.5倍之间随机，避免所有bot同步发送
+long long next_action(LoadThread *t, long long now, double rate) {
+    if (rate <= 0) return LLONG_MAX;
+    double interval = 1e9 / rate;
+    return now + (long long)(interval * (0.5 + (double)rand_r(&t->seed) / RAND_MAX));
+}
+
+void bot_queue(LoadThread *t, Bot *bot, const unsigned char *message, int len) {
+    if (bot->out_len + FRAME_HEADER_SIZE + len > BOT_OUT_BUFFER) {
+        metric_add(&t->stats.inputs_dropped, 1);
+        return;
+    }
+    
+    bot->out_buf[bot->out_len++] = len >> 8;
+    bot->out_buf[bot->out_len++] = len;
+    memcpy(bot->out_buf + bot->out_len, message, len);
+    bot->out_len += len;
+}
+
+int bot_flush(Bot *bot) {
+    int sent = 0;
+    
+    while (sent < bot->out_len) {
+        ssize_t n = send(bot->fd, bot->out_buf + sent, bot->out_len - sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return -1;
+        }
+        sent += n;
+    }
+    
+    memmove(bot->out_buf, bot->out_buf + sent, bot->out_len - sent);
+    bot->out_len -= sent;
+    return 0;
+}
+
+void bot_send_input(LoadThread *t, Bot *bot, int type, long long now) {
+    unsigned char message[11];
+    int len;
+    
+    bot->input_seq++;
+    message[0] = type;
+    message[1] = bot->my_index + 1;
+    if (type == CMD_MOVE) {
+        message[2] = rand_r(&t->seed) % 4;
+        len = 3;
+    } else {
+        len = 2;
+    }
+    put_u32(message + len, bot->input_seq);
+    put_u32(message + len + 4, bot->last_tick);
+    len += 8;
+    
+    bot->sent_seq[bot->input_seq % SEQ_WINDOW] = bot->input_seq;
+    bot->sent_ns[bot->input_seq % SEQ_WINDOW] = now;
+    bot_queue(t, bot, message, len);
+    metric_add(&t->stats.inputs_sent, 1);
+}
+
+// 快照里自己坦克的输入序号前进了，之间的每条输入都算回显
+void bot_echo(LoadThread *t, Bot *bot, unsigned int seq, long long now) {
+    if ((int)(seq - bot->echoed_seq) <= 0 || (int)(seq - bot->input_seq) > 0) return;
+    
+    for (unsigned int s = bot->echoed_seq + 1; s != seq + 1; s++) {
+        if (bot->sent_seq[s % SEQ_WINDOW] == s) {
+            hist_record(&t->stats.echo, now - bot->sent_ns[s % SEQ_WINDOW]);
+        }
+    }
+    bot->echoed_seq = seq;
+}
+
+// 关键帧里按名字找到自己的下标（其他人离开后下标会前移），顺便取出输入序号
+void parse_keyframe(LoadThread *t, Bot *bot, const unsigned char *p, int len, long long now) {
+    int offset = 9;
+    int width = read_varint_at(p, len, &offset);
+    int height = read_varint_at(p, len, &offset);
+    int x0 = read_varint_at(p, len, &offset) << MAP_CHUNK_SHIFT;
+    int y0 = read_varint_at(p, len, &offset) << MAP_CHUNK_SHIFT;
+    int x1 = read_varint_at(p, len, &offset) << MAP_CHUNK_SHIFT;
+    int y1 = read_varint_at(p, len, &offset) << MAP_CHUNK_SHIFT;
+    if (x1 > width) x1 = width;
+    if (y1 > height) y1 = height;
+    offset += ((x1 - x0) * (y1 - y0) + 3) / 4;
+    
+    int count = read_varint_at(p, len, &offset);
+    for (int i = 0; i < count && offset < len; i++) {
+        unsigned int seq = 0;
+        int visible = p[offset] != 0;
+        
+        // 看不见的坦克是5个0字节；看得见的坦克x至少是1（边界是墙）
+        if (visible) {
+            read_varint_at(p, len, &offset);
+            read_varint_at(p, len, &offset);
+            offset += 2;
+            seq = read_varint_at(p, len, &offset);
+        } else {
+            offset += 5;
+        }
+        read_varint_at(p, len, &offset);
+        if (offset >= len) return;
+        
+        int name_len = p[offset++];
+        if (offset + name_len > len) return;
+        if (name_len == (int)strlen(bot->username) && memcmp(p + offset, bot->username, name_len) == 0) {
+            bot->my_index = i;
+            if (visible) bot_echo(t, bot, seq, now);
+        }
+        offset += name_len;
+    }
+}
+
+// 增量帧只解析到坦克部分
+void parse_delta(LoadThread *t, Bot *bot, const unsigned char *p, int len, long long now) {
+    int offset = 14;
+    
+    int changes = read_varint_at(p, len, &offset);
+    for (int i = 0; i < changes && offset < len; i++) {
+        read_varint_at(p, len, &offset);
+        read_varint_at(p, len, &offset);
+        offset++;
+    }
+    
+    int chunks = read_varint_at(p, len, &offset);
+    for (int i = 0; i < chunks && offset < len; i++) {
+        read_varint_at(p, len, &offset);
+        read_varint_at(p, len, &offset);
+        offset += CHUNK_PACKED_SIZE;
+    }
+    
+    int tanks = read_varint_at(p, len, &offset);
+    for (int i = 0; i < tanks && offset < len; i++) {
+        int index = read_varint_at(p, len, &offset);
+        read_varint_at(p, len, &offset);
+        read_varint_at(p, len, &offset);
+        offset += 2;
+        unsigned int seq = read_varint_at(p, len, &offset);
+        if (offset <= len && index == bot->my_index) bot_echo(t, bot, seq, now);
+    }
+}
+
+void handle_frame(LoadThread *t, Bot *bot, const unsigned char *p, int len, long long now) {
+    if (len < 1) return;
+    
+    switch (p[0]) {
+        case CMD_ROOM_ASSIGN:
+            if (len >= 6) {
+                bot->my_index = p[5] - 1;
+                metric_add(&t->stats.connected, 1);
+            }
+            break;
+        case CMD_UPDATE:
+        case CMD_DELTA: {
+            if (len < (p[0] == CMD_UPDATE ? 9 : 14)) return;
+            
+            unsigned int tick = get_u32(p + 5);
+            if (bot->last_frame_ns) {
+                long long interval = now - bot->last_frame_ns;
+                long long jitter = interval - 1000000000LL / expected_rate;
+                hist_record(&t->stats.interval, interval);
+                hist_record(&t->stats.jitter, jitter < 0 ? -jitter : jitter);
+            }
+            bot->last_frame_ns = now;
+            bot->last_tick = tick;
+            metric_add(&t->stats.frames, 1);
+            
+            if (p[0] == CMD_UPDATE) {
+                metric_add(&t->stats.keyframes, 1);
+                parse_keyframe(t, bot, p, len, now);
+            } else {
+                metric_add(&t->stats.deltas, 1);
+                parse_delta(t, bot, p, len, now);
+            }
+            
+            // 像真实客户端一样确认，服务器才会发增量帧
+            unsigned char ack[5];
+            ack[0] = CMD_ACK;
+            put_u32(ack + 1, tick);
+            bot_queue(t, bot, ack, 5);
+            break;
+        }
+        case CMD_GAME_OVER:
+            // 新一局的关键帧之前不再统计间隔
+            bot->last_frame_ns = 0;
+            break;
+    }
+}
+
+int bot_read(LoadThread *t, Bot *bot, long long now) {
+    while (1) {
+        ssize_t n = recv(bot->fd, bot->in_buf + bot->in_len, BOT_IN_BUFFER - bot->in_len, 0);
+        if (n == 0) return -1;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        metric_add(&t->stats.bytes_in, n);
+        bot->in_len += n;
+        
+        int offset = 0;
+        while (bot->in_len - offset >= FRAME_HEADER_SIZE) {
+            int len = (bot->in_buf[offset] << 8) | bot->in_buf[offset + 1];
+            if (bot->in_len - offset - FRAME_HEADER_SIZE < len) break;
+            handle_frame(t, bot, bot->in_buf + offset + FRAME_HEADER_SIZE, len, now);
+            offset += FRAME_HEADER_SIZE + len;
+        }
+        memmove(bot->in_buf, bot->in_buf + offset, bot->in_len - offset);
+        bot->in_len -= offset;
+    }
+}
+
+void bot_close(LoadThread *t, Bot *bot) {
+    close(bot->fd);
+    bot->fd = -1;
+    metric_add(&t->stats.disconnects, 1);
+}
+
+int bot_connect(LoadThread *t, Bot *bot, int epoll_fd) {
+    bot->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (bot->fd < 0) return -1;
+    
+    if (connect(bot->fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+        close(bot->fd);
+        bot->fd = -1;
+        return -1;
+    }
+    
+    int flag = 1;
+    setsockopt(bot->fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+    fcntl(bot->fd, F_SETFL, fcntl(bot->fd, F_GETFL, 0) | O_NONBLOCK);
+    
+    unsigned char login[USERNAME_MAX + 1];
+    int name_len = strlen(bot->username);
+    login[0] = CMD_LOGIN;
+    memcpy(login + 1, bot->username, name_len);
+    bot_queue(t, bot, login, name_len + 1);
+    
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = bot;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, bot->fd, &ev);
+    
+    return bot_flush(bot);
+}
+
+void *load_thread_main(void *arg) {
+    LoadThread *t = (LoadThread *)arg;
+    struct epoll_event events[MAX_EVENTS];
+    
+    int epoll_fd = epoll_create1(0);
+    if (epoll_fd < 0) {
+        perror("epoll_create1 failed");
+        exit(EXIT_FAILURE);
+    }
+    
+    for (int i = 0; i < t->bot_count && !atomic_load(&load_stop); i++) {
+        Bot *bot = &t->bots[i];
+        snprintf(bot->username, USERNAME_MAX, "bot%d", t->first_bot + i);
+        bot->in_buf = malloc(BOT_IN_BUFFER);
+        bot->my_index = -1;
+        if (!bot->in_buf || bot_connect(t, bot, epoll_fd) < 0) {
+            fprintf(stderr, "%s failed to connect: %s\n", bot->username, strerror(errno));
+            if (bot->fd >= 0) close(bot->fd);
+            bot->fd = -1;
+            continue;
+        }
+        
+        long long now = monotonic_ns();
+        bot->next_move_ns = behavior >= BEHAVIOR_WANDER ? next_action(t, now, move_rate) : LLONG_MAX;
+        bot->next_shoot_ns = behavior >= BEHAVIOR_FIGHT ? next_action(t, now, shoot_rate) : LLONG_MAX;
+    }
+    
+    while (!atomic_load(&load_stop)) {
+        long long now = monotonic_ns();
+        
+        for (int i = 0; i < t->bot_count; i++) {
+            Bot *bot = &t->bots[i];
+            if (bot->fd < 0 || bot->my_index < 0) continue;
+            
+            if (now >= bot->next_move_ns) {
+                bot_send_input(t, bot, CMD_MOVE, now);
+                bot->next_move_ns = next_action(t, now, move_rate);
+            }
+            if (now >= bot->next_shoot_ns) {
+                bot_send_input(t, bot, CMD_SHOOT, now);
+                bot->next_shoot_ns = next_action(t, now, shoot_rate);
+            }
+            if (bot->out_len > 0 && bot_flush(bot) < 0) {
+                bot_close(t, bot);
+            }
+        }
+        
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, 2);
+        now = monotonic_ns();
+        for (int i = 0; i < n; i++) {
+            Bot *bot = events[i].data.ptr;
+            if (bot->fd < 0) continue;
+            if (bot_read(t, bot, now) < 0) {
+                bot_close(t, bot);
+            }
+        }
+    }
+    
+    for (int i = 0; i < t->bot_count; i++) {
+        if (t->bots[i].fd >= 0) close(t->bots[i].fd);
+        free(t->bots[i].in_buf);
+    }
+    close(epoll_fd);
+    
+    return NULL;
+}
+
+void merge_histogram(Histogram *out, Histogram *in) {
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        out->buckets[i] += atomic_load_explicit(&in->buckets[i], memory_order_relaxed);
+    }
+    out->count += atomic_load_explicit(&in->count, memory_order_relaxed);
+    out->sum += atomic_load_explicit(&in->sum, memory_order_relaxed);
+}
+
+unsigned long long stats_total(size_t offset) {
+    unsigned long long total = 0;
+    
+    for (int i = 0; i < load_thread_count; i++) {
+        total += atomic_load_explicit((_Atomic unsigned long long *)((char *)&load_threads[i].stats + offset),
+                                      memory_order_relaxed);
+    }
+    
+    return total;
+}
+
+void print_histogram(const char *label, size_t offset) {
+    Histogram h;
+    memset(&h, 0, sizeof(h));
+    for (int i = 0; i < load_thread_count; i++) {
+        merge_histogram(&h, (Histogram *)((char *)&load_threads[i].stats + offset));
+    }
+    
+    printf("%-18s n=%-9llu mean %8.2f  p50 %8.2f  p90 %8.2f  p99 %8.2f  p99.9 %8.2f ms\n", label,
+           (unsigned long long)h.count, h.count ? (double)h.sum / h.count / 1e6 : 0.0,
+           hist_quantile(&h, 0.5) / 1e6, hist_quantile(&h, 0.9) / 1e6,
+           hist_quantile(&h, 0.99) / 1e6, hist_quantile(&h, 0.999) / 1e6);
+}
+
+int main(int argc, char *argv[]) {
+    const char *host = "127.0.0.1";
+    int port = SERVER_PORT;
+    int clients = 100;
+    int duration = 10;
+    
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--host") == 0 && i + 1 < argc) {
+            host = argv[++i];
+        } else if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+            port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--clients") == 0 && i + 1 < argc) {
+            clients = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            load_thread_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--duration") == 0 && i + 1 < argc) {
+            duration = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--behavior") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "idle") == 0) behavior = BEHAVIOR_IDLE;
+            else if (strcmp(argv[i], "wander") == 0) behavior = BEHAVIOR_WANDER;
+            else if (strcmp(argv[i], "fight") == 0) behavior = BEHAVIOR_FIGHT;
+            else behavior = -1;
+        } else if (strcmp(argv[i], "--move-rate") == 0 && i + 1 < argc) {
+            move_rate = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--shoot-rate") == 0 && i + 1 < argc) {
+            shoot_rate = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--tick-rate") == 0 && i + 1 < argc) {
+            expected_rate = atoi(argv[++i]);
+        } else {
+            behavior = -1;
+            break;
+        }
+    }
+    
+    if (behavior < 0 || clients <= 0 || duration <= 0 || expected_rate <= 0 ||
+        load_thread_count < 1 || load_thread_count > MAX_LOAD_THREADS) {
+        fprintf(stderr, "Usage: %s [--host H] [--port N] [--clients N] [--threads N] [--duration S] "
+                "[--behavior idle|wander|fight] [--move-rate HZ] [--shoot-rate HZ] [--tick-rate HZ]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (load_thread_count > clients) load_thread_count = clients;
+    
+    struct hostent *he = gethostbyname(host);
+    if (!he) {
+        fprintf(stderr, "Unknown host %s\n", host);
+        exit(EXIT_FAILURE);
+    }
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    memcpy(&server_addr.sin_addr, he->h_addr_list[0], sizeof(server_addr.sin_addr));
+    
+    // 几千条连接会超过默认的1024个文件描述符
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    
+    int first = 0;
+    for (int i = 0; i < load_thread_count; i++) {
+        LoadThread *t = &load_threads[i];
+        t->index = i;
+        t->first_bot = first;
+        t->bot_count = clients / load_thread_count + (i < clients % load_thread_count);
+        t->seed = 12345 + i;
+        t->bots = calloc(t->bot_count, sizeof(Bot));
+        if (!t->bots) {
+            perror("Failed to allocate bots");
+            exit(EXIT_FAILURE);
+        }
+        first += t->bot_count;
+        
+        if (pthread_create(&t->thread, NULL, load_thread_main, t) != 0) {
+            perror("Failed to create load thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+    
+    unsigned long long last_frames = 0, last_inputs = 0, last_bytes = 0;
+    for (int s = 1; s <= duration; s++) {
+        sleep(1);
+        unsigned long long frames = stats_total(offsetof(LoadStats, frames));
+        unsigned long long inputs = stats_total(offsetof(LoadStats, inputs_sent));
+        unsigned long long bytes = stats_total(offsetof(LoadStats, bytes_in));
+        printf("[%3ds] in rooms %llu, frames/s %llu, inputs/s %llu, KB/s in %.1f, disconnects %llu\n", s,
+               stats_total(offsetof(LoadStats, connected)), frames - last_frames, inputs - last_inputs,
+               (bytes - last_bytes) / 1024.0, stats_total(offsetof(LoadStats, disconnects)));
+        last_frames = frames;
+        last_inputs = inputs;
+        last_bytes = bytes;
+    }
+    
+    atomic_store(&load_stop, 1);
+    for (int i = 0; i < load_thread_count; i++) {
+        pthread_join(load_threads[i].thread, NULL);
+    }
+    
+    printf("\n%d clients, %d s: %llu keyframes, %llu deltas, %.1f MB in, %llu inputs sent, %llu dropped\n",
+           clients, duration, stats_total(offsetof(LoadStats, keyframes)), stats_total(offsetof(LoadStats, deltas)),
+           stats_total(offsetof(LoadStats, bytes_in)) / 1048576.0, stats_total(offsetof(LoadStats, inputs_sent)),
+           stats_total(offsetof(LoadStats, inputs_dropped)));
+    print_histogram("frame interval", offsetof(LoadStats, interval));
+    print_histogram("interval jitter", offsetof(LoadStats, jitter));
+    print_histogram("input echo", offsetof(LoadStats, echo));
+    
+    return 0;
+}
@@ -0,0 +1,196 @@
+// 离线回放：按房间日志依次重做入场、离场、移动、射击和tick，逐tick核对状态哈希。
+// 直接包含服务器源码复用模拟代码，编译：gcc -O2 -o replay replay.c -lpthread
+#define TANKS_NO_MAIN
+#include "server.c"
+
+#include <sys/stat.h>
+
+int main(int argc, char *argv[]) {
+    const char *path = NULL;
+    int verbose = 0;
+    
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--verbose") == 0) {
+            verbose = 1;
+        } else if (!path) {
+            path = argv[i];
+        } else {
+            path = NULL;
+            break;
+        }
+    }
+    
+    if (!path) {
+        fprintf(stderr, "Usage: %s [--verbose] FILE.tlog\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror("Failed to open replay log");
+        exit(EXIT_FAILURE);
+    }
+    
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < 4) {
+        fprintf(stderr, "Replay log is empty\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        perror("Failed to map replay log");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+    
+    LogReader r = { data, st.st_size, 0, 0 };
+    const unsigned char *magic = read_bytes(&r, 4);
+    if (!magic || memcmp(magic, "TLOG", 4) != 0 || read_varint(&r) != REPLAY_VERSION) {
+        fprintf(stderr, "Not a replay log or unsupported version\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    int room_id = read_varint(&r);
+    map_width = read_varint(&r);
+    map_height = read_varint(&r);
+    players_per_room = read_varint(&r);
+    tick_rate = read_varint(&r);
+    fire_cooldown_ticks = read_varint(&r);
+    unsigned int first_tick = read_varint(&r);
+    const unsigned char *started = read_bytes(&r, 4);
+    if (r.error || tick_rate < MIN_TICK_RATE || tick_rate > MAX_TICK_RATE ||
+        map_width < MIN_MAP_SIZE || map_width > MAX_MAP_SIZE ||
+        map_height < MIN_MAP_SIZE || map_height > MAX_MAP_SIZE ||
+        players_per_room < 2 || players_per_room > MAX_PLAYERS) {
+        fprintf(stderr, "Corrupt replay header\n");
+        exit(EXIT_FAILURE);
+    }
+    time_t started_at = get_u32(started);
+    
+    Room *room = aligned_alloc(CACHE_LINE_SIZE, sizeof(Room));
+    if (!room) {
+        perror("Failed to allocate room");
+        exit(EXIT_FAILURE);
+    }
+    memset(room, 0, sizeof(Room));
+    room->id = room_id;
+    room->active = 1;
+    if (room_configure(room) < 0) {
+        perror("Failed to allocate room map");
+        exit(EXIT_FAILURE);
+    }
+    // 接管后重开的日志从旧进程的tick接着记
+    room->tick = first_tick;
+    
+    printf("Room %d, %dx%d, up to %d players, %d Hz, recorded %s", room_id, room->width, room->height,
+           room->max_players, tick_rate, ctime(&started_at));
+    
+    unsigned long long ticks = 0, events = 0, rounds = 0;
+    int mismatch = 0;
+    long long begin = monotonic_ns();
+    
+    // 服务器异常退出时日志尾部是映射窗口里没写到的零字节，读到REC_END就结束
+    while (!mismatch && r.pos < r.len) {
+        int type = r.data[r.pos++];
+        if (type == REC_END) break;
+        
+        unsigned int a = read_varint(&r);
+        unsigned int b = read_varint(&r);
+        if (r.error) break;
+        events++;
+        
+        switch (type) {
+            case REC_MAP:
+                room->map_seed = a;
+                init_map(room);
+                if (verbose) printf("tick %u: map seed %u\n", room->tick, a);
+                break;
+            case REC_JOIN: {
+                const unsigned char *name = read_bytes(&r, b);
+                if (!name || b >= USERNAME_MAX || (int)a != room->game.player_count ||
+                    room->game.player_count >= room->max_players) {
+                    mismatch = 1;
+                    break;
+                }
+                char username[USERNAME_MAX];
+                memcpy(username, name, b);
+                username[b] = '\0';
+                player_join(room, -1, username);
+                if (verbose) printf("tick %u: %s joined as player %u\n", room->tick, username, a + 1);
+                break;
+            }
+            case REC_LEAVE:
+                if ((int)a >= room->game.player_count) {
+                    mismatch = 1;
+                    break;
+                }
+                if (verbose) printf("tick %u: %s left\n", room->tick, room->game.players[a].username);
+                player_leave(room, a);
+                break;
+            case REC_MOVE:
+                if ((int)a >= room->game.player_count || b > LEFT) {
+                    mismatch = 1;
+                    break;
+                }
+                move_tank(room, a, b);
+                break;
+            case REC_SHOOT:
+                if ((int)a >= room->game.player_count) {
+                    mismatch = 1;
+                    break;
+                }
+                shoot(room, a, room->tick - b);
+                break;
+            case REC_TICK: {
+                const unsigned char *hash = read_bytes(&r, 8);
+                if (!hash) break;
+                
+                room_advance(room);
+                ticks++;
+                
+                unsigned long long expected = ((unsigned long long)get_u32(hash) << 32) | get_u32(hash + 4);
+                unsigned long long actual = room_state_hash(room);
+                if (room->tick != a || actual != expected) {
+                    fprintf(stderr, "State diverged at tick %u (log tick %u): hash %016llx, expected %016llx\n",
+                            room->tick, a, actual, expected);
+                    mismatch = 1;
+                }
+                break;
+            }
+            case REC_START:
+                if (!room->game.game_started || room->game.player_count != (int)a) mismatch = 1;
+                if (verbose) printf("tick %u: game started with %u players\n", room->tick, a);
+                break;
+            case REC_OVER:
+                if (!room->game.game_over || room->game.winner_id != (int)a) mismatch = 1;
+                if (verbose) printf("tick %u: game over, winner %u\n", room->tick, a);
+                break;
+            case REC_ROUND:
+                room_new_round(room);
+                rounds++;
+                break;
+            default:
+                fprintf(stderr, "Unknown record type %d at offset %zu\n", type, r.pos - 1);
+                mismatch = 1;
+                break;
+        }
+        
+        if (mismatch && type != REC_TICK) {
+            fprintf(stderr, "Record '%c' at tick %u does not match the replayed state\n", type, room->tick);
+        }
+    }
+    
+    if (r.error) {
+        fprintf(stderr, "Replay log truncated at offset %zu\n", r.pos);
+    }
+    
+    double elapsed = (monotonic_ns() - begin) / 1e9;
+    double recorded = (double)ticks / tick_rate;
+    printf("Replayed %llu events, %llu ticks, %llu rounds in %.3f ms (%.0fx real time)\n",
+           events, ticks, rounds, elapsed * 1e3, elapsed > 0 ? recorded / elapsed : 0.0);
+    // 记录写到一半就断了说明文件损坏；崩溃留下的零字节尾巴按REC_END正常结束，不会走到这里
+    printf("%s\n", mismatch ? "MISMATCH" : r.error ? "TRUNCATED" : "OK");
+    
+    return mismatch || r.error ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,21 +9,102 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
 #include <arpa/inet.h>
 #include <time.h>
+#include <stddef.h>
 #include <signal.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <semaphore.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
-#define MAX_PLAYERS 4
-#define MAX_ROOMS 10
-#define MAP_WIDTH 20
-#define MAP_HEIGHT 20
-#define MAX_BULLETS 32
+#define MAX_PLAYERS 64
+#define DEFAULT_PLAYERS 4
+#define DEFAULT_MAX_ROOMS 4096
+#define ROOM_ID_LIMIT 65536
+#define ROOM_CHUNK_SIZE 64
+#define ROOM_FREELIST_MAX 16
+#define ROOM_RETIRE_SECONDS 5
+#define ROOM_RELEASE 0
+#define ROOM_RUNNING 1
+#define ROOM_PARKED 2
+#define DEFAULT_TICK_RATE 20
+#define MIN_TICK_RATE 10
+#define MAX_TICK_RATE 120
+#define MAX_CATCHUP_TICKS 3
+#define MAX_REWIND_MS 250
+#define FIRE_COOLDOWN_MS 250
+#define DEFAULT_INPUT_RATE 30
+#define INPUT_BURST 10
+#define BULLET_SPEED 20
+#define INPUT_QUEUE_SIZE 256
+#define WHEEL_SLOTS 256
+#define MAX_TICK_WORKERS 64
+#define MAX_REACTORS 64
+#define DEFAULT_BACKLOG 1024
+#define DEFAULT_MAP_SIZE 20
+#define MIN_MAP_SIZE 10
+#define MAX_MAP_SIZE 256
+#define MAP_CHUNK_SHIFT 4
+#define MAP_CHUNK_SIZE (1 << MAP_CHUNK_SHIFT)
+#define MAX_MAP_CHUNKS ((MAX_MAP_SIZE / MAP_CHUNK_SIZE) * (MAX_MAP_SIZE / MAP_CHUNK_SIZE))
+#define CHUNK_PACKED_SIZE (MAP_CHUNK_SIZE * MAP_CHUNK_SIZE / 4)
+#define DEFAULT_VIEW_RADIUS 0
+#define MAX_BULLETS 64
+#define CACHE_LINE_SIZE 64
 #define MAX_EVENTS 64
 #define BUFFER_SIZE 4096
 #define SERVER_PORT 8888
 #define USERNAME_MAX 20
-#define THREAD_POOL_SIZE 16
+#define DEFAULT_POOL_THREADS 2
+#define MAX_POOL_THREADS 64
+#define WORK_QUEUE_SIZE 1024
+#define SNAPSHOT_HISTORY 32
+#define MAP_LOG_SIZE 128
+#define KEYFRAME_INTERVAL_MS 5000
+#define MAX_CONNECTIONS_LIMIT (1 << 20)
+#define CONNECTION_SPARE 1024
+#define OUT_QUEUE_FRAMES 64
+#define IN_BUFFER_SIZE 1024
+#define MAX_CLIENT_MESSAGE 256
+#define FRAME_HEADER_SIZE 2
+#define MAX_FRAME_PAYLOAD 65535
+#define FRAME_POOL_MAX 1024
+#define MAX_SPECTATORS 16
+#define SPECTATOR_SLOT_BASE 128
+#define DEFAULT_ADMIN_PORT 0
+#define MAX_METRIC_THREADS 256
+#define HIST_SUB_BITS 3
+#define HIST_BUCKETS (40 << HIST_SUB_BITS)
+#define REPLAY_VERSION 3
+#define MAP_CACHE_SIZE 16
+#define MAP_GENERATE_ATTEMPTS 16
+#define REPLAY_WINDOW (1 << 20)
+#define REPLAY_RECORD_MAX 64
+#define HASH_SEED 14695981039346656037ULL
+#define UDP_MAX_PAYLOAD 1200
+#define UDP_MAX_DATAGRAM 1500
+#define UDP_SERVER_HEADER 12
+#define UDP_CLIENT_HEADER 25
+#define UDP_ACK_WINDOW 32
+#define UDP_INPUT_REDUNDANCY 8
+#define SHUTDOWN_DRAIN_MS 2000
+#define HANDOFF_VERSION 1
+#define HANDOFF_CHUNK 32768
+#define HANDOFF_FDS_PER_MSG 200
+#define HANDOFF_TIMEOUT_MS 10000
 
 #define EMPTY 0
 #define WALL 1
@@ -32,6 +114,27 @@
 #define TANK_P3 5
 #define TANK_P4 6
 
+#define INPUT_MOVE 0
+#define INPUT_SHOOT 1
+#define INPUT_ACK 2
+
+
+// 回放日志的记录类型；类型字节后面跟两个变长整数，J和T另有附加数据
+#define REC_END 0
+#define REC_MAP 'P'
+#define REC_JOIN 'J'
+#define REC_LEAVE 'L'
+#define REC_MOVE 'M'
+#define REC_SHOOT 'S'
+#define REC_TICK 'T'
+#define REC_START 'G'
+#define REC_OVER 'O'
+#define REC_ROUND 'N'
+
+#define FRAME_CONTROL 0
+#define FRAME_DELTA 1
+#define FRAME_KEYFRAME 2
+
 #define UP 0
 #define RIGHT 1
 #define DOWN 2
@@ -44,913 +147,5359 @@
 #define CMD_GAME_START 'G'
 #define CMD_GAME_OVER 'O'
 #define CMD_ROOM_ASSIGN 'R'
+#define CMD_DELTA 'D'
+#define CMD_ACK 'A'
+#define CMD_SPECTATE 'W'
+#define CMD_TOKEN 'K'
+
+// 视野是地图块坐标上的矩形 [x0,x1)×[y0,y1)
+typedef struct {
+    unsigned char x0, y0, x1, y1;
+} ViewWindow;
+
+// 每个观看者（玩家或观战者）的增量基线状态；增量帧要知道基线那一tick发给它的视野
+typedef struct {
+    unsigned int acked_tick;
+    unsigned int baseline_tick;
+    int need_keyframe;
+    unsigned int window_ticks[SNAPSHOT_HISTORY];
+    ViewWindow windows[SNAPSHOT_HISTORY];
+} ViewState;
 
 typedef struct {
     int fd;
-    int x, y;
-    int direction;
-    int alive;
-    int id;
+    unsigned char x, y;
+    unsigned char direction;
+    unsigned char alive;
+    unsigned char id;
+    // 最近一条已处理输入的序号，随快照下发供客户端对账预测
+    unsigned int input_seq;
+    unsigned int next_fire_tick;
     char username[USERNAME_MAX];
 } Player;
 
 typedef struct {
-    int active;
-    int x, y;
-    int direction;
-    int owner_id;
-} Bullet;
+    int fd;
+    ViewState view;
+} Spectator;
+
+typedef unsigned long long BulletMask;
 
+#define BULLET_BIT(i) (1ULL << (i))
+#define BULLET_SLOTS_MASK (~0ULL >> (64 - MAX_BULLETS))
+
+_Static_assert(MAX_BULLETS <= 64 && MAX_BULLETS % 32 == 0, "MAX_BULLETS must be 32 or 64");
+
+// 子弹按字段分开存放，active的第i位表示槽位i在用；一个房间的全部子弹只占几条缓存行
 typedef struct {
-    int map[MAP_HEIGHT][MAP_WIDTH];
-    Player players[MAX_PLAYERS];
-    Bullet bullets[MAX_BULLETS];
+    BulletMask active;
+    unsigned char x[MAX_BULLETS];
+    unsigned char y[MAX_BULLETS];
+    unsigned char direction[MAX_BULLETS];
+    unsigned char owner_id[MAX_BULLETS];
+} BulletSet;
+
+typedef unsigned long long PlayerMask;
+
+#define PLAYER_BIT(i) (1ULL << (i))
+
+// 按16x16分块存放的格子层：同一块内的格子在内存中连续，局部查询只触及少数几块
+typedef struct {
+    int width, height;
+    int chunks_x, chunks_y;
+    size_t capacity;
+    unsigned char *cells;
+} Grid;
+
+#define GRID_CHUNK(g, x, y) (((y) >> MAP_CHUNK_SHIFT) * (g)->chunks_x + ((x) >> MAP_CHUNK_SHIFT))
+#define GRID_INDEX(g, x, y) ((GRID_CHUNK(g, x, y) << (2 * MAP_CHUNK_SHIFT)) | \
+                             (((y) & (MAP_CHUNK_SIZE - 1)) << MAP_CHUNK_SHIFT) | ((x) & (MAP_CHUNK_SIZE - 1)))
+#define GRID_CELL(g, x, y) ((g)->cells[GRID_INDEX(g, x, y)])
+
+typedef struct {
+    unsigned char x, y;
+    unsigned char direction;
+} SpawnPoint;
+
+typedef struct {
+    BulletSet bullets;
     int player_count;
     int game_started;
     int game_over;
     int winner_id;
+    Player players[MAX_PLAYERS];
 } GameState;
 
 typedef struct {
+    unsigned char x, y;
+    unsigned char direction;
+    unsigned char alive;
+    unsigned int input_seq;
+} TankState;
+
+typedef struct {
+    unsigned int tick;
+    unsigned int bullet_steps;
+    unsigned int roster_version;
+    unsigned int map_version;
+    unsigned int map_log_count;
+    int valid;
+    // 指向房间外的快照缓冲区，按房间人数上限分配
+    TankState *tanks;
+    BulletSet bullets;
+} Snapshot;
+
+typedef struct {
+    unsigned int tick;
+    unsigned char x, y;
+    unsigned char cell;
+} MapChange;
+
+typedef struct {
+    int fd;
+    unsigned long long session;
+    int type;
+    unsigned int arg;
+    long long queued_ns;
+    // 客户端给输入的序号，以及发出时它看到的快照tick（0表示没带）
+    unsigned int seq;
+    unsigned int seen_tick;
+} InputCommand;
+
+typedef struct {
+    _Atomic unsigned int sequence;
+    InputCommand cmd;
+} InputSlot;
+
+// 有界多生产者单消费者队列：网络线程无锁入队，房间tick开始时按顺序取出，
+// 每个槽位的序号表明它当前可写还是可读
+typedef struct {
+    InputSlot slots[INPUT_QUEUE_SIZE];
+    _Atomic unsigned int enqueue_pos __attribute__((aligned(CACHE_LINE_SIZE)));
+    _Atomic unsigned int dropped;
+    unsigned int dequeue_pos __attribute__((aligned(CACHE_LINE_SIZE)));
+} InputQueue;
+
+// PCG32：每个房间一份，换图时从中取种子；地图生成也用它，不碰libc的全局随机数状态
+typedef struct {
+    unsigned long long state;
+    unsigned long long inc;
+} Rng;
+
+// 顺序读取变长整数和字节串，越界时置error；回放工具和热重启接管共用
+typedef struct {
+    const unsigned char *data;
+    size_t len;
+    size_t pos;
+    int error;
+} LogReader;
+
+// 房间的回放日志：只追加，写进文件的一段内存映射窗口里，写满了就往后滑
+typedef struct {
+    int fd;
+    unsigned char *window;
+    off_t window_offset;
+    size_t pos;
+} ReplayLog;
+
+// 房间按缓存行对齐分配，相邻房间的锁和热数据不会落在同一条缓存行上。
+// 每个tick都要读写的字段排在前面，连在一起；快照、观战者、回放等冷数据放在后面或房间外
+typedef struct Room {
+    pthread_mutex_t mutex;
     int id;
+    int active;
+    unsigned int tick;
+    unsigned int bullet_steps;
+    int bullet_accum;
+    int width, height;
+    int max_players;
+    int view_radius;
     GameState game;
+    Grid map;
+    // 每格上存活坦克的玩家下标+1，0表示没有坦克；移动、出生、死亡时增量维护
+    Grid tank_at;
+    unsigned int roster_version;
+    unsigned int map_version;
+    unsigned int map_log_count;
+    unsigned int last_keyframe_tick;
+    unsigned int last_update_tick;
+    unsigned int last_change_tick;
+    // 当前地图的哈希，换图时整张重算，之后随每条地图变更累加
+    unsigned long long map_hash;
+    int map_seed;
+    Rng rng;
+    // 每个地图块内有哪些存活坦克
+    PlayerMask chunk_tanks[MAX_MAP_CHUNKS];
+    int worker;
+    long long next_tick_ns;
+    struct Room *sched_next;
+    // 不在对局中的房间不占时间轮，置位后由room_wake重新调度
+    _Atomic int parked;
+    // 快照环和每个玩家的增量基线（下标同game.players）在房间外按人数上限分配，见room_history_resize
+    Snapshot *snapshots;
+    ViewState *views;
+    int history_players;
+    MapChange map_log[MAP_LOG_SIZE];
+    Spectator spectators[MAX_SPECTATORS];
+    int spectator_count;
+    SpawnPoint spawns[MAX_PLAYERS];
+    ReplayLog *replay;
+    int replay_pending;              // 接管过来的房间等下一局再开新日志
+    struct Room *open_prev;
+    struct Room *open_next;
+    int in_open_list;
+    struct Room *next_free;
+    time_t retired_at;
+    unsigned long long tick_overruns;
+    unsigned long long ticks_skipped;
+    // 只由持有房间锁的tick线程写，管理端口读取
+    _Atomic unsigned long long bytes_out;
+    _Atomic unsigned long long frames_out;
+    InputQueue inputs;
+} __attribute__((aligned(CACHE_LINE_SIZE))) Room;
+
+// 房间池：房间号通过分块表映射到房间对象，表只增长不搬移，查找无需加锁；
+// 空房间回收到空闲链表重用，超出上限且闲置足够久的先挂到limbo上，等无锁查找不可能再拿着它时才释放；
+// 有空位的房间串在open链表上，匹配时直接取表头
+typedef struct {
+    pthread_mutex_t mutex;
+    Room **chunks[ROOM_ID_LIMIT / ROOM_CHUNK_SIZE];
+    int next_id;
+    int *free_ids;
+    int free_id_count;
+    Room *free_rooms;
+    int free_room_count;
+    Room *limbo;
+    unsigned long long limbo_quiescent[MAX_REACTORS + MAX_TICK_WORKERS];
+    Room *open_head;
+    Room *open_tail;
+    int active_count;
+    int max_rooms;
+} RoomPool;
+
+// 每个tick worker有一个毫秒粒度的时间轮，到期的房间进入本地运行队列；
+// 自己的队列空了就去别的worker队列尾部偷房间来跑
+typedef struct {
+    int index;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    Room *wheel[WHEEL_SLOTS];
+    long long wheel_pos;
+    Room *run_head;
+    Room *run_tail;
+    int run_count;
+    // 静默计数：奇数表示线程在跑、手里可能拿着房间指针，偶数表示睡着；见room_pool_trim
+    _Atomic unsigned long long quiescent;
+} TickWorker;
+
+// 每个reactor有自己的epoll和SO_REUSEPORT监听套接字，由内核把新连接分摊到各个reactor；
+// 连接一旦建立就只由接受它的reactor读写
+typedef struct {
+    int index;
     pthread_t thread;
+    int listen_fd;
+    int epoll_fd;
+    // 同TickWorker.quiescent
+    _Atomic unsigned long long quiescent;
+} Reactor;
+
+// 编码好的一帧（含长度前缀），引用计数归零后回到帧池；
+// 一帧只编码一次，所有接收者的发送队列引用同一块缓冲区；
+// 帧池里只放标准大小（BUFFER_SIZE）的缓冲区，大地图的关键帧单独分配
+typedef struct FrameBuf {
+    _Atomic int refs;
+    int len;
+    int capacity;
+    struct FrameBuf *next_free;
+    unsigned char data[];
+} FrameBuf;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    FrameBuf *free_list;
+    int free_count;
+} FramePool;
+
+// 旁路订阅房间的帧流（比如录像），每帧只回调一次；需要异步保存的调用frame_ref自行持有
+typedef void (*FrameTap)(Room *room, FrameBuf *frame, int kind);
+
+typedef struct {
+    FrameBuf *frame;
+    int kind;
+    long long queued_ns;
+} OutFrame;
+
+// 每个连接的发送队列，房间线程只负责入队，写不完的部分由epoll在EPOLLOUT时继续发送；
+// 接收缓冲区只由epoll线程访问，用来拼接被拆开或合并的消息
+typedef struct {
     int active;
+    int closing;
+    int epoll_fd;
     pthread_mutex_t mutex;
-    int map_seed;
-} Room;
+    OutFrame queue[OUT_QUEUE_FRAMES];
+    int head;
+    int count;
+    int head_sent;
+    unsigned int dropped_frames;
+    unsigned char in_buf[IN_BUFFER_SIZE];
+    int in_len;
+    // UDP通道：64位随机令牌随房间分配经TCP下发，客户端带令牌发来数据报后绑定地址，
+    // 之后只有序号更新的数据报才能改绑；
+    // 两个方向各自编号，对方最近收到的序号和之前32个的收到情况随每个数据报捎回
+    unsigned long long udp_token;
+    int udp_bound;
+    struct sockaddr_in udp_addr;
+    unsigned int udp_send_seq;
+    unsigned int udp_recv_seq;
+    unsigned int udp_recv_bits;
+    unsigned int udp_input_next;
+    unsigned int udp_sent_seq[UDP_ACK_WINDOW];
+    unsigned int udp_sent_tick[UDP_ACK_WINDOW];
+    unsigned int udp_acked_tick;
+    // 输入令牌桶，以千分之一个令牌为单位
+    long long input_tokens;
+    long long input_refill_ns;
+    unsigned long long inputs_limited;
+} Connection;
 
+// UDP令牌 -> fd 的开放寻址表，线性探测，删除时把同一簇后面的项往前挪；
+// 只在连接建立和关闭时改动，容量是连接表的两倍以上
 typedef struct {
-    pthread_t threads[THREAD_POOL_SIZE];
-    pthread_mutex_t queue_mutex;
-    pthread_cond_t queue_cond;
-    int shutdown;
-} ThreadPool;
+    pthread_mutex_t mutex;
+    unsigned long long *tokens;
+    int *fds;
+    unsigned int mask;
+} UdpTokenTable;
 
 typedef struct {
     void (*function)(void *);
     void *arg;
 } WorkItem;
 
-Room rooms[MAX_ROOMS];
-int server_fd;
-int epoll_fd;
+typedef struct {
+    _Atomic unsigned int sequence;
+    WorkItem work;
+} WorkSlot;
+
+// 后台线程池：预分配槽位的有界无锁环形队列，空闲线程睡在信号量上；
+// 用来做不适合放在tick里的活，比如提前生成下一局的地图
+typedef struct {
+    pthread_t threads[MAX_POOL_THREADS];
+    int thread_count;
+    WorkSlot slots[WORK_QUEUE_SIZE];
+    _Atomic unsigned int enqueue_pos;
+    _Atomic unsigned int dequeue_pos;
+    sem_t available;
+    _Atomic int shutdown;
+} ThreadPool;
+
+typedef struct {
+    _Atomic unsigned long long buckets[HIST_BUCKETS];
+    _Atomic unsigned long long count;
+    _Atomic unsigned long long sum;
+} Histogram;
+
+// 每个线程一份计数器和直方图，各自独占缓存行，热路径上不加锁也不做原子加；
+// 管理端口抓取时把所有线程的数据加起来
+typedef struct {
+    char name[32];
+    Histogram tick_duration;
+    Histogram encode_duration;
+    Histogram send_latency;
+    Histogram input_latency;
+    _Atomic unsigned long long ticks;
+    _Atomic unsigned long long inputs_applied;
+    _Atomic unsigned long long updates_skipped;
+    _Atomic unsigned long long room_wakeups;
+    _Atomic unsigned long long tcp_bytes_out;
+    _Atomic unsigned long long udp_bytes_out;
+    _Atomic unsigned long long udp_packets_out;
+    _Atomic unsigned long long udp_packets_in;
+} __attribute__((aligned(CACHE_LINE_SIZE))) ThreadMetrics;
+
+RoomPool room_pool;
+TickWorker tick_workers[MAX_TICK_WORKERS];
+int tick_worker_count;
+int tick_rate = DEFAULT_TICK_RATE;
+long long tick_interval_ns;
+unsigned int keyframe_interval_ticks;
+unsigned int fire_cooldown_ticks;
+int input_rate = DEFAULT_INPUT_RATE;
+int map_width = DEFAULT_MAP_SIZE;
+int map_height = DEFAULT_MAP_SIZE;
+int players_per_room = DEFAULT_PLAYERS;
+int view_radius = DEFAULT_VIEW_RADIUS;
+// 连接表和会话表都以fd为下标，启动时由init_connections按描述符上限分配
+int max_connections;
+Connection *connections;
+// fd -> 会话：高32位是代数，中间24位是房间号+1，低8位是槽位；0表示不在房间里
+_Atomic unsigned long long *sessions;
+Reactor reactors[MAX_REACTORS];
+int reactor_count;
+int udp_fd = -1;
+UdpTokenTable udp_tokens = { PTHREAD_MUTEX_INITIALIZER, NULL, NULL, 0 };
 ThreadPool thread_pool;
+FramePool frame_pool = { PTHREAD_MUTEX_INITIALIZER, NULL, 0 };
+FrameTap frame_tap = NULL;
+ThreadMetrics *metric_threads[MAX_METRIC_THREADS];
+_Atomic int metric_thread_count;
+__thread ThreadMetrics *thread_metrics;
+int admin_port = DEFAULT_ADMIN_PORT;
+int admin_fd = -1;
+const char *replay_dir = NULL;
+// 热重启：handoff_fd是监听在handoff_path上的Unix套接字，新进程连上来就把连接和房间交给它
+const char *handoff_path = NULL;
+int handoff_fd = -1;
+// 信号经signalfd交给reactor 0处理；其余reactor和tick worker收到停止标志后退出线程
+int signal_fd = -1;
+int reactor_wakeup_fd = -1;
+_Atomic int reactors_stopping;
+_Atomic int tick_workers_stopping;
+_Atomic unsigned int replay_serial;
+int debug_logging = 0;
 
-typedef struct WorkNode {
-    WorkItem work;
-    struct WorkNode *next;
-} WorkNode;
+// 逐事件的日志只在 --debug 时输出，高负载下stdout本身就是瓶颈
+#define debug_log(...) do { if (debug_logging) printf(__VA_ARGS__); } while (0)
 
-WorkNode *work_queue_head = NULL;
-WorkNode *work_queue_tail = NULL;
-int work_queue_size = 0;
+#define METRIC_ADD(field, value) do { if (thread_metrics) metric_add(&thread_metrics->field, (value)); } while (0)
+#define METRIC_TIME(hist, ns) do { if (thread_metrics) hist_record(&thread_metrics->hist, (ns)); } while (0)
 
-void init_room(int room_id);
-void *room_thread(void *arg);
+void init_room(Room *room);
+void replay_event(Room *room, int type, unsigned int a, unsigned int b);
+void map_installed(Room *room);
+int put_varint(unsigned char *buffer, unsigned int value);
+int room_tick(Room *room);
+long long monotonic_ns();
+void metric_add(_Atomic unsigned long long *counter, unsigned long long value);
+void hist_record(Histogram *h, long long ns);
+void schedule_room(Room *room);
+void start_tick_workers();
+void stop_tick_workers();
+void stop_reactors();
+void handoff_serve();
 void update_bullets(Room *room);
+void eliminate_player(Room *room, int index);
+void advance_position(int *x, int *y, int direction, int steps);
+void place_at_spawn(Room *room, Player *p, int slot);
+void rebuild_occupancy(Room *room);
 void send_game_update(Room *room);
 void send_game_start(Room *room);
 void send_game_over(Room *room);
-int find_available_room();
+void record_snapshot(Room *room);
+void room_advance(Room *room);
+int room_new_round(Room *room);
+void replay_tick(Room *room);
+void replay_join(Room *room, int slot, const char *username);
+unsigned long long hash_bytes(unsigned long long h, const void *data, size_t len);
+Room *find_available_room();
+Room *get_room(int room_id);
+void room_release(Room *room);
+void session_bind(int client_fd, int room_id, int slot);
+void session_unbind(int client_fd);
 void remove_player_from_room(int client_fd);
 Room *find_room_for_client(int client_fd);
-void handle_client_message(int client_fd, unsigned char *buffer, int len);
-void init_thread_pool();
-void add_work(void (*function)(void *), void *arg);
+void apply_inputs(Room *room);
+int input_queue_empty(InputQueue *q);
+void shoot(Room *room, int player_id, unsigned int seen_tick);
+void move_tank(Room *room, int player_id, int direction);
+int handle_client_message(int client_fd, const unsigned char *buffer, int len);
+void put_u32(unsigned char *buffer, unsigned int value);
+unsigned int get_u32(const unsigned char *buffer);
+void init_thread_pool(int count);
+int add_work(void (*function)(void *), void *arg);
 void *thread_pool_worker(void *arg);
-void client_handler(void *arg);
+void request_map_fill();
+void close_client(int client_fd);
+int conn_send(int fd, const unsigned char *data, int len, int kind);
+int conn_send_frame(int fd, FrameBuf *frame, int kind);
+FrameBuf *frame_alloc(int capacity);
+void frame_unref(FrameBuf *frame);
+void room_broadcast(Room *room, FrameBuf *frame, int kind);
 
-void init_thread_pool() {
-    pthread_mutex_init(&thread_pool.queue_mutex, NULL);
-    pthread_cond_init(&thread_pool.queue_cond, NULL);
-    thread_pool.shutdown = 0;
+void init_thread_pool(int count) {
+    if (count < 1) count = 1;
+    if (count > MAX_POOL_THREADS) count = MAX_POOL_THREADS;
+    
+    for (int i = 0; i < WORK_QUEUE_SIZE; i++) {
+        atomic_init(&thread_pool.slots[i].sequence, i);
+    }
+    atomic_init(&thread_pool.enqueue_pos, 0);
+    atomic_init(&thread_pool.dequeue_pos, 0);
+    atomic_init(&thread_pool.shutdown, 0);
+    sem_init(&thread_pool.available, 0, 0);
+    thread_pool.thread_count = count;
 
-    for (int i = 0; i < THREAD_POOL_SIZE; i++) {
+    for (int i = 0; i < count; i++) {
         if (pthread_create(&thread_pool.threads[i], NULL, thread_pool_worker, NULL) != 0) {
             perror("Failed to create thread");
             exit(EXIT_FAILURE);
         }
     }
 
-    printf("Thread pool initialized with %d threads\n", THREAD_POOL_SIZE);
+    printf("Thread pool initialized with %d threads\n", count);
 }
 
-void add_work(void (*function)(void *), void *arg) {
-    WorkNode *node = malloc(sizeof(WorkNode));
-    if (!node) {
-        perror("Failed to allocate work node");
-        return;
+// 队列满时返回-1，由调用者决定是否改为同步执行
+int add_work(void (*function)(void *), void *arg) {
+    unsigned int pos = atomic_load_explicit(&thread_pool.enqueue_pos, memory_order_relaxed);
+    WorkSlot *slot;
+    
+    while (1) {
+        slot = &thread_pool.slots[pos % WORK_QUEUE_SIZE];
+        unsigned int sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        int diff = (int)(sequence - pos);
+        
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&thread_pool.enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return -1;
+        } else {
+            pos = atomic_load_explicit(&thread_pool.enqueue_pos, memory_order_relaxed);
+        }
     }
     
-    node->work.function = function;
-    node->work.arg = arg;
-    node->next = NULL;
+    slot->work.function = function;
+    slot->work.arg = arg;
+    atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
     
-    pthread_mutex_lock(&thread_pool.queue_mutex);
+    sem_post(&thread_pool.available);
+    return 0;
+}
+
+int take_work(WorkItem *work) {
+    unsigned int pos = atomic_load_explicit(&thread_pool.dequeue_pos, memory_order_relaxed);
+    WorkSlot *slot;
     
-    if (work_queue_tail) {
-        work_queue_tail->next = node;
-    } else {
-        work_queue_head = node;
+    while (1) {
+        slot = &thread_pool.slots[pos % WORK_QUEUE_SIZE];
+        unsigned int sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        int diff = (int)(sequence - (pos + 1));
+        
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&thread_pool.dequeue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return 0;
+        } else {
+            pos = atomic_load_explicit(&thread_pool.dequeue_pos, memory_order_relaxed);
+        }
     }
     
-    work_queue_tail = node;
-    work_queue_size++;
+    *work = slot->work;
+    atomic_store_explicit(&slot->sequence, pos + WORK_QUEUE_SIZE, memory_order_release);
     
-    pthread_cond_signal(&thread_pool.queue_cond);
-    pthread_mutex_unlock(&thread_pool.queue_mutex);
+    return 1;
 }
 
 void *thread_pool_worker(void *arg) {
+    (void)arg;
+    WorkItem work;
+    
     while (1) {
-        pthread_mutex_lock(&thread_pool.queue_mutex);
-        
-        while (!work_queue_head && !thread_pool.shutdown) {
-            pthread_cond_wait(&thread_pool.queue_cond, &thread_pool.queue_mutex);
+        while (sem_wait(&thread_pool.available) != 0 && errno == EINTR) {
         }
         
-        if (thread_pool.shutdown) {
-            pthread_mutex_unlock(&thread_pool.queue_mutex);
+        if (atomic_load(&thread_pool.shutdown)) {
             pthread_exit(NULL);
         }
         
-        WorkItem work = work_queue_head->work;
-        WorkNode *temp = work_queue_head;
-        work_queue_head = work_queue_head->next;
-        if (!work_queue_head) {
-            work_queue_tail = NULL;
+        if (take_work(&work)) {
+            work.function(work.arg);
         }
-        work_queue_size--;
-        
-        pthread_mutex_unlock(&thread_pool.queue_mutex);
-        
-        free(temp);
-        work.function(work.arg);
     }
     
     return NULL;
 }
 
 void shutdown_thread_pool() {
-    pthread_mutex_lock(&thread_pool.queue_mutex);
-    thread_pool.shutdown = 1;
-    pthread_cond_broadcast(&thread_pool.queue_cond);
-    pthread_mutex_unlock(&thread_pool.queue_mutex);
+    atomic_store(&thread_pool.shutdown, 1);
     
-    for (int i = 0; i < THREAD_POOL_SIZE; i++) {
-        pthread_join(thread_pool.threads[i], NULL);
+    for (int i = 0; i < thread_pool.thread_count; i++) {
+        sem_post(&thread_pool.available);
     }
     
-    WorkNode *current = work_queue_head;
-    while (current) {
-        WorkNode *temp = current;
-        current = current->next;
-        free(temp);
+    for (int i = 0; i < thread_pool.thread_count; i++) {
+        pthread_join(thread_pool.threads[i], NULL);
     }
     
-    pthread_mutex_destroy(&thread_pool.queue_mutex);
-    pthread_cond_destroy(&thread_pool.queue_cond);
+    sem_destroy(&thread_pool.available);
 }
 
-void init_map(Room *room) {
-    srand(room->map_seed);
-    
-    memset(room->game.map, EMPTY, sizeof(room->game.map));
+int grid_resize(Grid *g, int width, int height) {
+    int chunks_x = (width + MAP_CHUNK_SIZE - 1) >> MAP_CHUNK_SHIFT;
+    int chunks_y = (height + MAP_CHUNK_SIZE - 1) >> MAP_CHUNK_SHIFT;
+    size_t size = ((size_t)chunks_x * chunks_y) << (2 * MAP_CHUNK_SHIFT);
     
-    for (int i = 0; i < MAP_WIDTH; i++) {
-        room->game.map[0][i] = WALL;
-        room->game.map[MAP_HEIGHT-1][i] = WALL;
+    if (size > g->capacity) {
+        unsigned char *cells = realloc(g->cells, size);
+        if (!cells) return -1;
+        g->cells = cells;
+        g->capacity = size;
     }
-    for (int i = 0; i < MAP_HEIGHT; i++) {
-        room->game.map[i][0] = WALL;
-        room->game.map[i][MAP_WIDTH-1] = WALL;
+    
+    g->width = width;
+    g->height = height;
+    g->chunks_x = chunks_x;
+    g->chunks_y = chunks_y;
+    memset(g->cells, 0, g->capacity);
+    
+    return 0;
+}
+
+void grid_free(Grid *g) {
+    free(g->cells);
+    memset(g, 0, sizeof(*g));
+}
+
+// 每圈出生点之外最多能放的玩家数：四角各一个，再加上距边界两格那一圈除去四角的格子
+int spawn_capacity(int width, int height) {
+    return 4 + 2 * (width - 6) + 2 * (height - 6);
+}
+
+// 前四个出生点在四角，其余沿距边界两格的一圈均匀分布，朝向地图内侧
+void compute_spawns(int width, int height, int count, SpawnPoint *spawns) {
+    SpawnPoint corners[4] = {
+        { 2, 2, RIGHT },
+        { width - 3, 2, LEFT },
+        { 2, height - 3, RIGHT },
+        { width - 3, height - 3, LEFT },
+    };
+    
+    for (int i = 0; i < count && i < 4; i++) {
+        spawns[i] = corners[i];
     }
     
-    for (int i = 0; i < (MAP_WIDTH * MAP_HEIGHT) / 5; i++) {
-        int x = rand() % (MAP_WIDTH - 2) + 1;
-        int y = rand() % (MAP_HEIGHT - 2) + 1;
+    int ring = spawn_capacity(width, height) - 4;
+    int extra = count - 4;
+    for (int k = 0; k < extra; k++) {
+        int t = (k * ring + ring / 2) / extra;
+        SpawnPoint *sp = &spawns[4 + k];
         
-        if ((x < 3 && y < 3) || 
-            (x < 3 && y > MAP_HEIGHT - 4) || 
-            (x > MAP_WIDTH - 4 && y < 3) || 
-            (x > MAP_WIDTH - 4 && y > MAP_HEIGHT - 4)) {
-            continue;
+        if (t < width - 6) {
+            sp->x = 3 + t; sp->y = 2; sp->direction = DOWN;
+        } else if ((t -= width - 6) < height - 6) {
+            sp->x = width - 3; sp->y = 3 + t; sp->direction = LEFT;
+        } else if ((t -= height - 6) < width - 6) {
+            sp->x = width - 4 - t; sp->y = height - 3; sp->direction = UP;
+        } else {
+            t -= width - 6;
+            sp->x = 2; sp->y = height - 4 - t; sp->direction = RIGHT;
         }
-        
-        room->game.map[y][x] = (rand() % 2 == 0) ? WALL : DESTRUCTIBLE_WALL;
     }
 }
 
-void init_room(int room_id) {
-    Room *room = &rooms[room_id];
-    
-    room->id = room_id;
-    room->active = 1;
-    room->map_seed = time(NULL) + room_id;
-    
-    pthread_mutex_init(&room->mutex, NULL);
-    
-    room->game.players[0].x = 2;
-    room->game.players[0].y = 2;
-    room->game.players[0].direction = RIGHT;
-    
-    room->game.players[1].x = MAP_WIDTH - 3;
-    room->game.players[1].y = 2;
-    room->game.players[1].direction = LEFT;
-    
-    room->game.players[2].x = 2;
-    room->game.players[2].y = MAP_HEIGHT - 3;
-    room->game.players[2].direction = RIGHT;
+unsigned int rng_next(Rng *rng) {
+    unsigned long long old = rng->state;
+    rng->state = old * 6364136223846793005ULL + rng->inc;
     
-    room->game.players[3].x = MAP_WIDTH - 3;
-    room->game.players[3].y = MAP_HEIGHT - 3;
-    room->game.players[3].direction = LEFT;
+    unsigned int xorshifted = ((old >> 18) ^ old) >> 27;
+    unsigned int rot = old >> 59;
+    return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+}
+
+void rng_seed(Rng *rng, unsigned long long seed) {
+    rng->state = 0;
+    rng->inc = (seed << 1) | 1;
+    rng_next(rng);
+    rng->state += seed;
+    rng_next(rng);
+}
+
+// [0, bound) 内的均匀整数，乘法取高位代替取模
+unsigned int rng_below(Rng *rng, unsigned int bound) {
+    return ((unsigned long long)rng_next(rng) * bound) >> 32;
+}
+
+// 用系统熵初始化，拿不到就退回时钟
+void rng_seed_random(Rng *rng) {
+    unsigned long long seed;
+    if (getrandom(&seed, sizeof(seed), 0) != sizeof(seed)) seed = monotonic_ns();
+    rng_seed(rng, seed);
+}
+
+// 只用局部随机数状态，可以在后台线程里并发调用；同一个种子总是生成同一张地图
+void generate_map(Grid *map, const SpawnPoint *spawns, int spawn_count, unsigned int seed) {
+    int width = map->width;
+    int height = map->height;
+    Rng rng;
     
-    init_map(room);
+    rng_seed(&rng, seed);
     
-    room->game.player_count = 0;
-    room->game.game_started = 0;
-    room->game.game_over = 0;
+    memset(map->cells, EMPTY, map->capacity);
     
-    for (int i = 0; i < MAX_BULLETS; i++) {
-        room->game.bullets[i].active = 0;
+    for (int i = 0; i < width; i++) {
+        GRID_CELL(map, i, 0) = WALL;
+        GRID_CELL(map, i, height - 1) = WALL;
+    }
+    for (int i = 0; i < height; i++) {
+        GRID_CELL(map, 0, i) = WALL;
+        GRID_CELL(map, width - 1, i) = WALL;
     }
     
-    printf("Room %d initialized\n", room_id);
+    for (int i = 0; i < (width * height) / 5; i++) {
+        int x = rng_below(&rng, width - 2) + 1;
+        int y = rng_below(&rng, height - 2) + 1;
+        
+        GRID_CELL(map, x, y) = (rng_next(&rng) & 1) ? WALL : DESTRUCTIBLE_WALL;
+    }
     
-    if (pthread_create(&room->thread, NULL, room_thread, room) != 0) {
-        perror("Failed to create room thread");
-        exit(EXIT_FAILURE);
+    // 出生点周围3x3保持空地
+    for (int i = 0; i < spawn_count; i++) {
+        for (int y = spawns[i].y - 1; y <= spawns[i].y + 1; y++) {
+            for (int x = spawns[i].x - 1; x <= spawns[i].x + 1; x++) {
+                if (x > 0 && x < width - 1 && y > 0 && y < height - 1) {
+                    GRID_CELL(map, x, y) = EMPTY;
+                }
+            }
+        }
     }
 }
 
-void *room_thread(void *arg) {
-    Room *room = (Room *)arg;
+// 从第一个出生点出发，不穿过不可摧毁的墙能否到达所有出生点；可摧毁的墙打得掉，算作连通
+int map_connected(Grid *map, const SpawnPoint *spawns, int spawn_count) {
+    int width = map->width;
+    int height = map->height;
+    unsigned char *seen = calloc(width * height, 1);
+    int *queue = malloc(sizeof(int) * width * height);
+    if (!seen || !queue) {
+        free(seen);
+        free(queue);
+        return 1;
+    }
     
-    printf("Room %d thread started\n", room->id);
+    static const int dx[4] = { 0, 1, 0, -1 };
+    static const int dy[4] = { -1, 0, 1, 0 };
+    int head = 0, tail = 0;
+    queue[tail++] = spawns[0].y * width + spawns[0].x;
+    seen[queue[0]] = 1;
     
-    while (room->active) {
-        pthread_mutex_lock(&room->mutex);
+    while (head < tail) {
+        int x = queue[head] % width;
+        int y = queue[head] / width;
+        head++;
         
-        if (room->game.game_started && !room->game.game_over) {
-            update_bullets(room);
-            
-            send_game_update(room);
-        }
-        
-        if (room->game.game_over) {
-            send_game_over(room);
-            
-            room->game.game_started = 0;
-            room->game.game_over = 0;
-            room->map_seed = time(NULL) + room->id;
-            init_map(room);
-            
-            for (int i = 0; i < MAX_PLAYERS; i++) {
-                if (room->game.players[i].fd > 0) {
-                    room->game.players[i].alive = 1;
-                    
-                    switch (i) {
-                        case 0:
-                            room->game.players[i].x = 2;
-                            room->game.players[i].y = 2;
-                            room->game.players[i].direction = RIGHT;
-                            break;
-                        case 1:
-                            room->game.players[i].x = MAP_WIDTH - 3;
-                            room->game.players[i].y = 2;
-                            room->game.players[i].direction = LEFT;
-                            break;
-                        case 2:
-                            room->game.players[i].x = 2;
-                            room->game.players[i].y = MAP_HEIGHT - 3;
-                            room->game.players[i].direction = RIGHT;
-                            break;
-                        case 3:
-                            room->game.players[i].x = MAP_WIDTH - 3;
-                            room->game.players[i].y = MAP_HEIGHT - 3;
-                            room->game.players[i].direction = LEFT;
-                            break;
-                    }
-                }
-            }
+        for (int d = 0; d < 4; d++) {
+            int nx = x + dx[d], ny = y + dy[d];
+            if (seen[ny * width + nx] || GRID_CELL(map, nx, ny) == WALL) continue;
             
-            for (int i = 0; i < MAX_BULLETS; i++) {
-                room->game.bullets[i].active = 0;
-            }
-            
-            if (room->game.player_count >= 2) {
-                room->game.game_started = 1;
-                send_game_start(room);
-            }
+            seen[ny * width + nx] = 1;
+            queue[tail++] = ny * width + nx;
         }
-        
-        pthread_mutex_unlock(&room->mutex);
-        
-        usleep(50000);
     }
     
-    printf("Room %d thread ended\n", room->id);
-    return NULL;
+    int connected = 1;
+    for (int i = 1; i < spawn_count; i++) {
+        if (!seen[spawns[i].y * width + spawns[i].x]) connected = 0;
+    }
+    
+    free(seen);
+    free(queue);
+    return connected;
 }
 
-int find_available_room() {
-    for (int i = 0; i < MAX_ROOMS; i++) {
-        if (rooms[i].active && rooms[i].game.player_count < MAX_PLAYERS) {
-            return i;
-        }
+// 不连通就换下一个种子重来，返回最终采用的种子；试满次数仍不连通就用最后一张
+unsigned int generate_valid_map(Grid *map, const SpawnPoint *spawns, int spawn_count, unsigned int seed) {
+    for (int attempt = 1; attempt < MAP_GENERATE_ATTEMPTS; attempt++, seed++) {
+        generate_map(map, spawns, spawn_count, seed);
+        if (map_connected(map, spawns, spawn_count)) return seed;
+    }
+    
+    generate_map(map, spawns, spawn_count, seed);
+    return seed;
+}
+
+// 按room->map_seed原样重建地图，回放和基准测试用
+void init_map(Room *room) {
+    generate_map(&room->map, room->spawns, room->max_players, room->map_seed);
+    map_installed(room);
+}
+
+// 预生成的地图缓存：线程池里一次只跑一个补货任务，房间开局和换局时直接取走整张格子层。
+// 所有房间的尺寸和人数来自同一份配置，不相符的房间当场生成
+typedef struct {
+    pthread_mutex_t mutex;
+    int width;
+    int height;
+    int spawn_count;
+    SpawnPoint spawns[MAX_PLAYERS];
+    Grid maps[MAP_CACHE_SIZE];
+    unsigned int seeds[MAP_CACHE_SIZE];
+    int count;
+    int filling;
+    Rng rng;
+    unsigned long long hits;
+    unsigned long long misses;
+} MapCache;
+
+MapCache map_cache = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+void init_map_cache(int width, int height, int spawn_count) {
+    if (spawn_count > spawn_capacity(width, height)) {
+        spawn_count = spawn_capacity(width, height);
     }
     
-    for (int i = 0; i < MAX_ROOMS; i++) {
-        if (!rooms[i].active) {
-            init_room(i);
-            return i;
+    pthread_mutex_lock(&map_cache.mutex);
+    map_cache.width = width;
+    map_cache.height = height;
+    map_cache.spawn_count = spawn_count;
+    compute_spawns(width, height, spawn_count, map_cache.spawns);
+    rng_seed_random(&map_cache.rng);
+    pthread_mutex_unlock(&map_cache.mutex);
+    
+    request_map_fill();
+}
+
+// 生成时不持锁，只在取种子和放入结果时短暂加锁
+void fill_map_cache(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&map_cache.mutex);
+    
+    while (map_cache.count < MAP_CACHE_SIZE) {
+        unsigned int seed = rng_next(&map_cache.rng);
+        pthread_mutex_unlock(&map_cache.mutex);
+        
+        Grid map;
+        memset(&map, 0, sizeof(map));
+        int ok = grid_resize(&map, map_cache.width, map_cache.height) == 0;
+        if (ok) {
+            seed = generate_valid_map(&map, map_cache.spawns, map_cache.spawn_count, seed);
         }
+        
+        pthread_mutex_lock(&map_cache.mutex);
+        if (!ok) break;
+        map_cache.maps[map_cache.count] = map;
+        map_cache.seeds[map_cache.count] = seed;
+        map_cache.count++;
     }
     
-    return -1;
+    map_cache.filling = 0;
+    pthread_mutex_unlock(&map_cache.mutex);
 }
 
-int add_player(int client_fd, const char* username, int room_id) {
-    Room *room = &rooms[room_id];
+void request_map_fill() {
+    pthread_mutex_lock(&map_cache.mutex);
+    int start = map_cache.width > 0 && !map_cache.filling && map_cache.count < MAP_CACHE_SIZE;
+    if (start) map_cache.filling = 1;
+    pthread_mutex_unlock(&map_cache.mutex);
     
-    pthread_mutex_lock(&room->mutex);
+    if (start && add_work(fill_map_cache, NULL) < 0) {
+        pthread_mutex_lock(&map_cache.mutex);
+        map_cache.filling = 0;
+        pthread_mutex_unlock(&map_cache.mutex);
+    }
+}
+
+// 取一张尺寸相符的地图换进房间，旧的格子层释放；缓存空了返回-1
+int map_cache_take(Room *room) {
+    pthread_mutex_lock(&map_cache.mutex);
     
-    if (room->game.player_count >= MAX_PLAYERS) {
-        pthread_mutex_unlock(&room->mutex);
+    if (map_cache.count == 0 || map_cache.width != room->width || map_cache.height != room->height ||
+        map_cache.spawn_count != room->max_players) {
+        map_cache.misses++;
+        pthread_mutex_unlock(&map_cache.mutex);
         return -1;
     }
     
-    int id = room->game.player_count;
-    room->game.players[id].fd = client_fd;
-    room->game.players[id].alive = 1;
-    room->game.players[id].id = id + 1;
-    
-    memset(room->game.players[id].username, 0, USERNAME_MAX);
-    strncpy(room->game.players[id].username, username, USERNAME_MAX - 1);
-    
-    room->game.player_count++;
+    map_cache.count--;
+    Grid map = map_cache.maps[map_cache.count];
+    room->map_seed = map_cache.seeds[map_cache.count];
+    map_cache.hits++;
+    pthread_mutex_unlock(&map_cache.mutex);
     
-    if (room->game.player_count >= 2 && !room->game.game_started) {
-        room->game.game_started = 1;
+    grid_free(&room->map);
+    room->map = map;
+    return 0;
+}
+
+// 开局和每局结束时换图：优先从缓存取，取不到就用房间自己的随机数当场生成。
+// 调用者需持有房间锁或者房间尚未开始调度
+void room_new_map(Room *room) {
+    if (map_cache_take(room) == 0) {
+        request_map_fill();
+    } else {
+        room->map_seed = generate_valid_map(&room->map, room->spawns, room->max_players, rng_next(&room->rng));
     }
     
-    pthread_mutex_unlock(&room->mutex);
+    map_installed(room);
+}
+
+void log_map_change(Room *room, int x, int y, int cell) {
+    MapChange *c = &room->map_log[room->map_log_count % MAP_LOG_SIZE];
+    c->tick = room->tick;
+    c->x = x;
+    c->y = y;
+    c->cell = cell;
+    room->map_log_count++;
     
-    return id;
+    unsigned char change[3] = { x, y, cell };
+    room->map_hash = hash_bytes(room->map_hash, change, sizeof(change));
 }
 
-void remove_player(Room *room, int client_fd) {
-    pthread_mutex_lock(&room->mutex);
+// FNV-1a，只用来核对回放结果是否一致
+unsigned long long hash_bytes(unsigned long long h, const void *data, size_t len) {
+    const unsigned char *p = data;
     
-    int i;
-    for (i = 0; i < room->game.player_count; i++) {
-        if (room->game.players[i].fd == client_fd) {
-            break;
-        }
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 1099511628211ULL;
     }
     
-    if (i == room->game.player_count) {
-        pthread_mutex_unlock(&room->mutex);
-        return;
-    }
+    return h;
+}
+
+// 换上新地图之后调用；地图完全由种子决定，日志里只记种子
+void map_installed(Room *room) {
+    room->map_version++;
+    room->map_hash = hash_bytes(HASH_SEED, room->map.cells, room->map.capacity);
+    replay_event(room, REC_MAP, room->map_seed, 0);
+}
+
+// 地图、坦克和子弹的哈希，每个tick结束时记进日志
+unsigned long long room_state_hash(Room *room) {
+    unsigned long long h = hash_bytes(room->map_hash, &room->tick, sizeof(room->tick));
     
-    room->game.players[i].alive = 0;
-    room->game.players[i].fd = -1;
+    for (int i = 0; i < room->game.player_count; i++) {
+        Player *p = &room->game.players[i];
+        unsigned char tank[4] = { p->x, p->y, p->direction, p->alive };
+        h = hash_bytes(h, tank, sizeof(tank));
+    }
     
-    for (int j = i; j < room->game.player_count - 1; j++) {
-        room->game.players[j] = room->game.players[j+1];
-        room->game.players[j].id = j + 1;
+    BulletSet *bullets = &room->game.bullets;
+    h = hash_bytes(h, &bullets->active, sizeof(bullets->active));
+    for (BulletMask m = bullets->active; m; m &= m - 1) {
+        int i = __builtin_ctzll(m);
+        unsigned char bullet[4] = { bullets->x[i], bullets->y[i], bullets->direction[i], bullets->owner_id[i] };
+        h = hash_bytes(h, bullet, sizeof(bullet));
     }
     
-    room->game.player_count--;
+    return h;
+}
+
+int replay_map_window(ReplayLog *log, off_t offset) {
+    if (ftruncate(log->fd, offset + REPLAY_WINDOW) < 0) return -1;
     
-    if (room->game.player_count <= 1 && room->game.game_started) {
-        if (room->game.player_count == 1) {
-            room->game.game_over = 1;
-            room->game.winner_id = room->game.players[0].id;
-            printf("Game over in Room %d! Player %s wins!\n", 
-                   room->id, room->game.players[0].username);
-        } else {
-            room->game.game_over = 1;
-            room->game.winner_id = 0;
-            printf("Game over in Room %d! No players left.\n", room->id);
-        }
-    }
+    void *window = mmap(NULL, REPLAY_WINDOW, PROT_READ | PROT_WRITE, MAP_SHARED, log->fd, offset);
+    if (window == MAP_FAILED) return -1;
     
-    if (room->game.player_count == 0) {
-        room->active = 0;
-        printf("Room %d is now inactive\n", room->id);
-    }
+    log->window = window;
+    log->window_offset = offset;
+    return 0;
+}
+
+// 调用者需持有房间锁；日志收尾时把文件截到实际长度。扩展失败时窗口已经解除映射，
+// 这时window为NULL，window_offset和pos仍然记着实际长度，照样要截掉预留的部分
+void replay_close(Room *room) {
+    ReplayLog *log = room->replay;
+    if (!log) return;
     
-    pthread_mutex_unlock(&room->mutex);
+    if (log->window) munmap(log->window, REPLAY_WINDOW);
+    if (ftruncate(log->fd, log->window_offset + log->pos) < 0) {
+        perror("Failed to truncate replay log");
+    }
+    close(log->fd);
+    free(log);
+    room->replay = NULL;
 }
 
-Room *find_room_for_client(int client_fd) {
-    for (int i = 0; i < MAX_ROOMS; i++) {
-        if (!rooms[i].active) continue;
+// 返回至少能写REPLAY_RECORD_MAX字节的位置；窗口快满时从当前所在的页重新映射，
+// 映射失败就停止记录这个房间
+unsigned char *replay_reserve(Room *room) {
+    ReplayLog *log = room->replay;
+    
+    if (log->pos + REPLAY_RECORD_MAX > REPLAY_WINDOW) {
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t advance = log->pos & ~(page - 1);
         
-        pthread_mutex_lock(&rooms[i].mutex);
-        for (int j = 0; j < rooms[i].game.player_count; j++) {
-            if (rooms[i].game.players[j].fd == client_fd) {
-                pthread_mutex_unlock(&rooms[i].mutex);
-                return &rooms[i];
-            }
+        munmap(log->window, REPLAY_WINDOW);
+        log->window = NULL;
+        if (replay_map_window(log, log->window_offset + advance) < 0) {
+            perror("Failed to extend replay log");
+            log->window_offset += advance;
+            log->pos -= advance;
+            replay_close(room);
+            return NULL;
         }
-        pthread_mutex_unlock(&rooms[i].mutex);
+        log->pos -= advance;
     }
     
-    return NULL;
+    return log->window + log->pos;
 }
 
-void remove_player_from_room(int client_fd) {
-    Room *room = find_room_for_client(client_fd);
-    if (room != NULL) {
-        remove_player(room, client_fd);
-    }
+// 调用者需持有房间锁或者房间尚未开始调度
+void replay_event(Room *room, int type, unsigned int a, unsigned int b) {
+    if (!room->replay) return;
+    
+    unsigned char *buffer = replay_reserve(room);
+    if (!buffer) return;
+    
+    int len = 0;
+    buffer[len++] = type;
+    len += put_varint(buffer + len, a);
+    len += put_varint(buffer + len, b);
+    room->replay->pos += len;
 }
 
-void shoot(Room *room, int player_id) {
-    pthread_mutex_lock(&room->mutex);
+void replay_join(Room *room, int slot, const char *username) {
+    if (!room->replay) return;
     
-    Player *p = &room->game.players[player_id];
-    if (!p->alive) {
+    unsigned char *buffer = replay_reserve(room);
+    if (!buffer) return;
+    
+    int ulen = strlen(username);
+    int len = 0;
+    buffer[len++] = REC_JOIN;
+    len += put_varint(buffer + len, slot);
+    len += put_varint(buffer + len, ulen);
+    memcpy(buffer + len, username, ulen);
+    room->replay->pos += len + ulen;
+}
+
+void replay_tick(Room *room) {
+    if (!room->replay) return;
+    
+    unsigned char *buffer = replay_reserve(room);
+    if (!buffer) return;
+    
+    unsigned long long h = room_state_hash(room);
+    int len = 0;
+    buffer[len++] = REC_TICK;
+    len += put_varint(buffer + len, room->tick);
+    len += put_varint(buffer + len, 0);
+    put_u32(buffer + len, h >> 32);
+    put_u32(buffer + len + 4, h);
+    room->replay->pos += len + 8;
+}
+
+// 房间开始使用时打开日志，文件头记下重现模拟需要的全部配置，后面紧跟当前地图。
+// 要创建文件，调用者不能持有room_pool.mutex；需持有房间锁
+void replay_open(Room *room) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/room%d-%ld-%u.tlog", replay_dir, room->id, (long)time(NULL),
+             atomic_fetch_add(&replay_serial, 1));
+    
+    ReplayLog *log = calloc(1, sizeof(ReplayLog));
+    if (!log) return;
+    
+    log->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (log->fd < 0) {
+        perror("Failed to create replay log");
+        free(log);
+        return;
+    }
+    
+    if (replay_map_window(log, 0) < 0) {
+        perror("Failed to map replay log");
+        close(log->fd);
+        free(log);
+        return;
+    }
+    room->replay = log;
+    
+    unsigned char *buffer = log->window;
+    memcpy(buffer, "TLOG", 4);
+    int len = 4;
+    len += put_varint(buffer + len, REPLAY_VERSION);
+    len += put_varint(buffer + len, room->id);
+    len += put_varint(buffer + len, room->width);
+    len += put_varint(buffer + len, room->height);
+    len += put_varint(buffer + len, room->max_players);
+    len += put_varint(buffer + len, tick_rate);
+    len += put_varint(buffer + len, fire_cooldown_ticks);
+    len += put_varint(buffer + len, room->tick);
+    put_u32(buffer + len, time(NULL));
+    log->pos = len + 4;
+    
+    replay_event(room, REC_MAP, room->map_seed, 0);
+}
+
+void place_at_spawn(Room *room, Player *p, int slot) {
+    p->x = room->spawns[slot].x;
+    p->y = room->spawns[slot].y;
+    p->direction = room->spawns[slot].direction;
+}
+
+void occupy_cell(Room *room, int x, int y, int index) {
+    GRID_CELL(&room->tank_at, x, y) = index + 1;
+    room->chunk_tanks[GRID_CHUNK(&room->tank_at, x, y)] |= PLAYER_BIT(index);
+}
+
+void vacate_cell(Room *room, int x, int y, int index) {
+    GRID_CELL(&room->tank_at, x, y) = 0;
+    room->chunk_tanks[GRID_CHUNK(&room->tank_at, x, y)] &= ~PLAYER_BIT(index);
+}
+
+// 玩家进出或重新出生后整体重建；下标会随玩家离开而移动，增量维护不划算
+void rebuild_occupancy(Room *room) {
+    memset(room->tank_at.cells, 0, room->tank_at.capacity);
+    memset(room->chunk_tanks, 0, sizeof(room->chunk_tanks));
+    
+    for (int i = 0; i < room->game.player_count; i++) {
+        Player *p = &room->game.players[i];
+        if (p->alive) {
+            occupy_cell(room, p->x, p->y, i);
+        }
+    }
+}
+
+// 快照环、各快照的坦克数组和玩家的增量基线放在同一块内存里
+size_t room_history_size(int players) {
+    return sizeof(Snapshot) * SNAPSHOT_HISTORY + sizeof(TankState) * SNAPSHOT_HISTORY * players +
+           sizeof(ViewState) * players;
+}
+
+// 清空快照环和增量基线，重新挂好各快照的坦克数组
+void room_history_reset(Room *room) {
+    if (!room->snapshots) return;
+    
+    TankState *tanks = (TankState *)(room->snapshots + SNAPSHOT_HISTORY);
+    
+    memset(room->snapshots, 0, room_history_size(room->history_players));
+    for (int i = 0; i < SNAPSHOT_HISTORY; i++) {
+        room->snapshots[i].tanks = tanks + i * room->history_players;
+    }
+    room->views = (ViewState *)(tanks + SNAPSHOT_HISTORY * room->history_players);
+}
+
+// 按人数上限准备快照缓冲区，人数上限不变就原地重用；分配失败返回-1
+int room_history_resize(Room *room, int players) {
+    if (!room->snapshots || players != room->history_players) {
+        Snapshot *snapshots = realloc(room->snapshots, room_history_size(players));
+        if (!snapshots) return -1;
+        room->snapshots = snapshots;
+        room->history_players = players;
+    }
+    
+    room_history_reset(room);
+    return 0;
+}
+
+void room_history_free(Room *room) {
+    free(room->snapshots);
+    room->snapshots = NULL;
+    room->views = NULL;
+    room->history_players = 0;
+}
+
+// 按当前配置确定房间的地图尺寸和人数上限并准备好格子层和快照缓冲区，分配失败返回-1
+int room_configure(Room *room) {
+    room->width = map_width;
+    room->height = map_height;
+    room->max_players = players_per_room;
+    room->view_radius = view_radius;
+    if (room->max_players > spawn_capacity(room->width, room->height)) {
+        room->max_players = spawn_capacity(room->width, room->height);
+    }
+    
+    compute_spawns(room->width, room->height, room->max_players, room->spawns);
+    
+    if (grid_resize(&room->map, room->width, room->height) < 0 ||
+        grid_resize(&room->tank_at, room->width, room->height) < 0 ||
+        room_history_resize(room, room->max_players) < 0) {
+        return -1;
+    }
+    
+    return 0;
+}
+
+void init_room(Room *room) {
+    room->active = 1;
+    rng_seed_random(&room->rng);
+    
+    memset(&room->game, 0, sizeof(room->game));
+    room_history_reset(room);
+    room->tick = 0;
+    room->bullet_steps = 0;
+    room->bullet_accum = 0;
+    room->replay_pending = 0;
+    room->tick_overruns = 0;
+    room->ticks_skipped = 0;
+    room->last_keyframe_tick = 0;
+    room->last_update_tick = 0;
+    room->last_change_tick = 0;
+    room->map_log_count = 0;
+    room->spectator_count = 0;
+    atomic_store(&room->bytes_out, 0);
+    atomic_store(&room->frames_out, 0);
+    
+    room_new_map(room);
+    
+    room->game.player_count = 0;
+    room->game.game_started = 0;
+    room->game.game_over = 0;
+    
+    room->game.bullets.active = 0;
+    
+    debug_log("Room %d initialized\n", room->id);
+    
+    room->worker = room->id % tick_worker_count;
+    room->next_tick_ns = monotonic_ns();
+    atomic_store(&room->parked, 0);
+    schedule_room(room);
+}
+
+// 调用者需持有房间锁。先置挂起标志再看输入队列，和room_wake的先改状态再看标志配对，
+// 两边中间都有全屏障，不会双方都错过对方；刚好有输入进来时撤销挂起并返回0
+int room_park(Room *room) {
+    atomic_store(&room->parked, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    
+    // 撤销失败说明已经有人唤醒并重新调度了，当作已挂起
+    if (!input_queue_empty(&room->inputs) && atomic_exchange(&room->parked, 0)) return 0;
+    
+    return 1;
+}
+
+// 玩家进出或输入入队之后调用；房间若已挂起就从现在开始重新按tick调度
+void room_wake(Room *room) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!atomic_load_explicit(&room->parked, memory_order_relaxed)) return;
+    if (!atomic_exchange(&room->parked, 0)) return;
+    
+    room->next_tick_ns = monotonic_ns();
+    METRIC_ADD(room_wakeups, 1);
+    schedule_room(room);
+}
+
+// 推进一个房间一帧。返回ROOM_RELEASE表示房间已经没人、应当回收；
+// 返回ROOM_PARKED表示房间在等人，已经挂起，tick worker不再调度它
+int room_tick(Room *room) {
+    pthread_mutex_lock(&room->mutex);
+    
+    if (!room->active) {
+        // 观战者随房间一起解散，连接保留
+        for (int i = 0; i < room->spectator_count; i++) {
+            session_unbind(room->spectators[i].fd);
+        }
+        room->spectator_count = 0;
+        replay_close(room);
+        pthread_mutex_unlock(&room->mutex);
+        return ROOM_RELEASE;
+    }
+    
+    apply_inputs(room);
+    
+    if (room->game.game_started && !room->game.game_over) {
+        room_advance(room);
+        
+        long long encode_started = monotonic_ns();
+        send_game_update(room);
+        METRIC_TIME(encode_duration, monotonic_ns() - encode_started);
+    }
+    
+    if (room->game.game_over) {
+        send_game_over(room);
+        replay_event(room, REC_OVER, room->game.winner_id, 0);
+        
+        room_new_map(room);
+        if (room_new_round(room)) {
+            send_game_start(room);
+        }
+    }
+    
+    // 大厅里什么都不用推进，等加入、离开或输入把它唤醒
+    int parked = !room->game.game_started && room_park(room);
+    
+    pthread_mutex_unlock(&room->mutex);
+    return parked ? ROOM_PARKED : ROOM_RUNNING;
+}
+
+// 以下几个函数加上move_tank和shoot是对局状态的全部变更入口，回放工具按日志依次调用它们。
+// 调用者需持有房间锁
+
+// 推进一帧并记下快照
+void room_advance(Room *room) {
+    room->tick++;
+    
+    // 子弹速度按格/秒计，与tick频率无关
+    room->bullet_accum += BULLET_SPEED;
+    while (room->bullet_accum >= tick_rate && !room->game.game_over) {
+        room->bullet_accum -= tick_rate;
+        update_bullets(room);
+    }
+    
+    record_snapshot(room);
+    replay_tick(room);
+}
+
+// 换图之后所有人回到出生点，人数够就直接开下一局并返回1
+int room_new_round(Room *room) {
+    // 接管来的房间从这里重开日志：新图刚换上，记下种子和在场玩家，
+    // 并把回放工具从空房间推不出来的状态（子弹进度、射击冷却、快照历史）清掉
+    if (room->replay_pending) {
+        room->replay_pending = 0;
+        room->bullet_accum = 0;
+        for (int i = 0; i < SNAPSHOT_HISTORY; i++) {
+            room->snapshots[i].valid = 0;
+        }
+        
+        replay_open(room);
+        for (int i = 0; i < room->game.player_count; i++) {
+            room->game.players[i].next_fire_tick = room->tick;
+            replay_join(room, i, room->game.players[i].username);
+        }
+    }
+    
+    room->game.game_started = 0;
+    room->game.game_over = 0;
+    
+    for (int i = 0; i < room->game.player_count; i++) {
+        room->game.players[i].alive = 1;
+        place_at_spawn(room, &room->game.players[i], i);
+    }
+    rebuild_occupancy(room);
+    
+    room->game.bullets.active = 0;
+    
+    room->roster_version++;
+    replay_event(room, REC_ROUND, 0, 0);
+    
+    if (room->game.player_count >= 2) {
+        room->game.game_started = 1;
+        replay_event(room, REC_START, room->game.player_count, 0);
+        return 1;
+    }
+    
+    return 0;
+}
+
+// 新玩家占用下一个槽位，返回下标
+int player_join(Room *room, int fd, const char *username) {
+    int id = room->game.player_count;
+    room->game.players[id].fd = fd;
+    room->game.players[id].alive = 1;
+    // 槽位里可能还留着离开的玩家移位时复制的坐标，回到出生点
+    place_at_spawn(room, &room->game.players[id], id);
+    room->game.players[id].id = id + 1;
+    room->game.players[id].input_seq = 0;
+    room->game.players[id].next_fire_tick = room->tick;
+    memset(&room->views[id], 0, sizeof(ViewState));
+    room->views[id].need_keyframe = 1;
+    
+    memset(room->game.players[id].username, 0, USERNAME_MAX);
+    strncpy(room->game.players[id].username, username, USERNAME_MAX - 1);
+    
+    room->game.player_count++;
+    room->roster_version++;
+    rebuild_occupancy(room);
+    replay_join(room, id, room->game.players[id].username);
+    
+    if (room->game.player_count >= 2 && !room->game.game_started) {
+        room->game.game_started = 1;
+        replay_event(room, REC_START, room->game.player_count, 0);
+    }
+    
+    return id;
+}
+
+// 后面的玩家依次前移一个槽位，剩一人或没人时本局结束
+void player_leave(Room *room, int index) {
+    room->game.players[index].alive = 0;
+    room->game.players[index].fd = -1;
+    
+    for (int j = index; j < room->game.player_count - 1; j++) {
+        room->game.players[j] = room->game.players[j+1];
+        room->game.players[j].id = j + 1;
+        room->views[j] = room->views[j+1];
+    }
+    
+    room->game.player_count--;
+    room->roster_version++;
+    rebuild_occupancy(room);
+    replay_event(room, REC_LEAVE, index, 0);
+    
+    if (room->game.player_count <= 1 && room->game.game_started) {
+        if (room->game.player_count == 1) {
+            room->game.game_over = 1;
+            room->game.winner_id = room->game.players[0].id;
+            debug_log("Game over in Room %d! Player %s wins!\n", 
+                   room->id, room->game.players[0].username);
+        } else {
+            room->game.game_over = 1;
+            room->game.winner_id = 0;
+            debug_log("Game over in Room %d! No players left.\n", room->id);
+        }
+    }
+}
+
+long long monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// 直方图：每个2的幂区间再等分成8段，相对误差不超过12.5%，单位是纳秒
+int hist_index(unsigned long long value) {
+    if (value < (1 << HIST_SUB_BITS)) return value;
+    
+    int msb = 63 - __builtin_clzll(value);
+    int index = ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) |
+                ((value >> (msb - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1));
+    
+    return index < HIST_BUCKETS ? index : HIST_BUCKETS - 1;
+}
+
+// 桶的上界（不含）
+unsigned long long hist_upper(int index) {
+    if (index < (1 << HIST_SUB_BITS)) return index + 1;
+    
+    int group = index >> HIST_SUB_BITS;
+    int sub = index & ((1 << HIST_SUB_BITS) - 1);
+    return (unsigned long long)((1 << HIST_SUB_BITS) + sub + 1) << (group - 1);
+}
+
+// 分位数取所在桶的上界，没有样本时返回0
+unsigned long long hist_quantile(Histogram *h, double q) {
+    unsigned long long count = atomic_load_explicit(&h->count, memory_order_relaxed);
+    if (!count) return 0;
+    
+    unsigned long long target = (unsigned long long)(q * count);
+    unsigned long long seen = 0;
+    int i = 0;
+    while (i < HIST_BUCKETS - 1) {
+        unsigned long long n = atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+        if (seen + n > target) break;
+        seen += n;
+        i++;
+    }
+    
+    return hist_upper(i);
+}
+
+// 计数器只由所属线程写，读写都用relaxed，不需要原子加
+void metric_add(_Atomic unsigned long long *counter, unsigned long long value) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + value,
+                          memory_order_relaxed);
+}
+
+void hist_record(Histogram *h, long long ns) {
+    if (ns < 0) ns = 0;
+    metric_add(&h->buckets[hist_index(ns)], 1);
+    metric_add(&h->count, 1);
+    metric_add(&h->sum, ns);
+}
+
+// 每个会记录指标的线程启动时登记一份自己的计数器，没登记的线程不记录
+void metrics_register(const char *role, int index) {
+    char name[32];
+    snprintf(name, sizeof(name), "%s-%d", role, index);
+    
+    // 热重启交接失败后重新拉起的线程沿用原来的计数
+    int count = atomic_load(&metric_thread_count);
+    if (count > MAX_METRIC_THREADS) count = MAX_METRIC_THREADS;
+    for (int t = 0; t < count; t++) {
+        if (metric_threads[t] && strcmp(metric_threads[t]->name, name) == 0) {
+            thread_metrics = metric_threads[t];
+            return;
+        }
+    }
+    
+    ThreadMetrics *m = aligned_alloc(CACHE_LINE_SIZE, sizeof(ThreadMetrics));
+    if (!m) return;
+    memset(m, 0, sizeof(ThreadMetrics));
+    memcpy(m->name, name, sizeof(m->name));
+    
+    int slot = atomic_fetch_add(&metric_thread_count, 1);
+    if (slot >= MAX_METRIC_THREADS) {
+        free(m);
+        return;
+    }
+    
+    metric_threads[slot] = m;
+    thread_metrics = m;
+}
+
+// reactor和tick worker的静默点：每轮循环开头调用quiescent_pass，阻塞等待前后分别调用
+// quiescent_offline和quiescent_online。过了静默点的线程不再持有之前查到的房间指针
+void quiescent_pass(_Atomic unsigned long long *q) {
+    atomic_fetch_add(q, 2);
+}
+
+void quiescent_offline(_Atomic unsigned long long *q) {
+    atomic_fetch_add(q, 1);
+}
+
+void quiescent_online(_Atomic unsigned long long *q) {
+    atomic_fetch_add(q, 1);
+}
+
+// 记下此刻各线程的静默计数
+void quiescent_snapshot(unsigned long long *snapshot) {
+    atomic_thread_fence(memory_order_seq_cst);
+    for (int i = 0; i < reactor_count; i++) {
+        snapshot[i] = atomic_load(&reactors[i].quiescent);
+    }
+    for (int i = 0; i < tick_worker_count; i++) {
+        snapshot[MAX_REACTORS + i] = atomic_load(&tick_workers[i].quiescent);
+    }
+}
+
+// 快照时在睡、或者之后已经过了静默点的线程不会再碰快照之前摘下的房间；全部如此返回1
+int quiescent_elapsed(const unsigned long long *snapshot) {
+    for (int i = 0; i < reactor_count; i++) {
+        if ((snapshot[i] & 1) && atomic_load(&reactors[i].quiescent) == snapshot[i]) return 0;
+    }
+    for (int i = 0; i < tick_worker_count; i++) {
+        unsigned long long v = snapshot[MAX_REACTORS + i];
+        if ((v & 1) && atomic_load(&tick_workers[i].quiescent) == v) return 0;
+    }
+    
+    return 1;
+}
+
+// 调用者需持有worker锁
+void wheel_insert(TickWorker *w, Room *room) {
+    long long slot = room->next_tick_ns / 1000000LL;
+    
+    if (slot < w->wheel_pos) slot = w->wheel_pos;
+    if (slot >= w->wheel_pos + WHEEL_SLOTS) slot = w->wheel_pos + WHEEL_SLOTS - 1;
+    
+    room->sched_next = w->wheel[slot % WHEEL_SLOTS];
+    w->wheel[slot % WHEEL_SLOTS] = room;
+}
+
+// 调用者需持有worker锁
+void run_queue_push(TickWorker *w, Room *room) {
+    room->sched_next = NULL;
+    if (w->run_tail) {
+        w->run_tail->sched_next = room;
+    } else {
+        w->run_head = room;
+    }
+    w->run_tail = room;
+    w->run_count++;
+}
+
+// 调用者需持有worker锁
+Room *run_queue_pop(TickWorker *w) {
+    Room *room = w->run_head;
+    if (!room) return NULL;
+    
+    w->run_head = room->sched_next;
+    if (!w->run_head) w->run_tail = NULL;
+    w->run_count--;
+    room->sched_next = NULL;
+    
+    return room;
+}
+
+// 从队列尾部偷，避开队主正要处理的头部；单链表只能遍历到倒数第二个，队列通常很短
+Room *run_queue_steal(TickWorker *w) {
+    Room *room = w->run_head;
+    if (!room) return NULL;
+    if (!room->sched_next) return run_queue_pop(w);
+    
+    Room *prev = room;
+    while (prev->sched_next != w->run_tail) prev = prev->sched_next;
+    
+    room = w->run_tail;
+    prev->sched_next = NULL;
+    w->run_tail = prev;
+    w->run_count--;
+    
+    return room;
+}
+
+// 调用者需持有worker锁；把已经转过的槽位里到期的房间搬到运行队列，
+// 精度为一个槽位（1ms），截止时间是绝对值，所以提前或推迟不会累积漂移
+void wheel_advance(TickWorker *w, long long now_ns) {
+    long long now_slot = now_ns / 1000000LL;
+    int turned = 0;
+    
+    while (w->wheel_pos <= now_slot && turned < WHEEL_SLOTS) {
+        Room *room = w->wheel[w->wheel_pos % WHEEL_SLOTS];
+        w->wheel[w->wheel_pos % WHEEL_SLOTS] = NULL;
+        w->wheel_pos++;
+        turned++;
+        
+        while (room) {
+            Room *next = room->sched_next;
+            if (room->next_tick_ns / 1000000LL <= now_slot) {
+                run_queue_push(w, room);
+            } else {
+                wheel_insert(w, room);
+            }
+            room = next;
+        }
+    }
+    
+    if (w->wheel_pos <= now_slot) w->wheel_pos = now_slot + 1;
+}
+
+// 调用者需持有worker锁；返回下一个非空槽位的时间，没有则返回-1
+long long wheel_next_deadline(TickWorker *w) {
+    for (int i = 0; i < WHEEL_SLOTS; i++) {
+        long long slot = w->wheel_pos + i;
+        if (w->wheel[slot % WHEEL_SLOTS]) return slot * 1000000LL;
+    }
+    return -1;
+}
+
+void schedule_room(Room *room) {
+    TickWorker *w = &tick_workers[room->worker];
+    
+    pthread_mutex_lock(&w->mutex);
+    wheel_insert(w, room);
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->mutex);
+}
+
+Room *steal_room(TickWorker *self) {
+    for (int i = 1; i < tick_worker_count; i++) {
+        TickWorker *victim = &tick_workers[(self->index + i) % tick_worker_count];
+        
+        pthread_mutex_lock(&victim->mutex);
+        Room *room = victim->run_count > 0 ? run_queue_steal(victim) : NULL;
+        pthread_mutex_unlock(&victim->mutex);
+        
+        if (room) return room;
+    }
+    
+    return NULL;
+}
+
+void *tick_worker_main(void *arg) {
+    TickWorker *w = (TickWorker *)arg;
+    
+    metrics_register("tick", w->index);
+    quiescent_online(&w->quiescent);
+    
+    while (1) {
+        quiescent_pass(&w->quiescent);
+        pthread_mutex_lock(&w->mutex);
+        
+        // 停止时时间轮和运行队列原样保留，重新拉起线程后接着跑
+        if (atomic_load(&tick_workers_stopping)) {
+            pthread_mutex_unlock(&w->mutex);
+            break;
+        }
+        
+        long long now = monotonic_ns();
+        wheel_advance(w, now);
+        Room *room = run_queue_pop(w);
+        
+        if (!room) {
+            pthread_mutex_unlock(&w->mutex);
+            room = steal_room(w);
+            
+            if (!room) {
+                pthread_mutex_lock(&w->mutex);
+                long long deadline = wheel_next_deadline(w);
+                // 偷房间时没持锁，可能错过了stop_tick_workers的广播，睡之前再看一次
+                if (!w->run_head && !atomic_load(&tick_workers_stopping)) {
+                    quiescent_offline(&w->quiescent);
+                    if (deadline < 0) {
+                        pthread_cond_wait(&w->cond, &w->mutex);
+                    } else if (deadline > now) {
+                        struct timespec ts;
+                        ts.tv_sec = deadline / 1000000000LL;
+                        ts.tv_nsec = deadline % 1000000000LL;
+                        pthread_cond_timedwait(&w->cond, &w->mutex, &ts);
+                    }
+                    quiescent_online(&w->quiescent);
+                }
+                pthread_mutex_unlock(&w->mutex);
+                continue;
+            }
+        } else {
+            pthread_mutex_unlock(&w->mutex);
+        }
+        
+        long long started = monotonic_ns();
+        int state = room_tick(room);
+        if (state == ROOM_RELEASE) {
+            debug_log("Room %d stopped ticking\n", room->id);
+            room_release(room);
+            continue;
+        }
+        if (state == ROOM_PARKED) {
+            // 房间可能已经被唤醒并交给别的worker，不能再碰它
+            METRIC_ADD(ticks, 1);
+            continue;
+        }
+        
+        // 固定步长：下一帧的截止时间在上一帧的截止时间上累加，落后时立即补帧，
+        // 落后太多就放弃补帧并保持原来的相位
+        room->next_tick_ns += tick_interval_ns;
+        now = monotonic_ns();
+        METRIC_TIME(tick_duration, now - started);
+        METRIC_ADD(ticks, 1);
+        if (now >= room->next_tick_ns) {
+            room->tick_overruns++;
+            
+            long long behind = (now - room->next_tick_ns) / tick_interval_ns;
+            if (behind >= MAX_CATCHUP_TICKS) {
+                room->ticks_skipped += behind;
+                room->next_tick_ns += behind * tick_interval_ns;
+                debug_log("Room %d fell %lld ticks behind, skipping ahead\n", room->id, behind);
+            }
+        }
+        schedule_room(room);
+    }
+    
+    quiescent_offline(&w->quiescent);
+    return NULL;
+}
+
+void init_tick_workers(int count, int rate) {
+    tick_rate = rate;
+    tick_interval_ns = 1000000000LL / rate;
+    keyframe_interval_ticks = (unsigned int)rate * KEYFRAME_INTERVAL_MS / 1000;
+    fire_cooldown_ticks = ((unsigned int)rate * FIRE_COOLDOWN_MS + 999) / 1000;
+    
+    if (count < 1) count = 1;
+    if (count > MAX_TICK_WORKERS) count = MAX_TICK_WORKERS;
+    tick_worker_count = count;
+    
+    long long now_slot = monotonic_ns() / 1000000LL;
+    
+    for (int i = 0; i < count; i++) {
+        TickWorker *w = &tick_workers[i];
+        pthread_condattr_t attr;
+        
+        memset(w, 0, sizeof(*w));
+        w->index = i;
+        w->wheel_pos = now_slot;
+        pthread_mutex_init(&w->mutex, NULL);
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&w->cond, &attr);
+        pthread_condattr_destroy(&attr);
+    }
+    
+    start_tick_workers();
+    
+    printf("Tick scheduler started with %d workers at %d Hz\n", count, rate);
+}
+
+void start_tick_workers() {
+    atomic_store(&tick_workers_stopping, 0);
+    
+    for (int i = 0; i < tick_worker_count; i++) {
+        if (pthread_create(&tick_workers[i].thread, NULL, tick_worker_main, &tick_workers[i]) != 0) {
+            perror("Failed to create tick worker");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+// 等各worker跑完手上的房间后退出；之后不会再有房间被tick，也不会有新帧入队
+void stop_tick_workers() {
+    atomic_store(&tick_workers_stopping, 1);
+    
+    for (int i = 0; i < tick_worker_count; i++) {
+        pthread_mutex_lock(&tick_workers[i].mutex);
+        pthread_cond_broadcast(&tick_workers[i].cond);
+        pthread_mutex_unlock(&tick_workers[i].mutex);
+    }
+    
+    for (int i = 0; i < tick_worker_count; i++) {
+        pthread_join(tick_workers[i].thread, NULL);
+    }
+}
+
+void init_room_pool(int max_rooms) {
+    memset(&room_pool, 0, sizeof(room_pool));
+    pthread_mutex_init(&room_pool.mutex, NULL);
+    
+    if (max_rooms > ROOM_ID_LIMIT) max_rooms = ROOM_ID_LIMIT;
+    room_pool.max_rooms = max_rooms;
+    
+    room_pool.free_ids = malloc(sizeof(int) * max_rooms);
+    if (!room_pool.free_ids) {
+        perror("Failed to allocate room pool");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void alloc_connections(int count) {
+    connections = calloc(count, sizeof(Connection));
+    sessions = calloc(count, sizeof(*sessions));
+    if (!connections || !sessions) {
+        perror("Failed to allocate connection table");
+        exit(EXIT_FAILURE);
+    }
+    
+    max_connections = count;
+    for (int i = 0; i < count; i++) {
+        pthread_mutex_init(&connections[i].mutex, NULL);
+    }
+    
+    unsigned int size = 1;
+    while (size < (unsigned int)count * 2) size <<= 1;
+    udp_tokens.tokens = calloc(size, sizeof(*udp_tokens.tokens));
+    udp_tokens.fds = calloc(size, sizeof(*udp_tokens.fds));
+    if (!udp_tokens.tokens || !udp_tokens.fds) {
+        perror("Failed to allocate UDP token table");
+        exit(EXIT_FAILURE);
+    }
+    udp_tokens.mask = size - 1;
+}
+    
+// 连接表大小受描述符上限约束：先把软上限提到硬上限，一半留给热重启时暂存接过来的描述符。
+// 没有指定时按所有房间坐满再加上观战和大厅里的连接来定，上限不够时房间实际坐不满
+void init_connections(int wanted, int max_rooms) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) < 0) {
+        perror("getrlimit failed");
+        exit(EXIT_FAILURE);
+    }
+    if (limit.rlim_cur < limit.rlim_max) {
+        rlim_t soft = limit.rlim_cur;
+        limit.rlim_cur = limit.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &limit) < 0) limit.rlim_cur = soft;
+    }
+    
+    long long fit = limit.rlim_cur / 2;
+    if (fit > MAX_CONNECTIONS_LIMIT) fit = MAX_CONNECTIONS_LIMIT;
+    
+    if (wanted > fit) {
+        fprintf(stderr, "--max-connections %d needs an open file limit of at least %d (ulimit -n)\n",
+                wanted, wanted * 2);
+        exit(EXIT_FAILURE);
+    }
+    
+    if (wanted == 0) {
+        long long full = (long long)max_rooms * players_per_room + CONNECTION_SPARE;
+        wanted = full < fit ? full : fit;
+        if (full > fit) {
+            printf("Open file limit allows %d connections (about %d full rooms); raise ulimit -n for more\n",
+                   wanted, wanted / players_per_room);
+        }
+    }
+    
+    alloc_connections(wanted);
+}
+
+Room *get_room(int room_id) {
+    if (room_id < 0 || room_id >= ROOM_ID_LIMIT) return NULL;
+    
+    Room **chunk = room_pool.chunks[room_id / ROOM_CHUNK_SIZE];
+    return chunk ? chunk[room_id % ROOM_CHUNK_SIZE] : NULL;
+}
+
+// 以下open链表操作调用者需持有room_pool.mutex
+void open_list_push(Room *room) {
+    if (room->in_open_list) return;
+    
+    room->open_prev = room_pool.open_tail;
+    room->open_next = NULL;
+    if (room_pool.open_tail) {
+        room_pool.open_tail->open_next = room;
+    } else {
+        room_pool.open_head = room;
+    }
+    room_pool.open_tail = room;
+    room->in_open_list = 1;
+}
+
+void open_list_remove(Room *room) {
+    if (!room->in_open_list) return;
+    
+    if (room->open_prev) {
+        room->open_prev->open_next = room->open_next;
+    } else {
+        room_pool.open_head = room->open_next;
+    }
+    if (room->open_next) {
+        room->open_next->open_prev = room->open_prev;
+    } else {
+        room_pool.open_tail = room->open_prev;
+    }
+    room->open_prev = NULL;
+    room->open_next = NULL;
+    room->in_open_list = 0;
+}
+
+void room_pool_update_open(Room *room) {
+    pthread_mutex_lock(&room_pool.mutex);
+    if (room->active && room->game.player_count < room->max_players) {
+        open_list_push(room);
+    } else {
+        open_list_remove(room);
+    }
+    pthread_mutex_unlock(&room_pool.mutex);
+}
+
+void room_free(Room *room) {
+    pthread_mutex_destroy(&room->mutex);
+    grid_free(&room->map);
+    grid_free(&room->tank_at);
+    room_history_free(room);
+    free(room);
+}
+
+// 空闲链表超过上限时释放闲置最久的房间，调用者需持有room_pool.mutex。
+// 回收前查到房间指针的线程可能还在用它，所以先挂到limbo上记下各线程的静默计数，
+// 等所有reactor和tick worker都过了一次静默点再真正释放
+void room_pool_trim() {
+    if (room_pool.limbo) {
+        if (!quiescent_elapsed(room_pool.limbo_quiescent)) return;
+        
+        while (room_pool.limbo) {
+            Room *room = room_pool.limbo;
+            room_pool.limbo = room->next_free;
+            room_free(room);
+        }
+    }
+    
+    time_t now = time(NULL);
+    Room **link = &room_pool.free_rooms;
+    int kept = 0;
+    
+    while (*link) {
+        Room *room = *link;
+        
+        if (kept >= ROOM_FREELIST_MAX && now - room->retired_at >= ROOM_RETIRE_SECONDS) {
+            *link = room->next_free;
+            room_pool.free_room_count--;
+            room->next_free = room_pool.limbo;
+            room_pool.limbo = room;
+            continue;
+        }
+        
+        kept++;
+        link = &room->next_free;
+    }
+    
+    if (room_pool.limbo) quiescent_snapshot(room_pool.limbo_quiescent);
+}
+
+// 调用者需持有room_pool.mutex，房间号所在的表块必须已经分配；失败时房间号由调用者归还
+Room *room_alloc_locked(int room_id) {
+    Room *room = room_pool.free_rooms;
+    if (room) {
+        room_pool.free_rooms = room->next_free;
+        room_pool.free_room_count--;
+    } else {
+        room = aligned_alloc(CACHE_LINE_SIZE, sizeof(Room));
+        if (!room) {
+            perror("Failed to allocate room");
+            return NULL;
+        }
+        memset(room, 0, sizeof(Room));
+        pthread_mutex_init(&room->mutex, NULL);
+        
+        // 输入队列只在分配时初始化一次，重用房间时可能仍有持旧指针的生产者
+        for (int i = 0; i < INPUT_QUEUE_SIZE; i++) {
+            atomic_init(&room->inputs.slots[i].sequence, i);
+        }
+    }
+    
+    if (room_configure(room) < 0) {
+        room->retired_at = time(NULL);
+        room->next_free = room_pool.free_rooms;
+        room_pool.free_rooms = room;
+        room_pool.free_room_count++;
+        perror("Failed to allocate room map");
+        return NULL;
+    }
+    
+    room->id = room_id;
+    room->next_free = NULL;
+    room_pool.chunks[room_id / ROOM_CHUNK_SIZE][room_id % ROOM_CHUNK_SIZE] = room;
+    room_pool.active_count++;
+    
+    return room;
+}
+
+// 确保房间号所在的表块已经分配，调用者需持有room_pool.mutex
+int room_chunk_ensure(int room_id) {
+    Room ***chunk = &room_pool.chunks[room_id / ROOM_CHUNK_SIZE];
+    if (!*chunk) {
+        *chunk = calloc(ROOM_CHUNK_SIZE, sizeof(Room *));
+        if (!*chunk) {
+            perror("Failed to allocate room table");
+            return -1;
+        }
+    }
+    
+    return 0;
+}
+
+Room *room_acquire() {
+    pthread_mutex_lock(&room_pool.mutex);
+    
+    if (room_pool.active_count >= room_pool.max_rooms) {
+        pthread_mutex_unlock(&room_pool.mutex);
+        return NULL;
+    }
+    
+    int room_id;
+    if (room_pool.free_id_count > 0) {
+        room_id = room_pool.free_ids[--room_pool.free_id_count];
+    } else {
+        room_id = room_pool.next_id;
+        if (room_chunk_ensure(room_id) < 0) {
+            pthread_mutex_unlock(&room_pool.mutex);
+            return NULL;
+        }
+        room_pool.next_id++;
+    }
+    
+    Room *room = room_alloc_locked(room_id);
+    if (!room) {
+        room_pool.free_ids[room_pool.free_id_count++] = room_id;
+        pthread_mutex_unlock(&room_pool.mutex);
+        return NULL;
+    }
+    
+    init_room(room);
+    
+    pthread_mutex_unlock(&room_pool.mutex);
+    
+    // 建日志文件放在池锁外面；房间进open链表之前没人能加入，日志不会漏记
+    if (replay_dir) {
+        pthread_mutex_lock(&room->mutex);
+        replay_open(room);
+        pthread_mutex_unlock(&room->mutex);
+    }
+    room_pool_update_open(room);
+    
+    return room;
+}
+
+// 热重启接管时按原来的房间号建房，客户端手里的房间号保持有效。房间号须按递增顺序传入，
+// 中间跳过的号码进空闲列表；返回的房间还没有初始化，也没有调度
+Room *room_adopt(int room_id) {
+    pthread_mutex_lock(&room_pool.mutex);
+    
+    if (room_id < room_pool.next_id || room_id >= room_pool.max_rooms) {
+        pthread_mutex_unlock(&room_pool.mutex);
+        return NULL;
+    }
+    
+    while (room_pool.next_id <= room_id) {
+        if (room_chunk_ensure(room_pool.next_id) < 0) {
+            pthread_mutex_unlock(&room_pool.mutex);
+            return NULL;
+        }
+        if (room_pool.next_id < room_id) {
+            room_pool.free_ids[room_pool.free_id_count++] = room_pool.next_id;
+        }
+        room_pool.next_id++;
+    }
+    
+    Room *room = room_alloc_locked(room_id);
+    if (!room) room_pool.free_ids[room_pool.free_id_count++] = room_id;
+    
+    pthread_mutex_unlock(&room_pool.mutex);
+    
+    return room;
+}
+
+// 由tick worker在房间停止后调用；房间对象先进空闲链表，无锁查找拿到的旧指针在被释放前
+// 一直可以访问，但可能已指向被重用的房间，使用前要在房间锁内核对active或会话（见apply_inputs）
+void room_release(Room *room) {
+    pthread_mutex_lock(&room_pool.mutex);
+    
+    open_list_remove(room);
+    room_pool.chunks[room->id / ROOM_CHUNK_SIZE][room->id % ROOM_CHUNK_SIZE] = NULL;
+    room_pool.free_ids[room_pool.free_id_count++] = room->id;
+    room_pool.active_count--;
+    
+    room->retired_at = time(NULL);
+    room->next_free = room_pool.free_rooms;
+    room_pool.free_rooms = room;
+    room_pool.free_room_count++;
+    
+    room_pool_trim();
+    
+    pthread_mutex_unlock(&room_pool.mutex);
+}
+
+Room *find_available_room() {
+    pthread_mutex_lock(&room_pool.mutex);
+    Room *room = room_pool.open_head;
+    pthread_mutex_unlock(&room_pool.mutex);
+    
+    return room ? room : room_acquire();
+}
+
+#define SESSION_ROOM(s) ((int)(((s) >> 8) & 0xFFFFFF) - 1)
+#define SESSION_SLOT(s) ((int)((s) & 0xFF))
+#define SESSION_GENERATION(s) ((unsigned int)((s) >> 32))
+
+// 每次绑定或解绑都推进代数，持锁后再比对一次就能发现查找之后发生的变化
+void session_bind(int client_fd, int room_id, int slot) {
+    if (client_fd < 0 || client_fd >= max_connections) return;
+    
+    unsigned long long old = atomic_load(&sessions[client_fd]);
+    unsigned long long generation = SESSION_GENERATION(old) + 1ULL;
+    
+    atomic_store(&sessions[client_fd], (generation << 32) |
+                 ((unsigned long long)(room_id + 1) << 8) | (unsigned long long)slot);
+}
+
+void session_unbind(int client_fd) {
+    if (client_fd < 0 || client_fd >= max_connections) return;
+    
+    unsigned long long old = atomic_load(&sessions[client_fd]);
+    unsigned long long generation = SESSION_GENERATION(old) + 1ULL;
+    
+    atomic_store(&sessions[client_fd], generation << 32);
+}
+
+unsigned long long session_lookup(int client_fd) {
+    if (client_fd < 0 || client_fd >= max_connections) return 0;
+    
+    return atomic_load(&sessions[client_fd]);
+}
+
+int add_player(int client_fd, const char* username, Room *room) {
+    pthread_mutex_lock(&room->mutex);
+    
+    if (!room->active || room->game.player_count >= room->max_players) {
+        room_pool_update_open(room);
+        pthread_mutex_unlock(&room->mutex);
+        return -1;
+    }
+    
+    int id = player_join(room, client_fd, username);
+    session_bind(client_fd, room->id, id);
+    room_pool_update_open(room);
+    
+    pthread_mutex_unlock(&room->mutex);
+    
+    return id;
+}
+
+void remove_player(Room *room, int client_fd) {
+    pthread_mutex_lock(&room->mutex);
+    
+    int i;
+    for (i = 0; i < room->game.player_count; i++) {
+        if (room->game.players[i].fd == client_fd) {
+            break;
+        }
+    }
+    
+    if (i == room->game.player_count) {
+        pthread_mutex_unlock(&room->mutex);
+        return;
+    }
+    
+    session_unbind(client_fd);
+    player_leave(room, i);
+    for (int j = i; j < room->game.player_count; j++) {
+        session_bind(room->game.players[j].fd, room->id, j);
+    }
+    
+    if (room->game.player_count == 0) {
+        room->active = 0;
+        debug_log("Room %d is now inactive\n", room->id);
+    }
+    
+    room_pool_update_open(room);
+    room_wake(room);
+    
+    pthread_mutex_unlock(&room->mutex);
+}
+
+// 观战者只接收帧流，会话槽位从SPECTATOR_SLOT_BASE开始
+int add_spectator(int client_fd, Room *room) {
+    pthread_mutex_lock(&room->mutex);
+    
+    if (!room->active || room->spectator_count >= MAX_SPECTATORS) {
+        pthread_mutex_unlock(&room->mutex);
+        return -1;
+    }
+    
+    int index = room->spectator_count++;
+    room->spectators[index].fd = client_fd;
+    memset(&room->spectators[index].view, 0, sizeof(ViewState));
+    room->spectators[index].view.need_keyframe = 1;
+    session_bind(client_fd, room->id, SPECTATOR_SLOT_BASE + index);
+    
+    pthread_mutex_unlock(&room->mutex);
+    
+    return index;
+}
+
+void remove_spectator(Room *room, int client_fd) {
+    pthread_mutex_lock(&room->mutex);
+    
+    for (int i = 0; i < room->spectator_count; i++) {
+        if (room->spectators[i].fd != client_fd) continue;
+        
+        session_unbind(client_fd);
+        room->spectator_count--;
+        if (i != room->spectator_count) {
+            room->spectators[i] = room->spectators[room->spectator_count];
+            session_bind(room->spectators[i].fd, room->id, SPECTATOR_SLOT_BASE + i);
+        }
+        break;
+    }
+    
+    pthread_mutex_unlock(&room->mutex);
+}
+
+Room *find_room_for_client(int client_fd) {
+    return get_room(SESSION_ROOM(session_lookup(client_fd)));
+}
+
+int input_queue_push(InputQueue *q, const InputCommand *cmd) {
+    unsigned int pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+    InputSlot *slot;
+    
+    while (1) {
+        slot = &q->slots[pos % INPUT_QUEUE_SIZE];
+        unsigned int sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        int diff = (int)(sequence - pos);
+        
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            atomic_fetch_add_explicit(&q->dropped, 1, memory_order_relaxed);
+            return -1;
+        } else {
+            pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+        }
+    }
+    
+    slot->cmd = *cmd;
+    atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+    
+    return 0;
+}
+
+// 只能由持有房间锁的tick调用
+int input_queue_empty(InputQueue *q) {
+    InputSlot *slot = &q->slots[q->dequeue_pos % INPUT_QUEUE_SIZE];
+    unsigned int sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+    
+    return (int)(sequence - (q->dequeue_pos + 1)) < 0;
+}
+
+// 只能由持有房间锁的tick调用
+int input_queue_pop(InputQueue *q, InputCommand *cmd) {
+    InputSlot *slot = &q->slots[q->dequeue_pos % INPUT_QUEUE_SIZE];
+    unsigned int sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+    
+    if ((int)(sequence - (q->dequeue_pos + 1)) < 0) return 0;
+    
+    *cmd = slot->cmd;
+    atomic_store_explicit(&slot->sequence, q->dequeue_pos + INPUT_QUEUE_SIZE, memory_order_release);
+    q->dequeue_pos++;
+    
+    return 1;
+}
+
+// 每个连接一个令牌桶：每秒补充input_rate个（另加每tick一次确认的额度），最多攒INPUT_BURST个；
+// 令牌用完的输入在进入房间队列之前就丢掉，刷输入的客户端挤不占别人的队列和tick时间
+int input_allowed(int client_fd) {
+    Connection *c = &connections[client_fd];
+    long long now = monotonic_ns();
+    int allowed = 0;
+    
+    pthread_mutex_lock(&c->mutex);
+    c->input_tokens += (now - c->input_refill_ns) * (input_rate + tick_rate) / 1000000;
+    if (c->input_tokens > INPUT_BURST * 1000LL) c->input_tokens = INPUT_BURST * 1000LL;
+    c->input_refill_ns = now;
+    
+    if (c->input_tokens >= 1000) {
+        c->input_tokens -= 1000;
+        allowed = 1;
+    } else {
+        c->inputs_limited++;
+    }
+    pthread_mutex_unlock(&c->mutex);
+    
+    return allowed;
+}
+
+void enqueue_input(int client_fd, int type, unsigned int arg, unsigned int seq, unsigned int seen_tick) {
+    if (!input_allowed(client_fd)) return;
+    
+    unsigned long long session = session_lookup(client_fd);
+    Room *room = get_room(SESSION_ROOM(session));
+    if (!room) return;
+    
+    InputCommand cmd;
+    cmd.fd = client_fd;
+    cmd.session = session;
+    cmd.type = type;
+    cmd.arg = arg;
+    cmd.seq = seq;
+    cmd.seen_tick = seen_tick;
+    cmd.queued_ns = monotonic_ns();
+    
+    if (input_queue_push(&room->inputs, &cmd) == 0) room_wake(room);
+}
+
+// 在tick开始时按入队顺序应用所有输入；入队后会话变过（离开、槽位移动）的命令直接丢弃。
+// 同一玩家一个tick内连续的移动只取最后一个方向，射击之前先落实它前面的移动
+void apply_inputs(Room *room) {
+    InputCommand cmd;
+    PlayerMask pending = 0;
+    unsigned char pending_dir[MAX_PLAYERS];
+    long long now = monotonic_ns();
+    
+    while (input_queue_pop(&room->inputs, &cmd)) {
+        METRIC_TIME(input_latency, now - cmd.queued_ns);
+        METRIC_ADD(inputs_applied, 1);
+        
+        if (session_lookup(cmd.fd) != cmd.session) continue;
+        
+        int slot = SESSION_SLOT(cmd.session);
+        if (SESSION_ROOM(cmd.session) != room->id) continue;
+        
+        ViewState *view = NULL;
+        if (slot >= SPECTATOR_SLOT_BASE) {
+            // 观战者只能确认快照
+            if (cmd.type != INPUT_ACK || slot - SPECTATOR_SLOT_BASE >= room->spectator_count) continue;
+            view = &room->spectators[slot - SPECTATOR_SLOT_BASE].view;
+        } else {
+            if (slot >= room->game.player_count) continue;
+            view = &room->views[slot];
+        }
+        
+        if (cmd.type != INPUT_ACK && cmd.seq && (int)(cmd.seq - room->game.players[slot].input_seq) > 0) {
+            room->game.players[slot].input_seq = cmd.seq;
+        }
+        
+        switch (cmd.type) {
+            case INPUT_MOVE:
+                pending |= PLAYER_BIT(slot);
+                pending_dir[slot] = cmd.arg;
+                break;
+            case INPUT_SHOOT: {
+                if (pending & PLAYER_BIT(slot)) {
+                    replay_event(room, REC_MOVE, slot, pending_dir[slot]);
+                    move_tank(room, slot, pending_dir[slot]);
+                    pending &= ~PLAYER_BIT(slot);
+                }
+                unsigned int seen_tick = cmd.seen_tick ? cmd.seen_tick : room->tick;
+                replay_event(room, REC_SHOOT, slot, room->tick - seen_tick);
+                shoot(room, slot, seen_tick);
+                break;
+            }
+            case INPUT_ACK:
+                if ((int)(cmd.arg - view->acked_tick) > 0 && (int)(room->tick - cmd.arg) >= 0) {
+                    view->acked_tick = cmd.arg;
+                }
+                break;
+        }
+    }
+    
+    for (PlayerMask m = pending; m; m &= m - 1) {
+        int slot = __builtin_ctzll(m);
+        replay_event(room, REC_MOVE, slot, pending_dir[slot]);
+        move_tank(room, slot, pending_dir[slot]);
+    }
+}
+
+void remove_player_from_room(int client_fd) {
+    unsigned long long session = session_lookup(client_fd);
+    Room *room = get_room(SESSION_ROOM(session));
+    if (room == NULL) return;
+    
+    if (SESSION_SLOT(session) >= SPECTATOR_SLOT_BASE) {
+        remove_spectator(room, client_fd);
+    } else {
+        remove_player(room, client_fd);
+    }
+}
+
+// 只在tick中调用，调用者需持有房间锁
+// 延迟补偿：子弹当作在射手看到的那个tick之后立即射出，逐tick对照历史快照里
+// 各坦克当时的位置推进到现在；墙按当前地图算，命中的目标在当前状态里被击毁。
+// 子弹在途中消失返回-1，否则(x,y)更新为现在应处的位置
+int rewind_shot(Room *room, int player_id, unsigned int seen_tick, int *x, int *y) {
+    int limit = MAX_REWIND_MS * tick_rate / 1000;
+    if (limit > SNAPSHOT_HISTORY - 1) limit = SNAPSHOT_HISTORY - 1;
+    
+    int rewind = room->tick - seen_tick;
+    if (rewind <= 1) return 0;
+    if (rewind > limit) seen_tick = room->tick - limit;
+    
+    Snapshot *prev = &room->snapshots[seen_tick % SNAPSHOT_HISTORY];
+    if (!prev->valid || prev->tick != seen_tick) return 0;
+    
+    int direction = room->game.players[player_id].direction;
+    
+    for (unsigned int t = seen_tick + 1; t != room->tick; t++) {
+        Snapshot *s = &room->snapshots[t % SNAPSHOT_HISTORY];
+        // 中途换过地图或玩家进出，更早的位置已经对不上
+        if (!s->valid || s->tick != t || s->roster_version != room->roster_version ||
+            s->map_version != room->map_version) {
+            break;
+        }
+        
+        for (unsigned int step = prev->bullet_steps; step != s->bullet_steps; step++) {
+            advance_position(x, y, direction, 1);
+            if (*x < 0 || *x >= room->width || *y < 0 || *y >= room->height) return -1;
+            
+            unsigned char cell = GRID_CELL(&room->map, *x, *y);
+            if (cell == WALL) return -1;
+            if (cell == DESTRUCTIBLE_WALL) {
+                GRID_CELL(&room->map, *x, *y) = EMPTY;
+                log_map_change(room, *x, *y, EMPTY);
+                return -1;
+            }
+            
+            for (int k = 0; k < room->game.player_count; k++) {
+                if (k == player_id || !s->tanks[k].alive || !room->game.players[k].alive) continue;
+                if (s->tanks[k].x == *x && s->tanks[k].y == *y) {
+                    eliminate_player(room, k);
+                    return -1;
+                }
+            }
+        }
+        
+        prev = s;
+    }
+    
+    return 0;
+}
+
+void shoot(Room *room, int player_id, unsigned int seen_tick) {
+    Player *p = &room->game.players[player_id];
+    if (!p->alive) {
+        return;
+    }
+    
+    // 射击冷却按tick计
+    if ((int)(room->tick - p->next_fire_tick) < 0) {
+        return;
+    }
+    
+    BulletSet *bullets = &room->game.bullets;
+    BulletMask free_slots = ~bullets->active & BULLET_SLOTS_MASK;
+    if (!free_slots) {
+        return;
+    }
+    
+    int bullet_id = __builtin_ctzll(free_slots);
+    
+    int x = p->x;
+    int y = p->y;
+    
+    switch (p->direction) {
+        case UP:    y--; break;
+        case RIGHT: x++; break;
+        case DOWN:  y++; break;
+        case LEFT:  x--; break;
+    }
+    
+    if (x < 0 || x >= room->width || y < 0 || y >= room->height ||
+        GRID_CELL(&room->map, x, y) == WALL) {
+        return;
+    }
+    
+    p->next_fire_tick = room->tick + fire_cooldown_ticks;
+    
+    if (rewind_shot(room, player_id, seen_tick, &x, &y) < 0) {
+        return;
+    }
+    
+    bullets->active |= BULLET_BIT(bullet_id);
+    bullets->x[bullet_id] = x;
+    bullets->y[bullet_id] = y;
+    bullets->direction[bullet_id] = p->direction;
+    bullets->owner_id[bullet_id] = player_id + 1;
+}
+
+// 只在tick中调用，调用者需持有房间锁
+void move_tank(Room *room, int player_id, int direction) {
+    Player *p = &room->game.players[player_id];
+    if (!p->alive) {
+        return;
+    }
+    
+    p->direction = direction;
+    
+    int new_x = p->x;
+    int new_y = p->y;
+    
+    switch (direction) {
+        case UP:    new_y--; break;
+        case RIGHT: new_x++; break;
+        case DOWN:  new_y++; break;
+        case LEFT:  new_x--; break;
+    }
+    
+    if (new_x < 0 || new_x >= room->width || new_y < 0 || new_y >= room->height) {
+        return;
+    }
+    
+    if (GRID_CELL(&room->map, new_x, new_y) == EMPTY && !GRID_CELL(&room->tank_at, new_x, new_y)) {
+        vacate_cell(room, p->x, p->y, player_id);
+        occupy_cell(room, new_x, new_y, player_id);
+        p->x = new_x;
+        p->y = new_y;
+    }
+}
+
+// 一次推进所有槽位的子弹（空槽位也一并计算，结果不会被读取），返回越界的槽位；
+// 撞墙和命中由调用者按槽位顺序逐个确认
+BulletMask step_bullets(BulletSet *bullets, int width, int height) {
+    BulletMask out = 0;
+    
+#if defined(__AVX2__)
+    __m256i max_x = _mm256_set1_epi8((char)(width - 1));
+    __m256i max_y = _mm256_set1_epi8((char)(height - 1));
+    
+    for (int base = 0; base < MAX_BULLETS; base += 32) {
+        __m256i dir = _mm256_loadu_si256((const __m256i *)(bullets->direction + base));
+        __m256i x = _mm256_loadu_si256((const __m256i *)(bullets->x + base));
+        __m256i y = _mm256_loadu_si256((const __m256i *)(bullets->y + base));
+        
+        // 比较结果为全1（即-1），减去它等于加1
+        x = _mm256_sub_epi8(x, _mm256_cmpeq_epi8(dir, _mm256_set1_epi8(RIGHT)));
+        x = _mm256_add_epi8(x, _mm256_cmpeq_epi8(dir, _mm256_set1_epi8(LEFT)));
+        y = _mm256_sub_epi8(y, _mm256_cmpeq_epi8(dir, _mm256_set1_epi8(DOWN)));
+        y = _mm256_add_epi8(y, _mm256_cmpeq_epi8(dir, _mm256_set1_epi8(UP)));
+        
+        _mm256_storeu_si256((__m256i *)(bullets->x + base), x);
+        _mm256_storeu_si256((__m256i *)(bullets->y + base), y);
+        
+        // 无符号比较 x <= width-1 等价于 max(x, width-1) == width-1，越过0的会回绕成255；
+        // 用width-1比较是为了256宽的地图也能放进一个字节
+        __m256i inside = _mm256_and_si256(
+            _mm256_cmpeq_epi8(_mm256_max_epu8(x, max_x), max_x),
+            _mm256_cmpeq_epi8(_mm256_max_epu8(y, max_y), max_y));
+        out |= (BulletMask)(~(unsigned int)_mm256_movemask_epi8(inside)) << base;
+    }
+#elif defined(__SSE2__)
+    __m128i max_x = _mm_set1_epi8((char)(width - 1));
+    __m128i max_y = _mm_set1_epi8((char)(height - 1));
+    
+    for (int base = 0; base < MAX_BULLETS; base += 16) {
+        __m128i dir = _mm_loadu_si128((const __m128i *)(bullets->direction + base));
+        __m128i x = _mm_loadu_si128((const __m128i *)(bullets->x + base));
+        __m128i y = _mm_loadu_si128((const __m128i *)(bullets->y + base));
+        
+        // 比较结果为全1（即-1），减去它等于加1
+        x = _mm_sub_epi8(x, _mm_cmpeq_epi8(dir, _mm_set1_epi8(RIGHT)));
+        x = _mm_add_epi8(x, _mm_cmpeq_epi8(dir, _mm_set1_epi8(LEFT)));
+        y = _mm_sub_epi8(y, _mm_cmpeq_epi8(dir, _mm_set1_epi8(DOWN)));
+        y = _mm_add_epi8(y, _mm_cmpeq_epi8(dir, _mm_set1_epi8(UP)));
+        
+        _mm_storeu_si128((__m128i *)(bullets->x + base), x);
+        _mm_storeu_si128((__m128i *)(bullets->y + base), y);
+        
+        // 无符号比较 x <= width-1 等价于 max(x, width-1) == width-1，越过0的会回绕成255；
+        // 用width-1比较是为了256宽的地图也能放进一个字节
+        __m128i inside = _mm_and_si128(
+            _mm_cmpeq_epi8(_mm_max_epu8(x, max_x), max_x),
+            _mm_cmpeq_epi8(_mm_max_epu8(y, max_y), max_y));
+        out |= (BulletMask)(~(unsigned int)_mm_movemask_epi8(inside) & 0xFFFF) << base;
+    }
+#else
+    for (int i = 0; i < MAX_BULLETS; i++) {
+        unsigned char x = bullets->x[i];
+        unsigned char y = bullets->y[i];
+        
+        switch (bullets->direction[i]) {
+            case UP:    y--; break;
+            case RIGHT: x++; break;
+            case DOWN:  y++; break;
+            case LEFT:  x--; break;
+        }
+        
+        bullets->x[i] = x;
+        bullets->y[i] = y;
+        
+        if (x >= width || y >= height) out |= BULLET_BIT(i);
+    }
+#endif
+    
+    return out;
+}
+
+void eliminate_player(Room *room, int index) {
+    Player *p = &room->game.players[index];
+    
+    p->alive = 0;
+    vacate_cell(room, p->x, p->y, index);
+    
+    debug_log("Player %s was eliminated in Room %d!\n", p->username, room->id);
+    
+    int alive_count = 0;
+    int last_alive = -1;
+    for (int k = 0; k < room->game.player_count; k++) {
+        if (room->game.players[k].alive) {
+            alive_count++;
+            last_alive = k;
+        }
+    }
+    
+    if (alive_count == 1 && room->game.game_started && !room->game.game_over) {
+        room->game.game_over = 1;
+        room->game.winner_id = room->game.players[last_alive].id;
+        debug_log("Game over in Room %d! Player %s wins!\n", 
+               room->id, room->game.players[last_alive].username);
+    }
+}
+
+// 子弹按槽位顺序结算：前面的子弹打掉的墙和坦克对后面的子弹立即生效
+void update_bullets(Room *room) {
+    BulletSet *bullets = &room->game.bullets;
+    
+    room->bullet_steps++;
+    
+    if (!bullets->active) return;
+    
+    BulletMask out = step_bullets(bullets, room->width, room->height);
+    bullets->active &= ~out;
+    
+    for (BulletMask m = bullets->active; m; m &= m - 1) {
+        int i = __builtin_ctzll(m);
+        int x = bullets->x[i];
+        int y = bullets->y[i];
+        
+        unsigned char cell = GRID_CELL(&room->map, x, y);
+        
+        if (cell == WALL) {
+            bullets->active &= ~BULLET_BIT(i);
+            continue;
+        }
+        
+        if (cell == DESTRUCTIBLE_WALL) {
+            GRID_CELL(&room->map, x, y) = EMPTY;
+            log_map_change(room, x, y, EMPTY);
+            bullets->active &= ~BULLET_BIT(i);
+            continue;
+        }
+        
+        int target = GRID_CELL(&room->tank_at, x, y);
+        if (target && bullets->owner_id[i] != room->game.players[target - 1].id) {
+            eliminate_player(room, target - 1);
+            bullets->active &= ~BULLET_BIT(i);
+        }
+    }
+}
+
+// capacity是消息内容的最大长度，不超过BUFFER_SIZE的都从帧池里取标准大小的缓冲区
+FrameBuf *frame_alloc(int capacity) {
+    FrameBuf *frame = NULL;
+    
+    if (capacity > MAX_FRAME_PAYLOAD) return NULL;
+    
+    if (capacity <= BUFFER_SIZE) {
+        capacity = BUFFER_SIZE;
+        
+        pthread_mutex_lock(&frame_pool.mutex);
+        frame = frame_pool.free_list;
+        if (frame) {
+            frame_pool.free_list = frame->next_free;
+            frame_pool.free_count--;
+        }
+        pthread_mutex_unlock(&frame_pool.mutex);
+    }
+    
+    if (!frame) {
+        frame = malloc(sizeof(FrameBuf) + FRAME_HEADER_SIZE + capacity);
+        if (!frame) {
+            perror("Failed to allocate frame");
+            return NULL;
+        }
+        frame->capacity = capacity;
+    }
+    
+    atomic_init(&frame->refs, 1);
+    frame->len = 0;
+    frame->next_free = NULL;
+    
+    return frame;
+}
+
+// 消息内容写在 frame->data + FRAME_HEADER_SIZE 处，写完后调用它补上长度前缀
+void frame_seal(FrameBuf *frame, int payload_len) {
+    frame->data[0] = payload_len >> 8;
+    frame->data[1] = payload_len;
+    frame->len = FRAME_HEADER_SIZE + payload_len;
+}
+
+void frame_ref(FrameBuf *frame) {
+    atomic_fetch_add_explicit(&frame->refs, 1, memory_order_relaxed);
+}
+
+void frame_unref(FrameBuf *frame) {
+    if (atomic_fetch_sub_explicit(&frame->refs, 1, memory_order_acq_rel) != 1) return;
+    
+    if (frame->capacity != BUFFER_SIZE) {
+        free(frame);
+        return;
+    }
+    
+    pthread_mutex_lock(&frame_pool.mutex);
+    if (frame_pool.free_count < FRAME_POOL_MAX) {
+        frame->next_free = frame_pool.free_list;
+        frame_pool.free_list = frame;
+        frame_pool.free_count++;
+        frame = NULL;
+    }
+    pthread_mutex_unlock(&frame_pool.mutex);
+    
+    free(frame);
+}
+
+unsigned int udp_token_home(unsigned long long token) {
+    return (token ^ (token >> 32)) & udp_tokens.mask;
+}
+
+// 以下三个函数调用者需持有udp_tokens.mutex；0不是合法令牌
+unsigned int udp_token_find_locked(unsigned long long token) {
+    unsigned int i = udp_token_home(token);
+    while (udp_tokens.tokens[i] && udp_tokens.tokens[i] != token) {
+        i = (i + 1) & udp_tokens.mask;
+    }
+    
+    return i;
+}
+
+void udp_token_insert_locked(unsigned long long token, int fd) {
+    unsigned int i = udp_token_find_locked(token);
+    udp_tokens.tokens[i] = token;
+    udp_tokens.fds[i] = fd;
+}
+
+void udp_token_remove_locked(unsigned long long token) {
+    unsigned int i = udp_token_find_locked(token);
+    if (!udp_tokens.tokens[i]) return;
+    
+    // 后面的项如果本该落在i或更前面，就挪到i上，保证查找时探测链不断
+    for (unsigned int j = (i + 1) & udp_tokens.mask; udp_tokens.tokens[j]; j = (j + 1) & udp_tokens.mask) {
+        unsigned int home = udp_token_home(udp_tokens.tokens[j]);
+        if (((j - home) & udp_tokens.mask) >= ((j - i) & udp_tokens.mask)) {
+            udp_tokens.tokens[i] = udp_tokens.tokens[j];
+            udp_tokens.fds[i] = udp_tokens.fds[j];
+            i = j;
+        }
+    }
+    udp_tokens.tokens[i] = 0;
+}
+
+// 返回令牌对应的fd，没有返回-1；拿到的fd还要在连接锁内核对令牌
+int udp_token_lookup(unsigned long long token) {
+    if (!token) return -1;
+    
+    pthread_mutex_lock(&udp_tokens.mutex);
+    unsigned int i = udp_token_find_locked(token);
+    int fd = udp_tokens.tokens[i] ? udp_tokens.fds[i] : -1;
+    pthread_mutex_unlock(&udp_tokens.mutex);
+    
+    return fd;
+}
+
+// 登记连接的UDP令牌（热重启接管时传入旧进程的令牌），token为0时生成一个新的随机令牌
+void udp_token_register(Connection *c, int fd, unsigned long long token) {
+    pthread_mutex_lock(&udp_tokens.mutex);
+    while (!token || udp_tokens.tokens[udp_token_find_locked(token)]) {
+        if (getrandom(&token, sizeof(token), 0) != sizeof(token)) {
+            token = monotonic_ns();
+        }
+    }
+    udp_token_insert_locked(token, fd);
+    pthread_mutex_unlock(&udp_tokens.mutex);
+    
+    c->udp_token = token;
+}
+
+void udp_token_unregister(Connection *c) {
+    if (!c->udp_token) return;
+    
+    pthread_mutex_lock(&udp_tokens.mutex);
+    udp_token_remove_locked(c->udp_token);
+    pthread_mutex_unlock(&udp_tokens.mutex);
+    
+    c->udp_token = 0;
+}
+
+void conn_open(int fd, int epoll_fd) {
+    Connection *c = &connections[fd];
+    
+    pthread_mutex_lock(&c->mutex);
+    c->active = 1;
+    c->epoll_fd = epoll_fd;
+    c->closing = 0;
+    c->head = 0;
+    c->count = 0;
+    c->head_sent = 0;
+    c->dropped_frames = 0;
+    c->in_len = 0;
+    
+    // 令牌是64位随机数，连接关闭时从表里撤掉，fd被重用后旧令牌自然失效
+    udp_token_unregister(c);
+    udp_token_register(c, fd, 0);
+    c->udp_bound = 0;
+    c->udp_send_seq = 0;
+    c->udp_recv_seq = 0;
+    c->udp_recv_bits = 0;
+    c->udp_input_next = 0;
+    c->udp_acked_tick = 0;
+    memset(c->udp_sent_seq, 0, sizeof(c->udp_sent_seq));
+    c->input_tokens = INPUT_BURST * 1000LL;
+    c->input_refill_ns = monotonic_ns();
+    c->inputs_limited = 0;
+    pthread_mutex_unlock(&c->mutex);
+}
+
+void conn_close(int fd) {
+    Connection *c = &connections[fd];
+    
+    pthread_mutex_lock(&c->mutex);
+    for (int i = 0; i < c->count; i++) {
+        frame_unref(c->queue[(c->head + i) % OUT_QUEUE_FRAMES].frame);
+    }
+    c->active = 0;
+    c->count = 0;
+    c->head_sent = 0;
+    c->udp_bound = 0;
+    udp_token_unregister(c);
+    pthread_mutex_unlock(&c->mutex);
+}
+
+// 调用者需持有连接锁
+int conn_flush_locked(int fd, Connection *c) {
+    long long now = 0;
+    
+    while (c->count > 0) {
+        struct iovec iov[OUT_QUEUE_FRAMES];
+        int iovcnt = 0;
+        
+        for (int i = 0; i < c->count; i++) {
+            OutFrame *f = &c->queue[(c->head + i) % OUT_QUEUE_FRAMES];
+            int skip = (i == 0) ? c->head_sent : 0;
+            iov[iovcnt].iov_base = f->frame->data + skip;
+            iov[iovcnt].iov_len = f->frame->len - skip;
+            iovcnt++;
+        }
+        
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        
+        ssize_t written = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        
+        METRIC_ADD(tcp_bytes_out, written);
+        
+        while (written > 0 && c->count > 0) {
+            OutFrame *f = &c->queue[c->head];
+            int remaining = f->frame->len - c->head_sent;
+            
+            if (written < remaining) {
+                c->head_sent += written;
+                break;
+            }
+            
+            written -= remaining;
+            if (!now) now = monotonic_ns();
+            METRIC_TIME(send_latency, now - f->queued_ns);
+            frame_unref(f->frame);
+            c->head = (c->head + 1) % OUT_QUEUE_FRAMES;
+            c->count--;
+            c->head_sent = 0;
+        }
+    }
+    
+    return 0;
+}
+
+int conn_flush(int fd) {
+    Connection *c = &connections[fd];
+    
+    pthread_mutex_lock(&c->mutex);
+    int result = c->active ? conn_flush_locked(fd, c) : 0;
+    pthread_mutex_unlock(&c->mutex);
+    
+    return result;
+}
+
+// 落后的客户端只需要最新的快照：新增量帧替换队列中尚未开始发送的增量帧，
+// 新关键帧同时替换尚未发送的关键帧和增量帧，控制消息从不丢弃
+void conn_drop_stale(Connection *c, int kind) {
+    int kept = 0;
+    
+    for (int i = 0; i < c->count; i++) {
+        OutFrame f = c->queue[(c->head + i) % OUT_QUEUE_FRAMES];
+        int in_flight = (i == 0 && c->head_sent > 0);
+        int stale = !in_flight && f.kind != FRAME_CONTROL && f.kind <= kind;
+        
+        if (stale) {
+            frame_unref(f.frame);
+            c->dropped_frames++;
+            continue;
+        }
+        
+        c->queue[(c->head + kept) % OUT_QUEUE_FRAMES] = f;
+        kept++;
+    }
+    
+    c->count = kept;
+}
+
+// 入队时只增加引用计数，不复制数据
+int conn_send_frame(int fd, FrameBuf *frame, int kind) {
+    if (fd < 0 || fd >= max_connections) return -1;
+    
+    Connection *c = &connections[fd];
+    
+    pthread_mutex_lock(&c->mutex);
+    
+    if (!c->active || c->closing) {
+        pthread_mutex_unlock(&c->mutex);
+        return -1;
+    }
+    
+    if (kind != FRAME_CONTROL) {
+        conn_drop_stale(c, kind);
+    }
+    
+    if (c->count == OUT_QUEUE_FRAMES) {
+        // 队列被控制消息塞满，客户端已经跟不上，断开交给epoll循环清理
+        c->closing = 1;
+        shutdown(fd, SHUT_RDWR);
+        pthread_mutex_unlock(&c->mutex);
+        return -1;
+    }
+    
+    frame_ref(frame);
+    OutFrame *f = &c->queue[(c->head + c->count) % OUT_QUEUE_FRAMES];
+    f->frame = frame;
+    f->kind = kind;
+    f->queued_ns = monotonic_ns();
+    c->count++;
+    
+    // 之前没有积压时顺手尝试写一次，写不完的等EPOLLOUT
+    if (c->count == 1 && conn_flush_locked(fd, c) < 0) {
+        c->closing = 1;
+        shutdown(fd, SHUT_RDWR);
+    }
+    
+    pthread_mutex_unlock(&c->mutex);
+    
+    return 0;
+}
+
+// 单个接收者的消息，打包成帧后发送
+int conn_send(int fd, const unsigned char *data, int len, int kind) {
+    FrameBuf *frame = frame_alloc(len);
+    if (!frame) return -1;
+    
+    memcpy(frame->data + FRAME_HEADER_SIZE, data, len);
+    frame_seal(frame, len);
+    
+    int result = conn_send_frame(fd, frame, kind);
+    frame_unref(frame);
+    
+    return result;
+}
+
+// 增量帧丢了也无妨：客户端不确认，服务器就继续以更早的基线编码，变化会在后面的帧里补上
+int udp_send_frame(int fd, FrameBuf *frame, unsigned int tick) {
+    Connection *c = &connections[fd];
+    unsigned char header[UDP_SERVER_HEADER];
+    struct sockaddr_in addr;
+    
+    pthread_mutex_lock(&c->mutex);
+    if (!c->active || c->closing || !c->udp_bound) {
+        pthread_mutex_unlock(&c->mutex);
+        return -1;
+    }
+    
+    unsigned int seq = ++c->udp_send_seq;
+    c->udp_sent_seq[seq % UDP_ACK_WINDOW] = seq;
+    c->udp_sent_tick[seq % UDP_ACK_WINDOW] = tick;
+    put_u32(header, seq);
+    put_u32(header + 4, c->udp_recv_seq);
+    put_u32(header + 8, c->udp_recv_bits);
+    addr = c->udp_addr;
+    pthread_mutex_unlock(&c->mutex);
+    
+    struct iovec iov[2];
+    iov[0].iov_base = header;
+    iov[0].iov_len = UDP_SERVER_HEADER;
+    iov[1].iov_base = frame->data + FRAME_HEADER_SIZE;
+    iov[1].iov_len = frame->len - FRAME_HEADER_SIZE;
+    
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &addr;
+    msg.msg_namelen = sizeof(addr);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    
+    // 发送缓冲区满当作丢包处理
+    ssize_t sent = sendmsg(udp_fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (sent > 0) {
+        METRIC_ADD(udp_bytes_out, sent);
+        METRIC_ADD(udp_packets_out, 1);
+    }
+    
+    return 0;
+}
+
+// 放得进一个数据报的增量帧在UDP通道绑定后走UDP，关键帧和其余消息仍走TCP
+int send_state_frame(int fd, FrameBuf *frame, int kind, unsigned int tick) {
+    if (kind == FRAME_DELTA && frame->len - FRAME_HEADER_SIZE <= UDP_MAX_PAYLOAD &&
+        udp_send_frame(fd, frame, tick) == 0) {
+        return 0;
+    }
+    
+    return conn_send_frame(fd, frame, kind);
+}
+
+// 令牌后面附上tick频率和输入限速，客户端据此合并移动、在本地按同样的令牌桶节流，
+// 不去预测服务器会合并掉或者丢弃的移动
+void send_session_token(int client_fd) {
+    unsigned char buffer[12];
+    Connection *c = &connections[client_fd];
+    
+    pthread_mutex_lock(&c->mutex);
+    unsigned long long token = c->udp_token;
+    pthread_mutex_unlock(&c->mutex);
+    
+    buffer[0] = CMD_TOKEN;
+    put_u32(buffer + 1, token >> 32);
+    put_u32(buffer + 5, token & 0xFFFFFFFF);
+    buffer[9] = tick_rate;
+    buffer[10] = (input_rate > 0xFFFF ? 0xFFFF : input_rate) >> 8;
+    buffer[11] = input_rate > 0xFFFF ? 0xFF : input_rate;
+    
+    conn_send(client_fd, buffer, 12, FRAME_CONTROL);
+}
+
+void send_room_assignment(int client_fd, int room_id, int player_id) {
+    unsigned char buffer[8];
+    
+    buffer[0] = CMD_ROOM_ASSIGN;
+    
+    put_u32(buffer + 1, room_id);
+    
+    buffer[5] = player_id + 1;
+    
+    conn_send(client_fd, buffer, 6, FRAME_CONTROL);
+    
+    debug_log("Assigned client %d to Room %d as Player %d\n", client_fd, room_id, player_id + 1);
+}
+
+void put_u32(unsigned char *buffer, unsigned int value) {
+    buffer[0] = value >> 24;
+    buffer[1] = value >> 16;
+    buffer[2] = value >> 8;
+    buffer[3] = value;
+}
+
+unsigned int get_u32(const unsigned char *buffer) {
+    return ((unsigned int)buffer[0] << 24) | ((unsigned int)buffer[1] << 16) |
+           ((unsigned int)buffer[2] << 8) | buffer[3];
+}
+
+void record_snapshot(Room *room) {
+    Snapshot *s = &room->snapshots[room->tick % SNAPSHOT_HISTORY];
+    
+    s->tick = room->tick;
+    s->bullet_steps = room->bullet_steps;
+    s->roster_version = room->roster_version;
+    s->map_version = room->map_version;
+    s->map_log_count = room->map_log_count;
+    s->valid = 1;
+    
+    for (int i = 0; i < room->game.player_count; i++) {
+        Player *p = &room->game.players[i];
+        s->tanks[i].x = p->x;
+        s->tanks[i].y = p->y;
+        s->tanks[i].direction = p->direction;
+        s->tanks[i].alive = p->alive;
+        s->tanks[i].input_seq = p->input_seq;
+    }
+    
+    s->bullets = room->game.bullets;
+}
+
+// 基线快照必须仍在历史环中，且之后没有换地图或玩家进出
+Snapshot *find_snapshot(Room *room, unsigned int tick) {
+    Snapshot *s = &room->snapshots[tick % SNAPSHOT_HISTORY];
+    
+    if (!s->valid || s->tick != tick || tick == room->tick) return NULL;
+    if (s->roster_version != room->roster_version || s->map_version != room->map_version) return NULL;
+    if (room->bullet_steps - s->bullet_steps > 255) return NULL;
+    
+    return s;
+}
+
+// 返回基线之后第一条地图变更的序号，变更日志已被覆盖时返回-1
+int map_log_since(Room *room, unsigned int tick) {
+    unsigned int i = room->map_log_count;
+    
+    while (i > 0) {
+        if (room->map_log_count - i >= MAP_LOG_SIZE) return -1;
+        if (room->map_log[(i - 1) % MAP_LOG_SIZE].tick <= tick) break;
+        i--;
+    }
+    
+    return i;
+}
+
+void advance_position(int *x, int *y, int direction, int steps) {
+    switch (direction) {
+        case UP:    *y -= steps; break;
+        case RIGHT: *x += steps; break;
+        case DOWN:  *y += steps; break;
+        case LEFT:  *x -= steps; break;
+    }
+}
+
+// 坐标、数量和编号都用LEB128变长整数：每字节低7位是数据，最高位表示后面还有字节
+int put_varint(unsigned char *buffer, unsigned int value) {
+    int len = 0;
+    
+    while (value >= 0x80) {
+        buffer[len++] = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+    buffer[len++] = value;
+    
+    return len;
+}
+
+// 先占位后回填的计数固定写成两字节（不超过16383），解码方式与普通变长整数相同
+void put_varint2(unsigned char *buffer, unsigned int value) {
+    buffer[0] = (value & 0x7F) | 0x80;
+    buffer[1] = value >> 7;
+}
+
+unsigned int read_varint(LogReader *r) {
+    unsigned int value = 0;
+    
+    for (int shift = 0; shift < 35; shift += 7) {
+        if (r->pos >= r->len) {
+            r->error = 1;
+            return 0;
+        }
+        unsigned char byte = r->data[r->pos++];
+        value |= (unsigned int)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) return value;
+    }
+    
+    r->error = 1;
+    return 0;
+}
+
+const unsigned char *read_bytes(LogReader *r, size_t count) {
+    if (r->len - r->pos < count) {
+        r->error = 1;
+        return NULL;
+    }
+    
+    const unsigned char *p = r->data + r->pos;
+    r->pos += count;
+    return p;
+}
+
+// 玩家的视野是以自己坦克为中心、半径view_radius格所覆盖的地图块；
+// 半径为0或者观战者看整张地图
+ViewWindow view_window(Room *room, Player *p) {
+    ViewWindow w = {0, 0, room->map.chunks_x, room->map.chunks_y};
+    
+    if (p && room->view_radius > 0) {
+        int x0 = p->x - room->view_radius, x1 = p->x + room->view_radius;
+        int y0 = p->y - room->view_radius, y1 = p->y + room->view_radius;
+        if (x0 < 0) x0 = 0;
+        if (y0 < 0) y0 = 0;
+        if (x1 > room->width - 1) x1 = room->width - 1;
+        if (y1 > room->height - 1) y1 = room->height - 1;
+        
+        w.x0 = x0 >> MAP_CHUNK_SHIFT;
+        w.y0 = y0 >> MAP_CHUNK_SHIFT;
+        w.x1 = (x1 >> MAP_CHUNK_SHIFT) + 1;
+        w.y1 = (y1 >> MAP_CHUNK_SHIFT) + 1;
+    }
+    
+    return w;
+}
+
+int window_equal(ViewWindow a, ViewWindow b) {
+    return a.x0 == b.x0 && a.y0 == b.y0 && a.x1 == b.x1 && a.y1 == b.y1;
+}
+
+int window_contains_chunk(ViewWindow w, int cx, int cy) {
+    return cx >= w.x0 && cx < w.x1 && cy >= w.y0 && cy < w.y1;
+}
+
+int window_contains(ViewWindow w, int x, int y) {
+    return window_contains_chunk(w, x >> MAP_CHUNK_SHIFT, y >> MAP_CHUNK_SHIFT);
+}
+
+// 视野内的存活坦克直接从每块的坦克集合里取
+PlayerMask window_tanks(Room *room, ViewWindow w) {
+    PlayerMask mask = 0;
+    
+    for (int cy = w.y0; cy < w.y1; cy++) {
+        for (int cx = w.x0; cx < w.x1; cx++) {
+            mask |= room->chunk_tanks[cy * room->map.chunks_x + cx];
+        }
+    }
+    
+    return mask;
+}
+
+PlayerMask snapshot_window_tanks(Snapshot *s, int player_count, ViewWindow w) {
+    PlayerMask mask = 0;
+    
+    for (int i = 0; i < player_count; i++) {
+        if (s->tanks[i].alive && window_contains(w, s->tanks[i].x, s->tanks[i].y)) {
+            mask |= PLAYER_BIT(i);
+        }
+    }
+    
+    return mask;
+}
+
+BulletMask window_bullets(BulletSet *bullets, ViewWindow w) {
+    BulletMask mask = 0;
+    
+    for (BulletMask m = bullets->active; m; m &= m - 1) {
+        int i = __builtin_ctzll(m);
+        if (window_contains(w, bullets->x[i], bullets->y[i])) {
+            mask |= BULLET_BIT(i);
+        }
+    }
+    
+    return mask;
+}
+
+void view_record(ViewState *view, unsigned int tick, ViewWindow w) {
+    view->window_ticks[tick % SNAPSHOT_HISTORY] = tick;
+    view->windows[tick % SNAPSHOT_HISTORY] = w;
+}
+
+// 查某一tick发给观看者的视野，已被覆盖时返回-1
+int view_window_at(ViewState *view, unsigned int tick, ViewWindow *w) {
+    int i = tick % SNAPSHOT_HISTORY;
+    
+    if (view->window_ticks[i] != tick || view->windows[i].x1 == 0) return -1;
+    
+    *w = view->windows[i];
+    return 0;
+}
+
+int keyframe_capacity(Room *room, ViewWindow w) {
+    return 16 + 4 * 2 + ((w.x1 - w.x0) * (w.y1 - w.y0) * CHUNK_PACKED_SIZE) +
+           3 + room->game.player_count * (15 + USERNAME_MAX) +
+           2 + MAX_BULLETS * 8 + 3;
+}
+
+// 增量帧除了可能整块下发进入视野的地图块外，其余部分最坏情况也不超过3KB
+int delta_capacity(ViewWindow w) {
+    return 3072 + (w.x1 - w.x0) * (w.y1 - w.y0) * (CHUNK_PACKED_SIZE + 4);
+}
+
+// 整块16x16格按行优先打包，地图边界外的格子写0
+int encode_chunk(Room *room, int cx, int cy, unsigned char *buffer) {
+    int offset = 0;
+    
+    offset += put_varint(buffer + offset, cx);
+    offset += put_varint(buffer + offset, cy);
+    
+    memset(buffer + offset, 0, CHUNK_PACKED_SIZE);
+    for (int n = 0; n < MAP_CHUNK_SIZE * MAP_CHUNK_SIZE; n++) {
+        int x = (cx << MAP_CHUNK_SHIFT) + (n & (MAP_CHUNK_SIZE - 1));
+        int y = (cy << MAP_CHUNK_SHIFT) + (n >> MAP_CHUNK_SHIFT);
+        if (x < room->width && y < room->height) {
+            buffer[offset + n / 4] |= GRID_CELL(&room->map, x, y) << ((n % 4) * 2);
+        }
+    }
+    
+    return offset + CHUNK_PACKED_SIZE;
+}
+
+// 关键帧只带视野内的地图（每格2位，按行优先每字节4格，低位在前）、坦克和子弹；
+// 视野外的玩家只保留编号和名字，坐标、方向和存活都写0
+int encode_keyframe(Room *room, ViewWindow w, unsigned char *buffer) {
+    int offset = 0;
+    
+    buffer[offset++] = CMD_UPDATE;
+    
+    put_u32(buffer + offset, room->id);
+    offset += 4;
+    
+    put_u32(buffer + offset, room->tick);
+    offset += 4;
+    
+    offset += put_varint(buffer + offset, room->width);
+    offset += put_varint(buffer + offset, room->height);
+    
+    offset += put_varint(buffer + offset, w.x0);
+    offset += put_varint(buffer + offset, w.y0);
+    offset += put_varint(buffer + offset, w.x1);
+    offset += put_varint(buffer + offset, w.y1);
+    
+    int x0 = w.x0 << MAP_CHUNK_SHIFT, y0 = w.y0 << MAP_CHUNK_SHIFT;
+    int x1 = w.x1 << MAP_CHUNK_SHIFT, y1 = w.y1 << MAP_CHUNK_SHIFT;
+    if (x1 > room->width) x1 = room->width;
+    if (y1 > room->height) y1 = room->height;
+    
+    int packed_len = ((x1 - x0) * (y1 - y0) + 3) / 4;
+    memset(buffer + offset, 0, packed_len);
+    int n = 0;
+    for (int y = y0; y < y1; y++) {
+        for (int x = x0; x < x1; x++, n++) {
+            buffer[offset + n / 4] |= GRID_CELL(&room->map, x, y) << ((n % 4) * 2);
+        }
+    }
+    offset += packed_len;
+    
+    PlayerMask visible = window_tanks(room, w);
+    offset += put_varint(buffer + offset, room->game.player_count);
+    
+    for (int i = 0; i < room->game.player_count; i++) {
+        Player *p = &room->game.players[i];
+        
+        if (visible & PLAYER_BIT(i)) {
+            offset += put_varint(buffer + offset, p->x);
+            offset += put_varint(buffer + offset, p->y);
+            buffer[offset++] = p->direction;
+            buffer[offset++] = p->alive;
+            offset += put_varint(buffer + offset, p->input_seq);
+        } else {
+            memset(buffer + offset, 0, 5);
+            offset += 5;
+        }
+        offset += put_varint(buffer + offset, p->id);
+        
+        int username_len = strlen(p->username);
+        if (username_len > USERNAME_MAX - 1) username_len = USERNAME_MAX - 1;
+        buffer[offset++] = username_len;
+        
+        memcpy(buffer + offset, p->username, username_len);
+        offset += username_len;
+    }
+    
+    BulletSet *bullets = &room->game.bullets;
+    BulletMask shown = window_bullets(bullets, w);
+    offset += put_varint(buffer + offset, __builtin_popcountll(shown));
+    
+    for (BulletMask m = shown; m; m &= m - 1) {
+        int i = __builtin_ctzll(m);
+        offset += put_varint(buffer + offset, i);
+        offset += put_varint(buffer + offset, bullets->x[i]);
+        offset += put_varint(buffer + offset, bullets->y[i]);
+        buffer[offset++] = bullets->direction[i];
+        offset += put_varint(buffer + offset, bullets->owner_id[i]);
+    }
+    
+    buffer[offset++] = room->game.game_started;
+    buffer[offset++] = room->game.game_over;
+    buffer[offset++] = room->game.winner_id;
+    
+    return offset;
+}
+
+// 增量帧相对客户端的基线：基线视野和当前视野都覆盖的格子只发变化，新进入视野的地图块整块下发；
+// 坦克和子弹按是否在两个视野内区分出进入、离开和变化，客户端按步数自行推进基线中的子弹
+int encode_delta(Room *room, Snapshot *base, ViewWindow base_window, ViewWindow w, unsigned char *buffer) {
+    int first_change = map_log_since(room, base->tick);
+    if (first_change < 0) return -1;
+    
+    int steps = room->bullet_steps - base->bullet_steps;
+    int offset = 0;
+    
+    buffer[offset++] = CMD_DELTA;
+    
+    put_u32(buffer + offset, room->id);
+    offset += 4;
+    
+    put_u32(buffer + offset, room->tick);
+    offset += 4;
+    put_u32(buffer + offset, base->tick);
+    offset += 4;
+    
+    buffer[offset++] = steps;
+    
+    int count_offset = offset;
+    offset += 2;
+    int change_count = 0;
+    for (unsigned int i = first_change; i < room->map_log_count; i++) {
+        MapChange *c = &room->map_log[i % MAP_LOG_SIZE];
+        if (!window_contains(w, c->x, c->y) || !window_contains(base_window, c->x, c->y)) continue;
+        
+        offset += put_varint(buffer + offset, c->x);
+        offset += put_varint(buffer + offset, c->y);
+        buffer[offset++] = c->cell;
+        change_count++;
+    }
+    put_varint2(buffer + count_offset, change_count);
+    
+    count_offset = offset;
+    offset += 2;
+    int chunk_count = 0;
+    for (int cy = w.y0; cy < w.y1; cy++) {
+        for (int cx = w.x0; cx < w.x1; cx++) {
+            if (window_contains_chunk(base_window, cx, cy)) continue;
+            
+            offset += encode_chunk(room, cx, cy, buffer + offset);
+            chunk_count++;
+        }
+    }
+    put_varint2(buffer + count_offset, chunk_count);
+    
+    PlayerMask visible = window_tanks(room, w);
+    PlayerMask was_visible = snapshot_window_tanks(base, room->game.player_count, base_window);
+    
+    count_offset = offset;
+    offset += 2;
+    int tank_count = 0;
+    for (PlayerMask m = visible; m; m &= m - 1) {
+        int i = __builtin_ctzll(m);
+        Player *p = &room->game.players[i];
+        TankState *t = &base->tanks[i];
+        
+        if ((was_visible & PLAYER_BIT(i)) && p->x == t->x && p->y == t->y && p->direction == t->direction &&
+            p->input_seq == t->input_seq) {
+            continue;
+        }
+        
+        offset += put_varint(buffer + offset, i);
+        offset += put_varint(buffer + offset, p->x);
+        offset += put_varint(buffer + offset, p->y);
+        buffer[offset++] = p->direction;
+        buffer[offset++] = p->alive;
+        offset += put_varint(buffer + offset, p->input_seq);
+        tank_count++;
+    }
+    put_varint2(buffer + count_offset, tank_count);
+    
+    // 离开视野的坦克（包括被击毁的）只发下标
+    PlayerMask left = was_visible & ~visible;
+    offset += put_varint(buffer + offset, __builtin_popcountll(left));
+    for (PlayerMask m = left; m; m &= m - 1) {
+        offset += put_varint(buffer + offset, __builtin_ctzll(m));
+    }
+    
+    BulletSet *bullets = &room->game.bullets;
+    BulletSet *old = &base->bullets;
+    BulletMask shown = window_bullets(bullets, w);
+    BulletMask was_shown = window_bullets(old, base_window);
+    
+    BulletMask removed = was_shown & ~shown;
+    offset += put_varint(buffer + offset, __builtin_popcountll(removed));
+    for (BulletMask m = removed; m; m &= m - 1) {
+        offset += put_varint(buffer + offset, __builtin_ctzll(m));
+    }
+    
+    count_offset = offset;
+    offset += 2;
+    int added_count = 0;
+    for (BulletMask m = shown; m; m &= m - 1) {
+        int i = __builtin_ctzll(m);
+        
+        if ((was_shown & BULLET_BIT(i)) && old->direction[i] == bullets->direction[i] &&
+            old->owner_id[i] == bullets->owner_id[i]) {
+            int x = old->x[i], y = old->y[i];
+            advance_position(&x, &y, old->direction[i], steps);
+            if (x == bullets->x[i] && y == bullets->y[i]) continue;
+        }
+        
+        offset += put_varint(buffer + offset, i);
+        offset += put_varint(buffer + offset, bullets->x[i]);
+        offset += put_varint(buffer + offset, bullets->y[i]);
+        buffer[offset++] = bullets->direction[i];
+        offset += put_varint(buffer + offset, bullets->owner_id[i]);
+        added_count++;
+    }
+    put_varint2(buffer + count_offset, added_count);
+    
+    buffer[offset++] = room->game.game_started;
+    buffer[offset++] = room->game.game_over;
+    buffer[offset++] = room->game.winner_id;
+    
+    return offset;
+}
+
+// 房间内所有玩家和观战者收到同一份帧
+void room_count_out(Room *room, FrameBuf *frame) {
+    metric_add(&room->bytes_out, frame->len);
+    metric_add(&room->frames_out, 1);
+}
+
+void room_broadcast(Room *room, FrameBuf *frame, int kind) {
+    for (int i = 0; i < room->game.player_count; i++) {
+        if (room->game.players[i].fd > 0 && conn_send_frame(room->game.players[i].fd, frame, kind) == 0) {
+            room_count_out(room, frame);
+        }
+    }
+    for (int i = 0; i < room->spectator_count; i++) {
+        if (conn_send_frame(room->spectators[i].fd, frame, kind) == 0) {
+            room_count_out(room, frame);
+        }
+    }
+    
+    if (frame_tap) frame_tap(room, frame, kind);
+}
+
+typedef struct {
+    FrameBuf *frame;
+    int kind;
+    unsigned int base_tick;
+    ViewWindow base_window;
+    ViewWindow window;
+} CachedFrame;
+
+// 本tick已编码的帧，视野和基线都相同的观看者共用一份
+typedef struct {
+    CachedFrame entries[MAX_PLAYERS + MAX_SPECTATORS];
+    int count;
+} UpdateFrames;
+
+FrameBuf *cached_frame(UpdateFrames *frames, int kind, unsigned int base_tick,
+                       ViewWindow base_window, ViewWindow window) {
+    for (int j = 0; j < frames->count; j++) {
+        CachedFrame *c = &frames->entries[j];
+        if (c->kind != kind || !window_equal(c->window, window)) continue;
+        if (kind == FRAME_DELTA && (c->base_tick != base_tick || !window_equal(c->base_window, base_window))) {
+            continue;
+        }
+        return c->frame;
+    }
+    return NULL;
+}
+
+void cache_frame(UpdateFrames *frames, FrameBuf *frame, int kind, unsigned int base_tick,
+                 ViewWindow base_window, ViewWindow window) {
+    CachedFrame *c = &frames->entries[frames->count++];
+    c->frame = frame;
+    c->kind = kind;
+    c->base_tick = base_tick;
+    c->base_window = base_window;
+    c->window = window;
+}
+
+// 为一个观看者选出本tick要发的帧；同一视野、同一基线的增量帧和关键帧每tick只编码一次
+FrameBuf *frame_for_view(Room *room, UpdateFrames *frames, ViewState *view, ViewWindow window,
+                         int periodic, int *kind) {
+    ViewWindow base_window = {0, 0, 0, 0};
+    FrameBuf *frame;
+    
+    if (!view->need_keyframe && !periodic) {
+        // 关键帧走可靠的TCP流，发出后即可作为基线，不必等确认
+        unsigned int base_tick = view->acked_tick;
+        if ((int)(view->baseline_tick - base_tick) > 0) base_tick = view->baseline_tick;
+        
+        Snapshot *base = find_snapshot(room, base_tick);
+        if (base && view_window_at(view, base_tick, &base_window) == 0) {
+            frame = cached_frame(frames, FRAME_DELTA, base_tick, base_window, window);
+            if (!frame && (frame = frame_alloc(delta_capacity(window))) != NULL) {
+                int len = encode_delta(room, base, base_window, window, frame->data + FRAME_HEADER_SIZE);
+                if (len > 0) {
+                    frame_seal(frame, len);
+                    cache_frame(frames, frame, FRAME_DELTA, base_tick, base_window, window);
+                    if (frame_tap) frame_tap(room, frame, FRAME_DELTA);
+                } else {
+                    frame_unref(frame);
+                    frame = NULL;
+                }
+            }
+            if (frame) {
+                view_record(view, room->tick, window);
+                *kind = FRAME_DELTA;
+                return frame;
+            }
+        }
+    }
+    
+    frame = cached_frame(frames, FRAME_KEYFRAME, 0, base_window, window);
+    if (!frame) {
+        frame = frame_alloc(keyframe_capacity(room, window));
+        if (!frame) return NULL;
+        frame_seal(frame, encode_keyframe(room, window, frame->data + FRAME_HEADER_SIZE));
+        cache_frame(frames, frame, FRAME_KEYFRAME, 0, base_window, window);
+        if (frame_tap) frame_tap(room, frame, FRAME_KEYFRAME);
+    }
+    
+    view->need_keyframe = 0;
+    view->baseline_tick = room->tick;
+    view_record(view, room->tick, window);
+    *kind = FRAME_KEYFRAME;
+    return frame;
+}
+
+// 这一tick的快照和上一tick完全相同（没有子弹时不看子弹步数）、没有新的地图变更，
+// 且所有观看者都已确认最近一次变化，就不用发帧。客户端的基线不能掉出快照历史，所以最多连续跳过半个历史长度
+int room_tick_quiet(Room *room) {
+    Snapshot *now = &room->snapshots[room->tick % SNAPSHOT_HISTORY];
+    Snapshot *prev = &room->snapshots[(room->tick - 1) % SNAPSHOT_HISTORY];
+    
+    if (!prev->valid || prev->tick != room->tick - 1 ||
+        prev->roster_version != now->roster_version || prev->map_version != now->map_version ||
+        prev->map_log_count != now->map_log_count ||
+        (now->bullets.active && prev->bullet_steps != now->bullet_steps) ||
+        memcmp(prev->tanks, now->tanks, sizeof(TankState) * room->game.player_count) != 0 ||
+        memcmp(&prev->bullets, &now->bullets, sizeof(BulletSet)) != 0) {
+        room->last_change_tick = room->tick;
+        return 0;
+    }
+    
+    if (room->tick - room->last_update_tick >= SNAPSHOT_HISTORY / 2) return 0;
+    
+    for (int i = 0; i < room->game.player_count; i++) {
+        ViewState *view = &room->views[i];
+        if (room->game.players[i].fd <= 0) continue;
+        if (view->need_keyframe || (int)(view->acked_tick - room->last_change_tick) < 0) return 0;
+    }
+    for (int i = 0; i < room->spectator_count; i++) {
+        ViewState *view = &room->spectators[i].view;
+        if (view->need_keyframe || (int)(view->acked_tick - room->last_change_tick) < 0) return 0;
+    }
+    
+    return 1;
+}
+
+void send_game_update(Room *room) {
+    UpdateFrames frames;
+    FrameBuf *frame;
+    int kind;
+    
+    frames.count = 0;
+    
+    int quiet = room_tick_quiet(room);
+    int periodic = room->tick - room->last_keyframe_tick >= keyframe_interval_ticks;
+    if (quiet && !periodic) {
+        METRIC_ADD(updates_skipped, 1);
+        return;
+    }
+    
+    room->last_update_tick = room->tick;
+    if (periodic) {
+        room->last_keyframe_tick = room->tick;
+    }
+    
+    for (int i = 0; i < room->game.player_count; i++) {
+        Player *p = &room->game.players[i];
+        if (p->fd <= 0) continue;
+        
+        frame = frame_for_view(room, &frames, &room->views[i], view_window(room, p), periodic, &kind);
+        if (frame && send_state_frame(p->fd, frame, kind, room->tick) == 0) room_count_out(room, frame);
+    }
+    
+    // 观战者看整张地图
+    ViewWindow full = view_window(room, NULL);
+    for (int i = 0; i < room->spectator_count; i++) {
+        Spectator *sp = &room->spectators[i];
+        
+        frame = frame_for_view(room, &frames, &sp->view, full, periodic, &kind);
+        if (frame && send_state_frame(sp->fd, frame, kind, room->tick) == 0) room_count_out(room, frame);
+    }
+    
+    for (int j = 0; j < frames.count; j++) {
+        frame_unref(frames.entries[j].frame);
+    }
+}
+
+void send_game_start(Room *room) {
+    FrameBuf *frame = frame_alloc(BUFFER_SIZE);
+    if (!frame) return;
+    
+    unsigned char *buffer = frame->data + FRAME_HEADER_SIZE;
+    buffer[0] = CMD_GAME_START;
+    put_u32(buffer + 1, room->id);
+    frame_seal(frame, 5);
+    
+    room_broadcast(room, frame, FRAME_CONTROL);
+    frame_unref(frame);
+    
+    for (int i = 0; i < room->game.player_count; i++) {
+        room->views[i].need_keyframe = 1;
+    }
+    for (int i = 0; i < room->spectator_count; i++) {
+        room->spectators[i].view.need_keyframe = 1;
+    }
+    
+    debug_log("Game started in Room %d with %d players!\n", room->id, room->game.player_count);
+}
+
+void send_game_over(Room *room) {
+    FrameBuf *frame = frame_alloc(BUFFER_SIZE);
+    if (!frame) return;
+    
+    unsigned char *buffer = frame->data + FRAME_HEADER_SIZE;
+    buffer[0] = CMD_GAME_OVER;
+    buffer[1] = room->game.winner_id;
+    frame_seal(frame, 2);
+    
+    room_broadcast(room, frame, FRAME_CONTROL);
+    frame_unref(frame);
+    
+    debug_log("Game over in Room %d! Winner: Player %d\n", room->id, room->game.winner_id);
+}
+
+void close_client(int client_fd) {
+    remove_player_from_room(client_fd);
+    
+    epoll_ctl(connections[client_fd].epoll_fd, EPOLL_CTL_DEL, client_fd, NULL);
+    conn_close(client_fd);
+    close(client_fd);
+}
+
+int handle_client_message(int client_fd, const unsigned char *buffer, int len) {
+    if (len <= 0) return 0;
+    
+    unsigned char cmd = buffer[0];
+    
+    switch (cmd) {
+        case CMD_LOGIN: {
+            char username[USERNAME_MAX];
+            int username_len = len - 1;
+            if (username_len > USERNAME_MAX - 1) username_len = USERNAME_MAX - 1;
+            memset(username, 0, USERNAME_MAX);
+            memcpy(username, buffer + 1, username_len);
+            
+            if (find_room_for_client(client_fd)) return 0;
+            
+            Room *room;
+            int player_id = -1;
+            while ((room = find_available_room()) != NULL) {
+                player_id = add_player(client_fd, username, room);
+                if (player_id >= 0) break;
+            }
+            
+            if (!room) {
+                debug_log("No rooms available for client %d\n", client_fd);
+                return -1;
+            }
+            
+            debug_log("Player %s connected, assigned to Room %d as Player %d\n", 
+                   username, room->id, player_id + 1);
+            
+            send_room_assignment(client_fd, room->id, player_id);
+            send_session_token(client_fd);
+            // 分配消息入队之后再唤醒，房间发出的第一帧不会跑到它前面
+            room_wake(room);
+            break;
+        }
+        case CMD_SPECTATE: {
+            if (len < 5) return 0;
+            
+            if (find_room_for_client(client_fd)) return 0;
+            
+            unsigned int room_id = get_u32(buffer + 1);
+            Room *room = room_id < ROOM_ID_LIMIT ? get_room(room_id) : NULL;
+            if (!room || add_spectator(client_fd, room) < 0) {
+                debug_log("Client %d cannot spectate Room %u\n", client_fd, room_id);
+                return -1;
+            }
+            
+            debug_log("Client %d is spectating Room %u\n", client_fd, room_id);
+            
+            // 玩家编号0表示观战
+            send_room_assignment(client_fd, room_id, -1);
+            send_session_token(client_fd);
+            break;
+        }
+        // 移动和射击后面可以跟输入序号和客户端看到的快照tick（各4字节）
+        case CMD_MOVE: {
+            if (len < 3) return 0;
+            
+            int direction = buffer[2];
+            if (direction < UP || direction > LEFT) return 0;
+            
+            if (len >= 11) {
+                enqueue_input(client_fd, INPUT_MOVE, direction, get_u32(buffer + 3), get_u32(buffer + 7));
+            } else {
+                enqueue_input(client_fd, INPUT_MOVE, direction, 0, 0);
+            }
+            break;
+        }
+        case CMD_SHOOT: {
+            if (len < 2) return 0;
+            
+            if (len >= 10) {
+                enqueue_input(client_fd, INPUT_SHOOT, 0, get_u32(buffer + 2), get_u32(buffer + 6));
+            } else {
+                enqueue_input(client_fd, INPUT_SHOOT, 0, 0, 0);
+            }
+            break;
+        }
+        case CMD_ACK: {
+            if (len < 5) return 0;
+            
+            enqueue_input(client_fd, INPUT_ACK, get_u32(buffer + 1), 0, 0);
+            break;
+        }
+    }
+    
+    return 0;
+}
+
+// 每条消息都带2字节长度前缀；边沿触发下一直读到EAGAIN，
+// 一次唤醒内把所有完整的消息依次分发，不完整的尾部留到下次
+int conn_read(int client_fd) {
+    Connection *c = &connections[client_fd];
+    
+    while (1) {
+        int len = recv(client_fd, c->in_buf + c->in_len, IN_BUFFER_SIZE - c->in_len, 0);
+        if (len == 0) {
+            debug_log("Client disconnected, fd: %d\n", client_fd);
+            return -1;
+        }
+        if (len < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            perror("recv failed");
+            return -1;
+        }
+        
+        c->in_len += len;
+        
+        int offset = 0;
+        while (c->in_len - offset >= FRAME_HEADER_SIZE) {
+            int msg_len = (c->in_buf[offset] << 8) | c->in_buf[offset + 1];
+            if (msg_len == 0 || msg_len > MAX_CLIENT_MESSAGE) {
+                debug_log("Invalid message length %d from client %d\n", msg_len, client_fd);
+                return -1;
+            }
+            if (c->in_len - offset < FRAME_HEADER_SIZE + msg_len) break;
+            
+            if (handle_client_message(client_fd, c->in_buf + offset + FRAME_HEADER_SIZE, msg_len) < 0) {
+                return -1;
+            }
+            offset += FRAME_HEADER_SIZE + msg_len;
+        }
+        
+        if (offset > 0) {
+            memmove(c->in_buf, c->in_buf + offset, c->in_len - offset);
+            c->in_len -= offset;
+        }
+    }
+}
+
+// 客户端数据报：令牌(8) + 序号 + 确认序号 + 确认位图 + 首个输入序号 + 输入条数(1) + 带长度前缀的输入消息；
+// 每个数据报重复携带尚未被确认的最近几条输入，已经处理过的按输入序号跳过
+void udp_receive(const unsigned char *buffer, int len, struct sockaddr_in *addr) {
+    if (len < UDP_CLIENT_HEADER) return;
+    
+    unsigned long long token = ((unsigned long long)get_u32(buffer) << 32) | get_u32(buffer + 4);
+    int fd = udp_token_lookup(token);
+    if (fd <= 0 || fd >= max_connections) return;
+    
+    unsigned int seq = get_u32(buffer + 8);
+    unsigned int ack = get_u32(buffer + 12);
+    unsigned int ack_bits = get_u32(buffer + 16);
+    unsigned int first_input = get_u32(buffer + 20);
+    int input_count = buffer[24];
+    if (input_count > UDP_INPUT_REDUNDANCY) return;
+    
+    Connection *c = &connections[fd];
+    pthread_mutex_lock(&c->mutex);
+    if (!c->active || c->closing || c->udp_token != token) {
+        pthread_mutex_unlock(&c->mutex);
+        return;
+    }
+    
+    // 地址以序号最新的数据报为准，客户端换了端口也能继续收；重放的旧数据报不能把地址改走
+    int diff = seq - c->udp_recv_seq;
+    if (diff > 0 || !c->udp_bound) {
+        c->udp_addr = *addr;
+        c->udp_bound = 1;
+    }
+    if (diff > 0) {
+        c->udp_recv_bits = diff > 32 ? 0 : ((unsigned long long)c->udp_recv_bits << diff) | (1ULL << (diff - 1));
+        c->udp_recv_seq = seq;
+    } else if (diff < 0 && diff >= -32) {
+        c->udp_recv_bits |= 1U << (-diff - 1);
+    }
+    
+    // 对方确认过的数据报换算成其中增量帧的tick，取最新的一个
+    unsigned int acked_tick = 0;
+    int have_ack = 0;
+    for (int n = -1; n < 32; n++) {
+        if (n >= 0 && !(ack_bits & (1U << n))) continue;
+        
+        unsigned int s = ack - 1 - n;
+        if (s == 0 || c->udp_sent_seq[s % UDP_ACK_WINDOW] != s) continue;
+        
+        unsigned int tick = c->udp_sent_tick[s % UDP_ACK_WINDOW];
+        if (!have_ack || (int)(tick - acked_tick) > 0) acked_tick = tick;
+        have_ack = 1;
+    }
+    
+    // 同一个tick只确认一次，重复的确认不进输入队列
+    if (have_ack && (int)(acked_tick - c->udp_acked_tick) > 0) {
+        c->udp_acked_tick = acked_tick;
+    } else {
+        have_ack = 0;
+    }
+    
+    int skip = c->udp_input_next - first_input;
+    if (skip < 0) skip = 0;
+    if ((int)(first_input + input_count - c->udp_input_next) > 0) {
+        c->udp_input_next = first_input + input_count;
+    }
+    pthread_mutex_unlock(&c->mutex);
+    
+    if (have_ack) enqueue_input(fd, INPUT_ACK, acked_tick, 0, 0);
+    
+    int offset = UDP_CLIENT_HEADER;
+    for (int i = 0; i < input_count; i++) {
+        if (len - offset < FRAME_HEADER_SIZE) return;
+        int msg_len = (buffer[offset] << 8) | buffer[offset + 1];
+        offset += FRAME_HEADER_SIZE;
+        if (msg_len == 0 || msg_len > len - offset) return;
+        
+        // UDP上只接受操作输入，登录和观战必须走TCP
+        if (i >= skip && (buffer[offset] == CMD_MOVE || buffer[offset] == CMD_SHOOT)) {
+            handle_client_message(fd, buffer + offset, msg_len);
+        }
+        offset += msg_len;
+    }
+}
+
+void udp_read() {
+    unsigned char buffer[UDP_MAX_DATAGRAM];
+    struct sockaddr_in addr;
+    socklen_t addr_len;
+    
+    while (1) {
+        addr_len = sizeof(addr);
+        int len = recvfrom(udp_fd, buffer, sizeof(buffer), 0, (struct sockaddr*)&addr, &addr_len);
+        if (len < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("recvfrom failed");
+            return;
+        }
+        
+        METRIC_ADD(udp_packets_in, 1);
+        udp_receive(buffer, len, &addr);
+    }
+}
+
+void set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// 把发送队列里剩下的帧尽量写出去，直到全部写完或超时
+void drain_connections(int timeout_ms) {
+    long long deadline = monotonic_ns() + timeout_ms * 1000000LL;
+    
+    while (1) {
+        int pending = 0;
+        
+        for (int fd = 0; fd < max_connections; fd++) {
+            Connection *c = &connections[fd];
+            
+            pthread_mutex_lock(&c->mutex);
+            if (c->active && !c->closing && c->count > 0) {
+                if (conn_flush_locked(fd, c) < 0) {
+                    c->closing = 1;
+                } else if (c->count > 0) {
+                    pending++;
+                }
+            }
+            pthread_mutex_unlock(&c->mutex);
+        }
+        
+        if (!pending || monotonic_ns() >= deadline) return;
+        usleep(10000);
+    }
+}
+
+// 收到SIGINT或SIGTERM后由reactor 0调用：先停掉收发和tick，回放日志收尾，
+// 把已经入队的帧发完再关连接
+void shutdown_server() {
+    printf("\nShutting down server...\n");
+    
+    stop_reactors();
+    for (int i = 0; i < reactor_count; i++) {
+        close(reactors[i].listen_fd);
+    }
+    if (handoff_fd >= 0) {
+        close(handoff_fd);
+        unlink(handoff_path);
+    }
+    
+    stop_tick_workers();
+    
+    for (int i = 0; i < room_pool.next_id; i++) {
+        Room *room = get_room(i);
+        if (room) {
+            pthread_mutex_lock(&room->mutex);
+            replay_close(room);
+            pthread_mutex_unlock(&room->mutex);
+        }
+    }
+    
+    drain_connections(SHUTDOWN_DRAIN_MS);
+    
+    for (int fd = 0; fd < max_connections; fd++) {
+        if (connections[fd].active) {
+            conn_close(fd);
+            close(fd);
+        }
+    }
+    
+    shutdown_thread_pool();
+    
+    if (udp_fd >= 0) close(udp_fd);
+    
+    exit(0);
+}
+
+int create_listener(int backlog) {
+    struct sockaddr_in server_addr;
+    
+    int listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (listen_fd == -1) {
+        perror("Failed to create socket");
+        exit(EXIT_FAILURE);
+    }
+    
+    int opt = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        perror("SO_REUSEPORT failed");
+        exit(EXIT_FAILURE);
+    }
+    
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+    server_addr.sin_port = htons(SERVER_PORT);
+    
+    if (bind(listen_fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        perror("Bind failed");
+        exit(EXIT_FAILURE);
+    }
+    
+    if (listen(listen_fd, backlog) < 0) {
+        perror("Listen failed");
+        exit(EXIT_FAILURE);
+    }
+    
+    return listen_fd;
+}
+
+int create_udp_socket() {
+    struct sockaddr_in server_addr;
+    
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        perror("Failed to create UDP socket");
+        exit(EXIT_FAILURE);
+    }
+    
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+    server_addr.sin_port = htons(SERVER_PORT);
+    
+    if (bind(fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        perror("UDP bind failed");
+        exit(EXIT_FAILURE);
+    }
+    
+    return fd;
+}
+
+void accept_clients(Reactor *r) {
+    struct sockaddr_in client_addr;
+    socklen_t client_len;
+    char addr_str[INET_ADDRSTRLEN];
+    
+    while (1) {
+        client_len = sizeof(client_addr);
+        int client_fd = accept4(r->listen_fd, (struct sockaddr*)&client_addr, &client_len,
+                                SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd == -1) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept failed");
+            return;
+        }
+        
+        if (client_fd >= max_connections) {
+            debug_log("Too many connections, rejecting fd %d\n", client_fd);
+            close(client_fd);
+            continue;
+        }
+        
+        conn_open(client_fd, r->epoll_fd);
+        
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        ev.data.fd = client_fd;
+        if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) == -1) {
+            perror("epoll_ctl failed");
+            conn_close(client_fd);
+            close(client_fd);
+            continue;
+        }
+        
+        inet_ntop(AF_INET, &client_addr.sin_addr, addr_str, sizeof(addr_str));
+        debug_log("New client connected, fd: %d, from: %s:%d (reactor %d)\n", 
+               client_fd, addr_str, ntohs(client_addr.sin_port), r->index);
+    }
+}
+
+void *reactor_main(void *arg) {
+    Reactor *r = (Reactor *)arg;
+    struct epoll_event events[MAX_EVENTS];
+    
+    metrics_register("reactor", r->index);
+    quiescent_online(&r->quiescent);
+    
+    while (1) {
+        quiescent_offline(&r->quiescent);
+        int nfds = epoll_wait(r->epoll_fd, events, MAX_EVENTS, -1);
+        quiescent_online(&r->quiescent);
+        if (nfds == -1) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait failed");
+            exit(EXIT_FAILURE);
+        }
+        
+        for (int i = 0; i < nfds; i++) {
+            if (events[i].data.fd == r->listen_fd) {
+                accept_clients(r);
+                continue;
+            }
+            
+            if (events[i].data.fd == reactor_wakeup_fd) {
+                if (atomic_load(&reactors_stopping)) {
+                    quiescent_offline(&r->quiescent);
+                    return NULL;
+                }
+                continue;
+            }
+            
+            if (events[i].data.fd == signal_fd) {
+                struct signalfd_siginfo info;
+                if (read(signal_fd, &info, sizeof(info)) == sizeof(info)) shutdown_server();
+                continue;
+            }
+            
+            if (events[i].data.fd == handoff_fd) {
+                // 交接失败才会回到这里，本批事件里的连接可能已经被关掉，重新等待
+                handoff_serve();
+                break;
+            }
+            
+            if (events[i].data.fd == udp_fd) {
+                udp_read();
+                continue;
+            }
+            
+            int client_fd = events[i].data.fd;
+            
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                debug_log("Client connection error, fd: %d\n", client_fd);
+                close_client(client_fd);
+                continue;
+            }
+            
+            if ((events[i].events & EPOLLOUT) && conn_flush(client_fd) < 0) {
+                perror("send failed");
+                close_client(client_fd);
+                continue;
+            }
+            
+            if ((events[i].events & EPOLLIN) && conn_read(client_fd) < 0) {
+                close_client(client_fd);
+            }
+        }
+    }
+    
+    return NULL;
+}
+
+// 由reactor 0调用：唤醒其余reactor并等它们退出，之后只有调用者还在收发
+void stop_reactors() {
+    unsigned long long one = 1;
+    
+    atomic_store(&reactors_stopping, 1);
+    if (reactor_count > 1 && write(reactor_wakeup_fd, &one, sizeof(one)) != sizeof(one)) {
+        perror("Failed to wake reactors");
+    }
+    
+    for (int i = 1; i < reactor_count; i++) {
+        pthread_join(reactors[i].thread, NULL);
+    }
+}
+
+void start_reactors() {
+    unsigned long long value;
+    
+    atomic_store(&reactors_stopping, 0);
+    if (read(reactor_wakeup_fd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+        perror("Failed to reset reactor wakeup");
+    }
+    
+    for (int i = 1; i < reactor_count; i++) {
+        if (pthread_create(&reactors[i].thread, NULL, reactor_main, &reactors[i]) != 0) {
+            perror("Failed to create reactor thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+// 把所有线程的同名直方图加起来
+void hist_merge(Histogram *out, size_t offset) {
+    memset(out, 0, sizeof(Histogram));
+    int count = atomic_load(&metric_thread_count);
+    if (count > MAX_METRIC_THREADS) count = MAX_METRIC_THREADS;
+    
+    for (int t = 0; t < count; t++) {
+        if (!metric_threads[t]) continue;
+        Histogram *h = (Histogram *)((char *)metric_threads[t] + offset);
+        for (int i = 0; i < HIST_BUCKETS; i++) {
+            out->buckets[i] += atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+        }
+        out->count += atomic_load_explicit(&h->count, memory_order_relaxed);
+        out->sum += atomic_load_explicit(&h->sum, memory_order_relaxed);
+    }
+}
+
+// 从2^10纳秒到2^34纳秒按2的幂输出累计桶，再给出几个分位数的估计值（桶上界）
+void write_histogram(FILE *out, const char *name, const char *help, size_t offset) {
+    static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    Histogram h;
+    hist_merge(&h, offset);
+    
+    fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    
+    unsigned long long cumulative = 0;
+    int index = 0;
+    for (int k = 10; k <= 34; k++) {
+        int limit = hist_index(1ULL << k);
+        while (index < limit) cumulative += h.buckets[index++];
+        fprintf(out, "%s_bucket{le=\"%.9g\"} %llu\n", name, (double)(1ULL << k) / 1e9, cumulative);
+    }
+    fprintf(out, "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)h.count);
+    fprintf(out, "%s_sum %.9f\n", name, (double)h.sum / 1e9);
+    fprintf(out, "%s_count %llu\n", name, (unsigned long long)h.count);
+    
+    fprintf(out, "# TYPE %s_quantile gauge\n", name);
+    for (int q = 0; q < (int)(sizeof(quantiles) / sizeof(quantiles[0])); q++) {
+        fprintf(out, "%s_quantile{quantile=\"%g\"} %.9f\n", name, quantiles[q],
+                hist_quantile(&h, quantiles[q]) / 1e9);
+    }
+}
+
+void write_thread_counter(FILE *out, const char *name, const char *help, size_t offset) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+    
+    int count = atomic_load(&metric_thread_count);
+    if (count > MAX_METRIC_THREADS) count = MAX_METRIC_THREADS;
+    for (int t = 0; t < count; t++) {
+        if (!metric_threads[t]) continue;
+        _Atomic unsigned long long *v = (_Atomic unsigned long long *)((char *)metric_threads[t] + offset);
+        fprintf(out, "%s{thread=\"%s\"} %llu\n", name, metric_threads[t]->name,
+                atomic_load_explicit(v, memory_order_relaxed));
+    }
+}
+
+static const struct {
+    const char *name;
+    const char *type;
+} room_metrics[] = {
+    { "tanks_room_bytes_out_total", "counter" },
+    { "tanks_room_frames_out_total", "counter" },
+    { "tanks_room_input_queue_depth", "gauge" },
+    { "tanks_room_inputs_dropped_total", "counter" },
+    { "tanks_room_tick_overruns_total", "counter" },
+    { "tanks_room_ticks_skipped_total", "counter" },
+    { "tanks_room_parked", "gauge" },
+};
+
+unsigned long long room_metric(Room *room, int metric) {
+    switch (metric) {
+        case 0: return atomic_load(&room->bytes_out);
+        case 1: return atomic_load(&room->frames_out);
+        case 2: return atomic_load(&room->inputs.enqueue_pos) - room->inputs.dequeue_pos;
+        case 3: return atomic_load(&room->inputs.dropped);
+        case 4: return room->tick_overruns;
+        case 5: return room->ticks_skipped;
+        default: return atomic_load(&room->parked);
+    }
+}
+
+// 抓取时只读各线程自己写的计数器；房间字段在room_pool锁下读取，保证房间对象不被释放，
+// 数值本身允许和tick线程并发而略有出入
+void write_metrics(FILE *out) {
+    write_histogram(out, "tanks_tick_duration_seconds", "Time spent in one room tick.",
+                    offsetof(ThreadMetrics, tick_duration));
+    write_histogram(out, "tanks_encode_duration_seconds", "Time spent encoding and queueing state updates per tick.",
+                    offsetof(ThreadMetrics, encode_duration));
+    write_histogram(out, "tanks_send_latency_seconds", "Time from queueing a TCP frame to writing its last byte.",
+                    offsetof(ThreadMetrics, send_latency));
+    write_histogram(out, "tanks_input_latency_seconds", "Time from receiving an input to applying it in a tick.",
+                    offsetof(ThreadMetrics, input_latency));
+    
+    write_thread_counter(out, "tanks_ticks_total", "Room ticks run.", offsetof(ThreadMetrics, ticks));
+    write_thread_counter(out, "tanks_inputs_applied_total", "Inputs taken off room queues.",
+                         offsetof(ThreadMetrics, inputs_applied));
+    write_thread_counter(out, "tanks_updates_skipped_total", "Ticks whose state frames were skipped as unchanged.",
+                         offsetof(ThreadMetrics, updates_skipped));
+    write_thread_counter(out, "tanks_room_wakeups_total", "Parked rooms woken by joins, leaves or inputs.",
+                         offsetof(ThreadMetrics, room_wakeups));
+    write_thread_counter(out, "tanks_tcp_bytes_out_total", "Bytes written to TCP sockets.",
+                         offsetof(ThreadMetrics, tcp_bytes_out));
+    write_thread_counter(out, "tanks_udp_bytes_out_total", "Bytes sent as UDP datagrams.",
+                         offsetof(ThreadMetrics, udp_bytes_out));
+    write_thread_counter(out, "tanks_udp_packets_out_total", "UDP datagrams sent.",
+                         offsetof(ThreadMetrics, udp_packets_out));
+    write_thread_counter(out, "tanks_udp_packets_in_total", "UDP datagrams received.",
+                         offsetof(ThreadMetrics, udp_packets_in));
+    
+    unsigned long long dropped_frames = 0, inputs_limited = 0;
+    int clients = 0;
+    for (int i = 0; i < max_connections; i++) {
+        if (!connections[i].active) continue;
+        clients++;
+        dropped_frames += connections[i].dropped_frames;
+        inputs_limited += connections[i].inputs_limited;
+    }
+    fprintf(out, "# TYPE tanks_connections gauge\ntanks_connections %d\n", clients);
+    fprintf(out, "# TYPE tanks_dropped_frames gauge\ntanks_dropped_frames %llu\n", dropped_frames);
+    fprintf(out, "# TYPE tanks_inputs_limited gauge\ntanks_inputs_limited %llu\n", inputs_limited);
+    fprintf(out, "# TYPE tanks_work_queue_depth gauge\ntanks_work_queue_depth %u\n",
+            atomic_load(&thread_pool.enqueue_pos) - atomic_load(&thread_pool.dequeue_pos));
+    
+    pthread_mutex_lock(&map_cache.mutex);
+    fprintf(out, "# TYPE tanks_map_cache_size gauge\ntanks_map_cache_size %d\n", map_cache.count);
+    fprintf(out, "# TYPE tanks_map_cache_hits_total counter\ntanks_map_cache_hits_total %llu\n", map_cache.hits);
+    fprintf(out, "# TYPE tanks_map_cache_misses_total counter\ntanks_map_cache_misses_total %llu\n", map_cache.misses);
+    pthread_mutex_unlock(&map_cache.mutex);
+    
+    pthread_mutex_lock(&room_pool.mutex);
+    fprintf(out, "# TYPE tanks_rooms gauge\ntanks_rooms %d\n", room_pool.active_count);
+    for (int metric = 0; metric < (int)(sizeof(room_metrics) / sizeof(room_metrics[0])); metric++) {
+        fprintf(out, "# TYPE %s %s\n", room_metrics[metric].name, room_metrics[metric].type);
+        for (int i = 0; i < room_pool.next_id; i++) {
+            Room *room = get_room(i);
+            if (!room || !room->active) continue;
+            fprintf(out, "%s{room=\"%d\"} %llu\n", room_metrics[metric].name, i, room_metric(room, metric));
+        }
+    }
+    pthread_mutex_unlock(&room_pool.mutex);
+}
+
+// 管理端口：只监听本机，一次处理一个请求，不管路径一律返回Prometheus文本格式
+void *admin_main(void *arg) {
+    int listen_fd = (int)(long)arg;
+    
+    while (1) {
+        int client_fd = accept(listen_fd, NULL, NULL);
+        if (client_fd < 0) {
+            if (errno == EINTR) continue;
+            perror("Admin accept failed");
+            continue;
+        }
+        
+        struct timeval timeout = { 1, 0 };
+        setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(client_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        
+        char request[1024];
+        if (read(client_fd, request, sizeof(request)) <= 0) {
+            close(client_fd);
+            continue;
+        }
+        
+        char *body = NULL;
+        size_t body_len = 0;
+        FILE *out = open_memstream(&body, &body_len);
+        if (out) {
+            write_metrics(out);
+            fclose(out);
+            
+            char header[128];
+            int header_len = snprintf(header, sizeof(header),
+                                      "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                                      "Content-Length: %zu\r\n\r\n", body_len);
+            if (write(client_fd, header, header_len) == header_len) {
+                size_t sent = 0;
+                while (sent < body_len) {
+                    ssize_t n = write(client_fd, body + sent, body_len - sent);
+                    if (n <= 0) break;
+                    sent += n;
+                }
+            }
+            free(body);
+        }
+        
+        close(client_fd);
+    }
+    
+    return NULL;
+}
+
+// 热重启时admin_fd已经是从旧进程接过来的监听套接字，直接用它
+void start_admin(int port) {
+    if (admin_fd < 0) {
+        admin_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (admin_fd < 0) {
+            perror("Admin socket creation failed");
+            exit(EXIT_FAILURE);
+        }
+        
+        int opt = 1;
+        setsockopt(admin_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+        
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(port);
+        
+        // 指标只是辅助功能，端口被占用时不影响游戏服务
+        if (bind(admin_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(admin_fd, 16) < 0) {
+            perror("Admin port unavailable, metrics disabled");
+            close(admin_fd);
+            admin_fd = -1;
+            return;
+        }
+    }
+    
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, admin_main, (void *)(long)admin_fd) != 0) {
+        perror("Failed to create admin thread");
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(thread);
+    
+    printf("Metrics available at http://127.0.0.1:%d/metrics\n", port);
+}
+
+void reactor_watch(Reactor *r, int fd) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        perror("epoll_ctl failed");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// listen_fds和inherited_udp_fd来自热重启前的旧进程，没有时传NULL和-1新建
+void init_reactors(int count, int backlog, const int *listen_fds, int inherited_udp_fd) {
+    if (count < 1) count = 1;
+    if (count > MAX_REACTORS) count = MAX_REACTORS;
+    reactor_count = count;
+    
+    // 停止时用来唤醒reactor 0以外的reactor
+    reactor_wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (reactor_wakeup_fd == -1) {
+        perror("eventfd failed");
+        exit(EXIT_FAILURE);
+    }
+    
+    for (int i = 0; i < count; i++) {
+        Reactor *r = &reactors[i];
+        
+        r->index = i;
+        r->listen_fd = listen_fds ? listen_fds[i] : create_listener(backlog);
+        r->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (r->epoll_fd == -1) {
+            perror("epoll_create1 failed");
+            exit(EXIT_FAILURE);
+        }
+        
+        reactor_watch(r, r->listen_fd);
+        if (i > 0) reactor_watch(r, reactor_wakeup_fd);
+    }
+    
+    // UDP套接字只有一个，由第一个reactor负责读；发送在tick线程里直接进行
+    udp_fd = inherited_udp_fd >= 0 ? inherited_udp_fd : create_udp_socket();
+    reactor_watch(&reactors[0], udp_fd);
+    
+    printf("Server started, listening on TCP/UDP port %d with %d reactors (backlog %d)\n",
+           SERVER_PORT, count, backlog);
+}
+
+// 热重启：新进程带着同一个 --handoff 路径启动，连上旧进程监听的Unix套接字（SOCK_SEQPACKET）。
+// 旧进程停下reactor和tick worker，先发若干'F'消息，用SCM_RIGHTS带过去监听套接字、UDP套接字和
+// 所有客户端连接，正文是它们在旧进程里的编号；再发若干'S'状态分块和一条'E'。新进程把描述符放回
+// 原来的编号，按fd索引的表和UDP令牌都不用改；恢复连接和房间后回一条'K'，旧进程随即退出。
+// 中途任何一步出错旧进程都会接着运行
+void handoff_put(FILE *out, unsigned int value) {
+    unsigned char buffer[5];
+    fwrite(buffer, 1, put_varint(buffer, value), out);
+}
+
+void handoff_put64(FILE *out, unsigned long long value) {
+    handoff_put(out, value >> 32);
+    handoff_put(out, value & 0xFFFFFFFF);
+}
+
+unsigned long long handoff_read64(LogReader *r) {
+    unsigned long long high = read_varint(r);
+    return (high << 32) | read_varint(r);
+}
+
+// 调用者需持有连接锁。写出了一部分的帧只带剩下的字节，还没开始写的帧只保留控制消息，
+// 快照在新进程里会以关键帧重发
+void handoff_pack_connection(FILE *out, int fd, Connection *c) {
+    handoff_put(out, fd);
+    handoff_put64(out, c->udp_token);
+    handoff_put(out, c->udp_bound);
+    handoff_put(out, ntohl(c->udp_addr.sin_addr.s_addr));
+    handoff_put(out, ntohs(c->udp_addr.sin_port));
+    handoff_put(out, c->udp_send_seq);
+    handoff_put(out, c->udp_recv_seq);
+    handoff_put(out, c->udp_recv_bits);
+    handoff_put(out, c->udp_input_next);
+    for (int i = 0; i < UDP_ACK_WINDOW; i++) {
+        handoff_put(out, c->udp_sent_seq[i]);
+        handoff_put(out, c->udp_sent_tick[i]);
+    }
+    handoff_put(out, c->udp_acked_tick);
+    handoff_put(out, c->dropped_frames);
+    handoff_put64(out, c->inputs_limited);
+    handoff_put(out, c->in_len);
+    fwrite(c->in_buf, 1, c->in_len, out);
+    
+    int frames = 0;
+    for (int i = 0; i < c->count; i++) {
+        OutFrame *f = &c->queue[(c->head + i) % OUT_QUEUE_FRAMES];
+        if ((i == 0 && c->head_sent > 0) || f->kind == FRAME_CONTROL) frames++;
+    }
+    
+    handoff_put(out, frames);
+    for (int i = 0; i < c->count; i++) {
+        OutFrame *f = &c->queue[(c->head + i) % OUT_QUEUE_FRAMES];
+        int skip = (i == 0) ? c->head_sent : 0;
+        if (skip == 0 && f->kind != FRAME_CONTROL) continue;
+        
+        handoff_put(out, f->frame->len - skip);
+        fwrite(f->frame->data + skip, 1, f->frame->len - skip, out);
+    }
+}
+
+// 调用者需持有房间锁。快照历史、地图变更日志和回放日志不带过去
+void handoff_pack_room(FILE *out, Room *room) {
+    GameState *game = &room->game;
+    
+    handoff_put(out, room->id);
+    handoff_put(out, room->width);
+    handoff_put(out, room->height);
+    handoff_put(out, room->max_players);
+    handoff_put(out, room->view_radius);
+    handoff_put(out, room->map_seed);
+    handoff_put(out, room->tick);
+    handoff_put(out, room->bullet_steps);
+    handoff_put(out, room->bullet_accum);
+    handoff_put64(out, room->rng.state);
+    handoff_put64(out, room->rng.inc);
+    
+    for (int y = 0; y < room->height; y++) {
+        for (int x = 0; x < room->width; x++) {
+            fputc(GRID_CELL(&room->map, x, y), out);
+        }
+    }
+    
+    handoff_put(out, game->game_started);
+    handoff_put(out, game->game_over);
+    handoff_put(out, game->winner_id);
+    handoff_put(out, game->player_count);
+    for (int i = 0; i < game->player_count; i++) {
+        Player *p = &game->players[i];
+        int name_len = strlen(p->username);
+        
+        handoff_put(out, p->fd);
+        handoff_put(out, p->x);
+        handoff_put(out, p->y);
+        handoff_put(out, p->direction);
+        handoff_put(out, p->alive);
+        handoff_put(out, p->input_seq);
+        handoff_put(out, p->next_fire_tick);
+        handoff_put(out, name_len);
+        fwrite(p->username, 1, name_len, out);
+    }
+    
+    BulletSet *bullets = &game->bullets;
+    handoff_put64(out, bullets->active);
+    for (BulletMask m = bullets->active; m; m &= m - 1) {
+        int i = __builtin_ctzll(m);
+        handoff_put(out, bullets->x[i]);
+        handoff_put(out, bullets->y[i]);
+        handoff_put(out, bullets->direction[i]);
+        handoff_put(out, bullets->owner_id[i]);
+    }
+    
+    handoff_put(out, room->spectator_count);
+    for (int i = 0; i < room->spectator_count; i++) {
+        handoff_put(out, room->spectators[i].fd);
+    }
+}
+
+int handoff_send(int conn, char type, const void *data, size_t len, const int *fds, int fd_count) {
+    union {
+        char buffer[CMSG_SPACE(sizeof(int) * HANDOFF_FDS_PER_MSG)];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov[2] = { { &type, 1 }, { (void *)data, len } };
+    struct msghdr msg;
+    
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    
+    if (fd_count > 0) {
+        memset(&control, 0, sizeof(control));
+        msg.msg_control = control.buffer;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * fd_count);
+        
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fd_count);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * fd_count);
+    }
+    
+    return sendmsg(conn, &msg, MSG_NOSIGNAL) == (ssize_t)(len + 1) ? 0 : -1;
+}
+
+// 旧进程一侧，reactor 0在handoff_fd可读时调用；成功时直接退出，失败时恢复收发和tick后返回
+void handoff_serve() {
+    int fd_count = 0;
+    
+    int conn = accept4(handoff_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (conn < 0) return;
+    
+    struct timeval timeout = { HANDOFF_TIMEOUT_MS / 1000, HANDOFF_TIMEOUT_MS % 1000 * 1000 };
+    setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    
+    printf("New process connected, handing off...\n");
+    long long started = monotonic_ns();
+    
+    stop_reactors();
+    stop_tick_workers();
+    
+    // 已经标记关闭的连接不交接；队列里还没处理的输入现在就执行掉
+    for (int fd = 0; fd < max_connections; fd++) {
+        if (connections[fd].active && connections[fd].closing) close_client(fd);
+    }
+    
+    for (int i = 0; i < room_pool.next_id; i++) {
+        Room *room = get_room(i);
+        if (!room) continue;
+        
+        pthread_mutex_lock(&room->mutex);
+        if (room->active) apply_inputs(room);
         pthread_mutex_unlock(&room->mutex);
+    }
+    
+    drain_connections(0);
+    
+    char *state = NULL;
+    size_t state_len = 0;
+    int *fds = malloc(sizeof(int) * (max_connections + MAX_REACTORS + 3));
+    FILE *out = fds ? open_memstream(&state, &state_len) : NULL;
+    if (!out) {
+        perror("Failed to allocate handoff state");
+        free(fds);
+        close(conn);
+        start_tick_workers();
+        start_reactors();
         return;
     }
     
-    int bullet_id = -1;
-    for (int i = 0; i < MAX_BULLETS; i++) {
-        if (!room->game.bullets[i].active) {
-            bullet_id = i;
-            break;
+    fwrite("TKHO", 1, 4, out);
+    handoff_put(out, HANDOFF_VERSION);
+    handoff_put(out, room_pool.next_id);
+    handoff_put(out, reactor_count);
+    for (int i = 0; i < reactor_count; i++) {
+        handoff_put(out, reactors[i].listen_fd);
+        fds[fd_count++] = reactors[i].listen_fd;
+    }
+    handoff_put(out, udp_fd);
+    fds[fd_count++] = udp_fd;
+    handoff_put(out, admin_fd + 1);
+    if (admin_fd >= 0) fds[fd_count++] = admin_fd;
+    handoff_put(out, handoff_fd);
+    fds[fd_count++] = handoff_fd;
+    
+    int conn_count = 0;
+    for (int fd = 0; fd < max_connections; fd++) {
+        if (connections[fd].active) conn_count++;
+    }
+    handoff_put(out, conn_count);
+    for (int fd = 0; fd < max_connections; fd++) {
+        Connection *c = &connections[fd];
+        
+        pthread_mutex_lock(&c->mutex);
+        if (c->active) {
+            handoff_pack_connection(out, fd, c);
+            fds[fd_count++] = fd;
         }
+        pthread_mutex_unlock(&c->mutex);
     }
     
-    if (bullet_id == -1) {
+    int room_count = 0;
+    for (int i = 0; i < room_pool.next_id; i++) {
+        Room *room = get_room(i);
+        if (room && room->active) room_count++;
+    }
+    handoff_put(out, room_count);
+    for (int i = 0; i < room_pool.next_id; i++) {
+        Room *room = get_room(i);
+        if (!room) continue;
+        
+        pthread_mutex_lock(&room->mutex);
+        if (room->active) handoff_pack_room(out, room);
         pthread_mutex_unlock(&room->mutex);
-        return;
     }
     
-    Bullet *b = &room->game.bullets[bullet_id];
-    b->active = 1;
-    b->owner_id = player_id + 1;
+    fclose(out);
+    
+    int ok = 1;
+    for (int i = 0; ok && i < fd_count; i += HANDOFF_FDS_PER_MSG) {
+        unsigned char numbers[HANDOFF_FDS_PER_MSG * 4];
+        int n = fd_count - i < HANDOFF_FDS_PER_MSG ? fd_count - i : HANDOFF_FDS_PER_MSG;
+        
+        for (int j = 0; j < n; j++) {
+            put_u32(numbers + j * 4, fds[i + j]);
+        }
+        ok = handoff_send(conn, 'F', numbers, n * 4, fds + i, n) == 0;
+    }
+    for (size_t sent = 0; ok && sent < state_len; sent += HANDOFF_CHUNK) {
+        size_t n = state_len - sent < HANDOFF_CHUNK ? state_len - sent : HANDOFF_CHUNK;
+        ok = handoff_send(conn, 'S', state + sent, n, NULL, 0) == 0;
+    }
+    
+    char reply = 0;
+    ok = ok && handoff_send(conn, 'E', NULL, 0, NULL, 0) == 0 && recv(conn, &reply, 1, 0) == 1 && reply == 'K';
+    free(state);
+    free(fds);
+    
+    if (ok) {
+        for (int i = 0; i < room_pool.next_id; i++) {
+            Room *room = get_room(i);
+            if (!room) continue;
+            
+            pthread_mutex_lock(&room->mutex);
+            replay_close(room);
+            pthread_mutex_unlock(&room->mutex);
+        }
+        
+        printf("Handed off %d connections and %d rooms in %.1f ms, exiting\n",
+               conn_count, room_count, (monotonic_ns() - started) / 1e6);
+        exit(0);
+    }
+    
+    fprintf(stderr, "Handoff failed, resuming\n");
+    close(conn);
+    start_tick_workers();
+    start_reactors();
+}
+
+// 没有旧进程时自己监听handoff_path，等下一个版本来接手
+void handoff_listen(const char *path) {
+    struct sockaddr_un addr;
     
-    switch (p->direction) {
-        case UP:
-            b->x = p->x;
-            b->y = p->y - 1;
-            break;
-        case RIGHT:
-            b->x = p->x + 1;
-            b->y = p->y;
-            break;
-        case DOWN:
-            b->x = p->x;
-            b->y = p->y + 1;
-            break;
-        case LEFT:
-            b->x = p->x - 1;
-            b->y = p->y;
-            break;
-    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
     
-    b->direction = p->direction;
+    handoff_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (handoff_fd < 0) {
+        perror("Handoff socket creation failed");
+        exit(EXIT_FAILURE);
+    }
     
-    if (b->x < 0 || b->x >= MAP_WIDTH || b->y < 0 || b->y >= MAP_HEIGHT ||
-        room->game.map[b->y][b->x] == WALL) {
-        b->active = 0;
+    unlink(path);
+    if (bind(handoff_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("Handoff bind failed");
+        exit(EXIT_FAILURE);
     }
     
-    pthread_mutex_unlock(&room->mutex);
+    if (listen(handoff_fd, 1) < 0) {
+        perror("Handoff listen failed");
+        exit(EXIT_FAILURE);
+    }
 }
 
-void move_tank(Room *room, int player_id, int direction) {
-    pthread_mutex_lock(&room->mutex);
-    
-    Player *p = &room->game.players[player_id];
-    if (!p->alive) {
-        pthread_mutex_unlock(&room->mutex);
-        return;
+// 收到的描述符先挪到连接表以上，避开旧进程里所有可能的编号
+int handoff_park_fd(int fd) {
+    int moved = fcntl(fd, F_DUPFD_CLOEXEC, max_connections);
+    close(fd);
+    return moved;
+}
+
+// 新进程一侧，必须在创建任何其他描述符之前调用。连不上说明没有旧进程在跑，返回-1；
+// 否则收下旧进程的描述符并放回原来的编号，状态留在state里，返回和旧进程之间的连接。
+// 连接表要先由init_connections分配好
+int handoff_receive(const char *path, LogReader *state) {
+    int capacity = max_connections + MAX_REACTORS + 3;
+    int *parked = malloc(sizeof(int) * capacity);
+    int *targets = malloc(sizeof(int) * capacity);
+    int count = 0;
+    if (!parked || !targets) {
+        perror("Failed to allocate handoff buffers");
+        exit(EXIT_FAILURE);
     }
     
-    p->direction = direction;
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
     
-    int new_x = p->x;
-    int new_y = p->y;
+    int conn = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (conn < 0) {
+        perror("Handoff socket creation failed");
+        exit(EXIT_FAILURE);
+    }
     
-    switch (direction) {
-        case UP:    new_y--; break;
-        case RIGHT: new_x++; break;
-        case DOWN:  new_y++; break;
-        case LEFT:  new_x--; break;
+    if (connect(conn, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        if (errno != ENOENT && errno != ECONNREFUSED) {
+            perror("Handoff connect failed");
+            exit(EXIT_FAILURE);
+        }
+        close(conn);
+        return -1;
     }
     
-    if (new_x < 0 || new_x >= MAP_WIDTH || new_y < 0 || new_y >= MAP_HEIGHT) {
-        pthread_mutex_unlock(&room->mutex);
-        return;
+    conn = handoff_park_fd(conn);
+    if (conn < 0) {
+        perror("Failed to move handoff socket");
+        exit(EXIT_FAILURE);
     }
     
-    if (room->game.map[new_y][new_x] == EMPTY) {
-        int has_tank = 0;
-        for (int i = 0; i < room->game.player_count; i++) {
-            if (i != player_id && room->game.players[i].alive && 
-                room->game.players[i].x == new_x && room->game.players[i].y == new_y) {
-                has_tank = 1;
-                break;
-            }
-        }
-        
-        if (!has_tank) {
-            p->x = new_x;
-            p->y = new_y;
-        }
+    struct timeval timeout = { HANDOFF_TIMEOUT_MS / 1000, HANDOFF_TIMEOUT_MS % 1000 * 1000 };
+    setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    
+    printf("Taking over from the running server at %s\n", path);
+    
+    unsigned char *buffer = malloc(HANDOFF_CHUNK + 1);
+    unsigned char *data = NULL;
+    size_t len = 0;
+    if (!buffer) {
+        perror("Failed to allocate handoff buffer");
+        exit(EXIT_FAILURE);
     }
     
-    pthread_mutex_unlock(&room->mutex);
-}
-
-void update_bullets(Room *room) {
-    for (int i = 0; i < MAX_BULLETS; i++) {
-        if (!room->game.bullets[i].active) continue;
-        
-        Bullet *b = &room->game.bullets[i];
+    while (1) {
+        union {
+            char buffer[CMSG_SPACE(sizeof(int) * HANDOFF_FDS_PER_MSG)];
+            struct cmsghdr align;
+        } control;
+        struct iovec iov = { buffer, HANDOFF_CHUNK + 1 };
+        struct msghdr msg;
         
-        switch (b->direction) {
-            case UP:    b->y--; break;
-            case RIGHT: b->x++; break;
-            case DOWN:  b->y++; break;
-            case LEFT:  b->x--; break;
-        }
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buffer;
+        msg.msg_controllen = sizeof(control.buffer);
         
-        if (b->x < 0 || b->x >= MAP_WIDTH || b->y < 0 || b->y >= MAP_HEIGHT) {
-            b->active = 0;
-            continue;
+        ssize_t n = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+        if (n <= 0 || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+            fprintf(stderr, "Handoff interrupted\n");
+            exit(EXIT_FAILURE);
         }
         
-        if (room->game.map[b->y][b->x] == WALL) {
-            b->active = 0;
-            continue;
+        int *fds = NULL;
+        int received = 0;
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            fds = (int *)CMSG_DATA(cmsg);
+            received = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
         }
         
-        if (room->game.map[b->y][b->x] == DESTRUCTIBLE_WALL) {
-            room->game.map[b->y][b->x] = EMPTY;
-            b->active = 0;
-            continue;
-        }
+        if (buffer[0] == 'E') break;
         
-        for (int j = 0; j < room->game.player_count; j++) {
-            Player *p = &room->game.players[j];
-            if (p->alive && p->x == b->x && p->y == b->y && 
-                b->owner_id != p->id) {
-                
-                p->alive = 0;
-                b->active = 0;
-                
-                printf("Player %s was eliminated in Room %d!\n", p->username, room->id);
-                
-                int alive_count = 0;
-                int last_alive = -1;
-                for (int k = 0; k < room->game.player_count; k++) {
-                    if (room->game.players[k].alive) {
-                        alive_count++;
-                        last_alive = k;
-                    }
+        if (buffer[0] == 'F' && received == (n - 1) / 4 &&
+            count + received <= capacity) {
+            for (int i = 0; i < received; i++) {
+                targets[count] = get_u32(buffer + 1 + i * 4);
+                parked[count] = handoff_park_fd(fds[i]);
+                if (parked[count] < 0) {
+                    perror("Failed to move inherited descriptor");
+                    exit(EXIT_FAILURE);
                 }
-                
-                if (alive_count == 1 && room->game.game_started && !room->game.game_over) {
-                    room->game.game_over = 1;
-                    room->game.winner_id = room->game.players[last_alive].id;
-                    printf("Game over in Room %d! Player %s wins!\n", 
-                           room->id, room->game.players[last_alive].username);
-                }
-                
-                break;
+                count++;
             }
+        } else if (buffer[0] == 'S' && received == 0) {
+            data = realloc(data, len + n - 1);
+            if (!data) {
+                perror("Failed to allocate handoff state");
+                exit(EXIT_FAILURE);
+            }
+            memcpy(data + len, buffer + 1, n - 1);
+            len += n - 1;
+        } else {
+            fprintf(stderr, "Unexpected handoff message '%c'\n", buffer[0]);
+            exit(EXIT_FAILURE);
         }
     }
-}
-
-void send_room_assignment(int client_fd, int room_id, int player_id) {
-    unsigned char buffer[4];
     
-    buffer[0] = CMD_ROOM_ASSIGN;
-    
-    buffer[1] = room_id;
+    free(buffer);
     
-    buffer[2] = player_id + 1;
+    for (int i = 0; i < count; i++) {
+        if (targets[i] >= max_connections) {
+            fprintf(stderr, "Descriptor %d does not fit the connection table, cannot take over\n", targets[i]);
+            exit(EXIT_FAILURE);
+        }
+        if (fcntl(targets[i], F_GETFD) != -1) {
+            fprintf(stderr, "Descriptor %d is already in use, cannot take over\n", targets[i]);
+            exit(EXIT_FAILURE);
+        }
+        if (dup3(parked[i], targets[i], O_CLOEXEC) < 0) {
+            perror("Failed to restore inherited descriptor");
+            exit(EXIT_FAILURE);
+        }
+        close(parked[i]);
+    }
+    free(parked);
+    free(targets);
     
-    send(client_fd, buffer, 3, 0);
+    state->data = data;
+    state->len = len;
+    state->pos = 0;
+    state->error = 0;
     
-    printf("Assigned client %d to Room %d as Player %d\n", client_fd, room_id, player_id + 1);
+    return conn;
 }
 
-void send_game_update(Room *room) {
-    unsigned char buffer[BUFFER_SIZE];
-    memset(buffer, 0, BUFFER_SIZE);
-    int offset = 0;
+// 读出状态头：房间号上限、各reactor的监听套接字和UDP套接字，管理端口和热重启的监听套接字直接接管
+int handoff_read_header(LogReader *r, int *next_room_id, int *listen_fds, int *inherited_udp_fd) {
+    const unsigned char *magic = read_bytes(r, 4);
+    if (!magic || memcmp(magic, "TKHO", 4) != 0 || read_varint(r) != HANDOFF_VERSION) {
+        fprintf(stderr, "Running server speaks an incompatible handoff version\n");
+        exit(EXIT_FAILURE);
+    }
     
-    buffer[offset++] = CMD_UPDATE;
+    *next_room_id = read_varint(r);
+    int count = read_varint(r);
+    if (count < 1 || count > MAX_REACTORS) r->error = 1;
+    for (int i = 0; !r->error && i < count; i++) {
+        listen_fds[i] = read_varint(r);
+    }
+    *inherited_udp_fd = read_varint(r);
+    admin_fd = (int)read_varint(r) - 1;
+    handoff_fd = read_varint(r);
     
-    buffer[offset++] = room->id;
+    if (r->error || *next_room_id > ROOM_ID_LIMIT) {
+        fprintf(stderr, "Corrupt handoff state\n");
+        exit(EXIT_FAILURE);
+    }
     
-    for (int y = 0; y < MAP_HEIGHT; y++) {
-        for (int x = 0; x < MAP_WIDTH; x++) {
-            buffer[offset++] = room->game.map[y][x];
-        }
+    return count;
+}
+
+void handoff_restore_connection(LogReader *r) {
+    int fd = read_varint(r);
+    if (r->error || fd >= max_connections || fcntl(fd, F_GETFD) == -1) {
+        r->error = 1;
+        return;
     }
     
-    buffer[offset++] = room->game.player_count;
+    Reactor *reactor = &reactors[fd % reactor_count];
+    Connection *c = &connections[fd];
+    conn_open(fd, reactor->epoll_fd);
     
-    for (int i = 0; i < room->game.player_count; i++) {
-        Player *p = &room->game.players[i];
-        
-        buffer[offset++] = p->x;
-        buffer[offset++] = p->y;
-        buffer[offset++] = p->direction;
-        buffer[offset++] = p->alive;
-        buffer[offset++] = p->id;
-        
-        int username_len = strlen(p->username);
-        if (username_len > USERNAME_MAX - 1) username_len = USERNAME_MAX - 1;
-        buffer[offset++] = username_len;
-        
-        memcpy(buffer + offset, p->username, username_len);
-        offset += username_len;
+    pthread_mutex_lock(&c->mutex);
+    udp_token_unregister(c);
+    udp_token_register(c, fd, handoff_read64(r));
+    c->udp_bound = read_varint(r);
+    memset(&c->udp_addr, 0, sizeof(c->udp_addr));
+    c->udp_addr.sin_family = AF_INET;
+    c->udp_addr.sin_addr.s_addr = htonl(read_varint(r));
+    c->udp_addr.sin_port = htons(read_varint(r));
+    c->udp_send_seq = read_varint(r);
+    c->udp_recv_seq = read_varint(r);
+    c->udp_recv_bits = read_varint(r);
+    c->udp_input_next = read_varint(r);
+    for (int i = 0; i < UDP_ACK_WINDOW; i++) {
+        c->udp_sent_seq[i] = read_varint(r);
+        c->udp_sent_tick[i] = read_varint(r);
     }
+    c->udp_acked_tick = read_varint(r);
+    c->dropped_frames = read_varint(r);
+    c->inputs_limited = handoff_read64(r);
     
-    int bullet_count = 0;
-    for (int i = 0; i < MAX_BULLETS; i++) {
-        if (room->game.bullets[i].active) bullet_count++;
+    unsigned int in_len = read_varint(r);
+    const unsigned char *in = in_len <= IN_BUFFER_SIZE ? read_bytes(r, in_len) : NULL;
+    if (in) {
+        memcpy(c->in_buf, in, in_len);
+        c->in_len = in_len;
+    } else {
+        r->error = 1;
     }
-    buffer[offset++] = bullet_count;
     
-    for (int i = 0; i < MAX_BULLETS; i++) {
-        if (room->game.bullets[i].active) {
-            Bullet *b = &room->game.bullets[i];
-            buffer[offset++] = b->x;
-            buffer[offset++] = b->y;
-            buffer[offset++] = b->direction;
-            buffer[offset++] = b->owner_id;
+    unsigned int frames = read_varint(r);
+    if (frames > OUT_QUEUE_FRAMES) r->error = 1;
+    for (unsigned int i = 0; !r->error && i < frames; i++) {
+        unsigned int len = read_varint(r);
+        const unsigned char *bytes = len <= FRAME_HEADER_SIZE + MAX_FRAME_PAYLOAD ? read_bytes(r, len) : NULL;
+        FrameBuf *frame = bytes ? frame_alloc((int)len - FRAME_HEADER_SIZE) : NULL;
+        if (!frame) {
+            r->error = 1;
+            break;
         }
+        
+        memcpy(frame->data, bytes, len);
+        frame->len = len;
+        OutFrame *f = &c->queue[(c->head + c->count) % OUT_QUEUE_FRAMES];
+        f->frame = frame;
+        f->kind = FRAME_CONTROL;
+        f->queued_ns = monotonic_ns();
+        c->count++;
     }
+    pthread_mutex_unlock(&c->mutex);
     
-    buffer[offset++] = room->game.game_started;
-    buffer[offset++] = room->game.game_over;
-    buffer[offset++] = room->game.winner_id;
-    
-    for (int i = 0; i < room->game.player_count; i++) {
-        if (room->game.players[i].fd > 0) {
-            send(room->game.players[i].fd, buffer, offset, 0);
-        }
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    ev.data.fd = fd;
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        perror("epoll_ctl failed");
+        r->error = 1;
     }
 }
 
-void send_game_start(Room *room) {
-    unsigned char buffer[3];
+// 房间按原来的房间号重建，地图和对局状态原样恢复，所有观看者从关键帧重新开始；
+// 恢复出来的房间处于挂起状态，全部解析成功并通知旧进程之后才由handoff_restore唤醒
+void handoff_restore_room(LogReader *r) {
+    int id = read_varint(r);
+    int width = read_varint(r);
+    int height = read_varint(r);
+    int max_players = read_varint(r);
+    int radius = read_varint(r);
+    if (r->error || width < MIN_MAP_SIZE || width > MAX_MAP_SIZE || height < MIN_MAP_SIZE || height > MAX_MAP_SIZE ||
+        max_players < 2 || max_players > spawn_capacity(width, height) || radius > MAX_MAP_SIZE) {
+        r->error = 1;
+        return;
+    }
     
-    buffer[0] = CMD_GAME_START;
+    Room *room = room_adopt(id);
+    if (!room) {
+        r->error = 1;
+        return;
+    }
     
-    buffer[1] = room->id;
+    pthread_mutex_lock(&room->mutex);
     
-    for (int i = 0; i < room->game.player_count; i++) {
-        if (room->game.players[i].fd > 0) {
-            send(room->game.players[i].fd, buffer, 2, 0);
-        }
+    room->width = width;
+    room->height = height;
+    room->max_players = max_players;
+    room->view_radius = radius;
+    compute_spawns(width, height, max_players, room->spawns);
+    if (grid_resize(&room->map, width, height) < 0 || grid_resize(&room->tank_at, width, height) < 0 ||
+        room_history_resize(room, max_players) < 0) {
+        perror("Failed to allocate room map");
+        r->error = 1;
     }
     
-    printf("Game started in Room %d with %d players!\n", room->id, room->game.player_count);
-}
-
-void send_game_over(Room *room) {
-    unsigned char buffer[3];
+    room->active = 1;
+    memset(&room->game, 0, sizeof(room->game));
+    room_history_reset(room);
+    room->map_log_count = 0;
+    room->tick_overruns = 0;
+    room->ticks_skipped = 0;
+    atomic_store(&room->bytes_out, 0);
+    atomic_store(&room->frames_out, 0);
     
-    buffer[0] = CMD_GAME_OVER;
+    room->map_seed = read_varint(r);
+    room->tick = read_varint(r);
+    room->bullet_steps = read_varint(r);
+    room->bullet_accum = read_varint(r);
+    room->rng.state = handoff_read64(r);
+    room->rng.inc = handoff_read64(r);
+    room->last_keyframe_tick = room->tick;
+    room->last_update_tick = room->tick;
+    room->last_change_tick = room->tick;
+    room->replay_pending = replay_dir != NULL;
     
-    buffer[1] = room->game.winner_id;
+    const unsigned char *cells = r->error ? NULL : read_bytes(r, width * height);
+    for (int y = 0; cells && y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            GRID_CELL(&room->map, x, y) = cells[y * width + x];
+        }
+    }
     
-    for (int i = 0; i < room->game.player_count; i++) {
-        if (room->game.players[i].fd > 0) {
-            send(room->game.players[i].fd, buffer, 2, 0);
+    GameState *game = &room->game;
+    game->game_started = read_varint(r);
+    game->game_over = read_varint(r);
+    game->winner_id = read_varint(r);
+    game->player_count = read_varint(r);
+    if (game->player_count > max_players) r->error = 1;
+    
+    for (int i = 0; !r->error && i < game->player_count; i++) {
+        Player *p = &game->players[i];
+        
+        p->fd = read_varint(r);
+        p->x = read_varint(r);
+        p->y = read_varint(r);
+        p->direction = read_varint(r);
+        p->alive = read_varint(r);
+        p->input_seq = read_varint(r);
+        p->next_fire_tick = read_varint(r);
+        p->id = i + 1;
+        room->views[i].need_keyframe = 1;
+        
+        unsigned int name_len = read_varint(r);
+        const unsigned char *name = name_len < USERNAME_MAX ? read_bytes(r, name_len) : NULL;
+        if (!name || p->fd < 0 || p->fd >= max_connections || p->x >= width || p->y >= height || p->direction > LEFT) {
+            r->error = 1;
+            break;
         }
+        memcpy(p->username, name, name_len);
     }
     
-    printf("Game over in Room %d! Winner: Player %d\n", room->id, room->game.winner_id);
-}
-
-void client_handler(void *arg) {
-    int client_fd = *((int *)arg);
-    free(arg);
+    BulletSet *bullets = &game->bullets;
+    bullets->active = handoff_read64(r) & BULLET_SLOTS_MASK;
+    for (BulletMask m = bullets->active; !r->error && m; m &= m - 1) {
+        int i = __builtin_ctzll(m);
+        bullets->x[i] = read_varint(r);
+        bullets->y[i] = read_varint(r);
+        bullets->direction[i] = read_varint(r);
+        bullets->owner_id[i] = read_varint(r);
+        if (bullets->x[i] >= width || bullets->y[i] >= height || bullets->direction[i] > LEFT) r->error = 1;
+    }
     
-    int flags = fcntl(client_fd, F_GETFL, 0);
-    fcntl(client_fd, F_SETFL, flags | O_NONBLOCK);
+    room->spectator_count = read_varint(r);
+    if (room->spectator_count > MAX_SPECTATORS) r->error = 1;
+    for (int i = 0; !r->error && i < room->spectator_count; i++) {
+        Spectator *s = &room->spectators[i];
+        
+        s->fd = read_varint(r);
+        memset(&s->view, 0, sizeof(ViewState));
+        s->view.need_keyframe = 1;
+        if (s->fd < 0 || s->fd >= max_connections) r->error = 1;
+    }
     
-    struct epoll_event ev;
-    ev.events = EPOLLIN | EPOLLET;
-    ev.data.fd = client_fd;
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) == -1) {
-        perror("epoll_ctl failed");
-        close(client_fd);
+    if (r->error) {
+        pthread_mutex_unlock(&room->mutex);
         return;
     }
-}
-
-void handle_client_message(int client_fd, unsigned char *buffer, int len) {
-    if (len <= 0) return;
     
-    unsigned char cmd = buffer[0];
+    room->roster_version++;
+    room->map_version++;
+    room->map_hash = hash_bytes(HASH_SEED, room->map.cells, room->map.capacity);
+    rebuild_occupancy(room);
     
-    switch (cmd) {
-        case CMD_LOGIN: {
-            buffer[len] = '\0';
-            
-            char username[USERNAME_MAX];
-            memset(username, 0, USERNAME_MAX);
-            strncpy(username, (char*)(buffer + 1), USERNAME_MAX - 1);
-            
-            int room_id = find_available_room();
-            if (room_id < 0) {
-                printf("No rooms available for client %d\n", client_fd);
-                close(client_fd);
-                return;
-            }
-            
-            int player_id = add_player(client_fd, username, room_id);
-            if (player_id >= 0) {
-                printf("Player %s connected, assigned to Room %d as Player %d\n", 
-                       username, room_id, player_id + 1);
-                
-                send_room_assignment(client_fd, room_id, player_id);
-            }
-            break;
-        }
-        case CMD_MOVE: {
-            if (len < 3) return;
-            
-            int player_id = buffer[1] - 1;
-            int direction = buffer[2];
-            
-            Room *room = find_room_for_client(client_fd);
-            if (room && player_id >= 0 && player_id < room->game.player_count && 
-                room->game.players[player_id].fd == client_fd) {
-                move_tank(room, player_id, direction);
-            }
-            break;
-        }
-        case CMD_SHOOT: {
-            if (len < 2) return;
-            
-            int player_id = buffer[1] - 1;
-            
-            Room *room = find_room_for_client(client_fd);
-            if (room && player_id >= 0 && player_id < room->game.player_count && 
-                room->game.players[player_id].fd == client_fd) {
-                shoot(room, player_id);
-            }
-            break;
-        }
+    for (int i = 0; i < game->player_count; i++) {
+        session_bind(game->players[i].fd, room->id, i);
     }
+    for (int i = 0; i < room->spectator_count; i++) {
+        session_bind(room->spectators[i].fd, room->id, SPECTATOR_SLOT_BASE + i);
+    }
+    room_pool_update_open(room);
+    
+    // 先不调度：旧进程确认退出之前，新进程不能往继承来的连接上写任何东西
+    room->worker = room->id % tick_worker_count;
+    atomic_store(&room->parked, 1);
+    
+    pthread_mutex_unlock(&room->mutex);
 }
 
-void set_nonblocking(int fd) {
-    int flags = fcntl(fd, F_GETFL, 0);
-    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
-}
-
-void shutdown_server(int sig) {
-    printf("\nShutting down server...\n");
+// 各线程和reactor都已初始化之后调用，恢复连接和房间并通知旧进程退出
+void handoff_restore(LogReader *r, int conn) {
+    int conn_count = read_varint(r);
+    for (int i = 0; !r->error && i < conn_count; i++) {
+        handoff_restore_connection(r);
+    }
     
-    for (int i = 0; i < MAX_ROOMS; i++) {
-        if (rooms[i].active) {
-            pthread_mutex_lock(&rooms[i].mutex);
-            
-            for (int j = 0; j < rooms[i].game.player_count; j++) {
-                if (rooms[i].game.players[j].fd > 0) {
-                    close(rooms[i].game.players[j].fd);
-                }
-            }
-            
-            rooms[i].active = 0;
-            pthread_mutex_unlock(&rooms[i].mutex);
-            
-            pthread_join(rooms[i].thread, NULL);
-            pthread_mutex_destroy(&rooms[i].mutex);
-        }
+    int room_count = read_varint(r);
+    for (int i = 0; !r->error && i < room_count; i++) {
+        handoff_restore_room(r);
     }
     
-    shutdown_thread_pool();
+    if (r->error || r->pos != r->len) {
+        fprintf(stderr, "Corrupt handoff state\n");
+        exit(EXIT_FAILURE);
+    }
     
-    if (server_fd > 0) close(server_fd);
-    if (epoll_fd > 0) close(epoll_fd);
+    free((void *)r->data);
     
-    exit(0);
+    char reply = 'K';
+    if (send(conn, &reply, 1, MSG_NOSIGNAL) != 1) {
+        perror("Failed to confirm handoff");
+        exit(EXIT_FAILURE);
+    }
+    close(conn);
+    
+    for (int i = 0; i < room_pool.next_id; i++) {
+        Room *room = get_room(i);
+        if (!room) continue;
+        
+        pthread_mutex_lock(&room->mutex);
+        if (room->active) room_wake(room);
+        pthread_mutex_unlock(&room->mutex);
+    }
+    
+    printf("Took over %d connections and %d rooms\n", conn_count, room_count);
 }
 
-int main() {
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t client_len = sizeof(client_addr);
-    struct epoll_event ev, events[MAX_EVENTS];
-    
-    signal(SIGINT, shutdown_server);
+// 回放工具直接包含本文件复用模拟代码，自己提供main
+#ifndef TANKS_NO_MAIN
+int main(int argc, char *argv[]) {
+    int max_rooms = DEFAULT_MAX_ROOMS;
+    int tick_workers_wanted = sysconf(_SC_NPROCESSORS_ONLN);
+    int tick_rate_wanted = DEFAULT_TICK_RATE;
+    int reactors_wanted = sysconf(_SC_NPROCESSORS_ONLN);
+    int backlog = DEFAULT_BACKLOG;
+    int pool_threads = DEFAULT_POOL_THREADS;
+    int connections_wanted = 0;
     
-    memset(rooms, 0, sizeof(rooms));
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--max-rooms") == 0 && i + 1 < argc) {
+            max_rooms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--tick-workers") == 0 && i + 1 < argc) {
+            tick_workers_wanted = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--tick-rate") == 0 && i + 1 < argc) {
+            tick_rate_wanted = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--reactors") == 0 && i + 1 < argc) {
+            reactors_wanted = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--backlog") == 0 && i + 1 < argc) {
+            backlog = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--pool-threads") == 0 && i + 1 < argc) {
+            pool_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--map-size") == 0 && i + 1 < argc) {
+            // 接受 N 或 WxH，所有房间共用这一个尺寸
+            const char *size = argv[++i];
+            char *end;
+            map_width = strtol(size, &end, 10);
+            map_height = *end == 'x' ? strtol(end + 1, &end, 10) : map_width;
+            if (end == size || *end != '\0') {
+                fprintf(stderr, "Invalid --map-size value '%s', expected N or WxH\n", size);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--max-players") == 0 && i + 1 < argc) {
+            players_per_room = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--view-radius") == 0 && i + 1 < argc) {
+            view_radius = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--input-rate") == 0 && i + 1 < argc) {
+            input_rate = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--max-connections") == 0 && i + 1 < argc) {
+            connections_wanted = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--admin-port") == 0 && i + 1 < argc) {
+            admin_port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--replay-dir") == 0 && i + 1 < argc) {
+            replay_dir = argv[++i];
+        } else if (strcmp(argv[i], "--handoff") == 0 && i + 1 < argc) {
+            handoff_path = argv[++i];
+        } else if (strcmp(argv[i], "--debug") == 0) {
+            debug_logging = 1;
+        } else {
+            fprintf(stderr, "Usage: %s [--max-rooms N] [--tick-workers N] [--tick-rate HZ] "
+                    "[--reactors N] [--backlog N] [--pool-threads N] [--map-size WxH] "
+                    "[--max-players N] [--view-radius N] [--input-rate N] [--max-connections N] [--admin-port N] [--replay-dir DIR] "
+                    "[--handoff PATH] [--debug]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
     
-    init_room(0);
+    if (tick_rate_wanted < MIN_TICK_RATE || tick_rate_wanted > MAX_TICK_RATE) {
+        fprintf(stderr, "Tick rate must be between %d and %d Hz\n", MIN_TICK_RATE, MAX_TICK_RATE);
+        exit(EXIT_FAILURE);
+    }
     
-    init_thread_pool();
+    if (max_rooms <= 0) {
+        fprintf(stderr, "Invalid --max-rooms value\n");
+        exit(EXIT_FAILURE);
+    }
     
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd == -1) {
-        perror("Failed to create socket");
+    if (backlog <= 0) {
+        fprintf(stderr, "Invalid --backlog value\n");
         exit(EXIT_FAILURE);
     }
     
-    int opt = 1;
-    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (map_width < MIN_MAP_SIZE || map_width > MAX_MAP_SIZE ||
+        map_height < MIN_MAP_SIZE || map_height > MAX_MAP_SIZE) {
+        fprintf(stderr, "Map size must be between %d and %d\n", MIN_MAP_SIZE, MAX_MAP_SIZE);
+        exit(EXIT_FAILURE);
+    }
     
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(SERVER_PORT);
+    if (players_per_room < 2 || players_per_room > MAX_PLAYERS) {
+        fprintf(stderr, "Players per room must be between 2 and %d\n", MAX_PLAYERS);
+        exit(EXIT_FAILURE);
+    }
     
-    if (bind(server_fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        perror("Bind failed");
+    if (input_rate <= 0) {
+        fprintf(stderr, "Invalid --input-rate value\n");
         exit(EXIT_FAILURE);
     }
     
-    if (listen(server_fd, 5) < 0) {
-        perror("Listen failed");
+    if (connections_wanted < 0 || connections_wanted > MAX_CONNECTIONS_LIMIT) {
+        fprintf(stderr, "Invalid --max-connections value\n");
         exit(EXIT_FAILURE);
     }
     
-    printf("Server started, listening on port %d\n", SERVER_PORT);
+    if (admin_port < 0 || admin_port > 65535) {
+        fprintf(stderr, "Invalid --admin-port value\n");
+        exit(EXIT_FAILURE);
+    }
     
-    epoll_fd = epoll_create1(0);
-    if (epoll_fd == -1) {
-        perror("epoll_create1 failed");
+    if (view_radius < 0 || view_radius > MAX_MAP_SIZE) {
+        fprintf(stderr, "View radius must be between 0 and %d\n", MAX_MAP_SIZE);
         exit(EXIT_FAILURE);
     }
     
-    ev.events = EPOLLIN;
-    ev.data.fd = server_fd;
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &ev) == -1) {
-        perror("epoll_ctl failed");
+    if (players_per_room > spawn_capacity(map_width, map_height)) {
+        players_per_room = spawn_capacity(map_width, map_height);
+        printf("A %dx%d map fits at most %d players per room\n", map_width, map_height, players_per_room);
+    }
+    
+    // 有旧进程在跑就接管它的套接字和房间，监听套接字的个数决定reactor数
+    LogReader handoff_state;
+    int handoff_conn = -1;
+    int listen_fds[MAX_REACTORS];
+    int inherited_udp_fd = -1;
+    init_connections(connections_wanted, max_rooms);
+    if (handoff_path) handoff_conn = handoff_receive(handoff_path, &handoff_state);
+    if (handoff_conn >= 0) {
+        int next_room_id;
+        reactors_wanted = handoff_read_header(&handoff_state, &next_room_id, listen_fds, &inherited_udp_fd);
+        if (max_rooms < next_room_id) max_rooms = next_room_id;
+    }
+    
+    // SIGINT和SIGTERM在所有线程里都屏蔽，只经signalfd由reactor 0处理
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd == -1) {
+        perror("signalfd failed");
         exit(EXIT_FAILURE);
     }
     
-    while (1) {
-        int nfds = epoll_wait(epoll_fd, events, MAX_EVENTS, 50);
-        if (nfds == -1) {
-            perror("epoll_wait failed");
-            exit(EXIT_FAILURE);
-        }
-        
-        for (int i = 0; i < nfds; i++) {
-            if (events[i].data.fd == server_fd) {
-                int *client_fd = malloc(sizeof(int));
-                if (!client_fd) {
-                    perror("Failed to allocate memory for client_fd");
-                    continue;
-                }
-                
-                *client_fd = accept(server_fd, (struct sockaddr*)&client_addr, &client_len);
-                if (*client_fd == -1) {
-                    perror("accept failed");
-                    free(client_fd);
-                    continue;
-                }
-                
-                printf("New client connected, fd: %d, from: %s:%d\n", 
-                       *client_fd, inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
-                
-                add_work(client_handler, client_fd);
-            } else {
-                unsigned char buffer[BUFFER_SIZE];
-                int client_fd = events[i].data.fd;
-                
-                int len = recv(client_fd, buffer, sizeof(buffer), 0);
-                if (len <= 0) {
-                    if (len == 0) {
-                        printf("Client disconnected, fd: %d\n", client_fd);
-                        remove_player_from_room(client_fd);
-                    } else {
-                        perror("recv failed");
-                    }
-                    
-                    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client_fd, NULL);
-                    close(client_fd);
-                } else {
-                    handle_client_message(client_fd, buffer, len);
-                }
-            }
-        }
-        
-        usleep(10000);
+    init_thread_pool(pool_threads);
+    init_room_pool(max_rooms);
+    init_map_cache(map_width, map_height, players_per_room);
+    init_tick_workers(tick_workers_wanted, tick_rate_wanted);
+    
+    init_reactors(reactors_wanted, backlog, handoff_conn >= 0 ? listen_fds : NULL, inherited_udp_fd);
+    reactor_watch(&reactors[0], signal_fd);
+    
+    if (admin_port > 0) {
+        start_admin(admin_port);
+    } else if (admin_fd >= 0) {
+        close(admin_fd);
+        admin_fd = -1;
+    }
+    
+    if (handoff_conn >= 0) {
+        handoff_restore(&handoff_state, handoff_conn);
+    } else if (handoff_path) {
+        handoff_listen(handoff_path);
     }
+    if (handoff_fd >= 0) reactor_watch(&reactors[0], handoff_fd);
     
-    close(server_fd);
-    close(epoll_fd);
+    start_reactors();
+    reactor_main(&reactors[0]);
     
     return 0;
 }
+#endif
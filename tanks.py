@@ -4,14 +4,22 @@ import sys
 import threading
 import time
 import os
+import random
 
-MAP_WIDTH = 20
-MAP_HEIGHT = 20
+# 窗口里显示的格子数；地图更大时镜头跟随自己的坦克
+VIEW_WIDTH = 20
+VIEW_HEIGHT = 20
 TILE_SIZE = 30
-SCREEN_WIDTH = MAP_WIDTH * TILE_SIZE
-SCREEN_HEIGHT = MAP_HEIGHT * TILE_SIZE + 40
+SCREEN_WIDTH = VIEW_WIDTH * TILE_SIZE
+SCREEN_HEIGHT = VIEW_HEIGHT * TILE_SIZE + 40
 SERVER_PORT = 8888
 BUFFER_SIZE = 4096
+SNAPSHOT_HISTORY = 64
+FRAME_HEADER_SIZE = 2
+MAP_CHUNK_SIZE = 16
+UDP_INPUT_REDUNDANCY = 8
+UDP_ACK_WINDOW = 32
+INPUT_BURST = 10
 
 EMPTY = 0
 WALL = 1
@@ -33,6 +41,10 @@ CMD_UPDATE = ord('U')
 CMD_GAME_START = ord('G')
 CMD_GAME_OVER = ord('O')
 CMD_ROOM_ASSIGN = ord('R')
+CMD_DELTA = ord('D')
+CMD_ACK = b'A'
+CMD_SPECTATE = b'W'
+CMD_TOKEN = ord('K')
 
 BLACK = (0, 0, 0)
 WHITE = (255, 255, 255)
@@ -52,8 +64,21 @@ TANK_COLORS = [
 ]
 
 
+def read_varint(data, offset):
+    # LEB128：每字节低7位是数据，最高位表示后面还有字节
+    value = 0
+    shift = 0
+    while True:
+        byte = data[offset]
+        offset += 1
+        value |= (byte & 0x7F) << shift
+        if not byte & 0x80:
+            return value, offset
+        shift += 7
+
+
 class TankGameClient:
-    def __init__(self, server_ip):
+    def __init__(self, server_ip, spectate_room=None, use_udp=False, udp_loss=0.0):
         self.running = True
         pygame.init()
         self.screen = pygame.display.set_mode((SCREEN_WIDTH, SCREEN_HEIGHT))
@@ -61,9 +86,14 @@ class TankGameClient:
         self.clock = pygame.time.Clock()
         self.server_ip = server_ip
 
-        self.map = [[EMPTY for _ in range(MAP_WIDTH)] for _ in range(MAP_HEIGHT)]
+        self.map_width = VIEW_WIDTH
+        self.map_height = VIEW_HEIGHT
+        self.map = [[EMPTY for _ in range(self.map_width)] for _ in range(self.map_height)]
         self.players = []
         self.bullets = []
+        self.bullet_slots = {}
+        self.snapshots = {}
+        self.latest_tick = -1
         self.player_id = -1
         self.room_id = -1
         self.game_started = False
@@ -72,15 +102,48 @@ class TankGameClient:
         self.connected = False
         self.connection_error = None
         self.room_assigned = False
+        self.spectate_room = spectate_room
+        self.state_lock = threading.Lock()
+
+        # UDP通道：收到令牌后开启，增量帧和操作输入走UDP；udp_loss按比例模拟双向丢包
+        self.use_udp = use_udp
+        self.udp_loss = udp_loss
+        self.udp_sock = None
+        self.udp_lock = threading.Lock()
+        self.udp_seq = 0
+        self.udp_recv_seq = 0
+        self.udp_recv_bits = 0
+        self.input_seq = 0
+        self.pending_inputs = []
+        self.sent_inputs = {}
+
+        # 客户端预测：移动先在本地生效，快照里带回的输入序号之前的移动从待确认列表中去掉
+        self.command_seq = 0
+        self.pending_moves = []
+
+        # 服务器一个tick只执行最后一个移动，超出令牌桶的输入直接丢弃；令牌消息带来tick频率和限速后，
+        # 本地按同样的规则合并、节流，还没发出去的移动不参与预测
+        self.input_lock = threading.Lock()
+        self.tick_interval = 0
+        self.input_rate = 0
+        self.input_tokens = INPUT_BURST
+        self.input_refill = time.monotonic()
+        self.queued_move = None
+        self.queued_shot = False
+        self.last_move_time = 0
 
         self.load_resources()
 
-        self.username = self.show_login_dialog()
+        if spectate_room is None:
+            self.username = self.show_login_dialog()
 
         try:
             self.connect_to_server()
             self.connected = True
-            self.send_login()
+            if spectate_room is None:
+                self.send_login()
+            else:
+                self.send_spectate(spectate_room)
 
             self.thread = threading.Thread(target=self.receive_data)
             self.thread.daemon = True
@@ -235,35 +298,388 @@ class TankGameClient:
         self.sock.connect((self.server_ip, SERVER_PORT))
         print(f"Connected to server: {self.server_ip}:{SERVER_PORT}")
 
+    def send_message(self, message):
+        # 每条消息前加2字节长度，服务器按长度拆分粘在一起的消息
+        self.sock.sendall(len(message).to_bytes(FRAME_HEADER_SIZE, 'big') + message)
+
     def send_login(self):
         message = CMD_LOGIN + self.username.encode()
-        self.sock.send(message)
+        self.send_message(message)
+
+    def send_spectate(self, room_id):
+        self.send_message(CMD_SPECTATE + room_id.to_bytes(4, 'big'))
 
     def send_move(self, direction):
-        if self.player_id != -1 and self.connected and self.room_assigned and not self.game_over:
-            try:
-                message = CMD_MOVE + bytes([self.player_id, direction])
-                self.sock.send(message)
-            except BrokenPipeError:
-                print("Server connection lost")
-                self.connected = False
-            except Exception as e:
-                print(f"Error sending move: {e}")
-                self.connected = False
+        if self.player_id > 0 and self.connected and self.room_assigned and not self.game_over:
+            with self.input_lock:
+                self.queued_move = direction
+            self.flush_inputs()
 
     def send_shoot(self):
-        if self.player_id != -1 and self.connected and self.room_assigned and not self.game_over:
+        if self.player_id > 0 and self.connected and self.room_assigned and not self.game_over:
+            with self.input_lock:
+                self.queued_shot = True
+            self.flush_inputs()
+
+    def take_input_token(self, now):
+        # 与服务器的令牌桶相同，只是不算确认占用的那份额度
+        if not self.input_rate:
+            return True
+        self.input_tokens = min(INPUT_BURST, self.input_tokens + (now - self.input_refill) * self.input_rate)
+        self.input_refill = now
+        if self.input_tokens < 1:
+            return False
+        self.input_tokens -= 1
+        return True
+
+    def flush_inputs(self):
+        # 排队的移动每个tick最多发出一个，射击排在它后面，保持先移动后射击的顺序
+        with self.input_lock:
             try:
-                message = CMD_SHOOT + bytes([self.player_id])
-                self.sock.send(message)
+                now = time.monotonic()
+                if (self.queued_move is not None and now - self.last_move_time >= self.tick_interval and
+                        self.take_input_token(now)):
+                    self.command_seq += 1
+                    self.pending_moves.append((self.command_seq, self.queued_move))
+                    message = CMD_MOVE + bytes([self.player_id, self.queued_move]) + self.input_stamp()
+                    self.queued_move = None
+                    self.last_move_time = now
+                    self.send_input(message)
+
+                if self.queued_shot and self.queued_move is None:
+                    self.queued_shot = False
+                    if self.take_input_token(now):
+                        self.command_seq += 1
+                        self.send_input(CMD_SHOOT + bytes([self.player_id]) + self.input_stamp())
             except BrokenPipeError:
                 print("Server connection lost")
                 self.connected = False
             except Exception as e:
-                print(f"Error sending shoot: {e}")
+                print(f"Error sending input: {e}")
                 self.connected = False
 
+    def input_stamp(self):
+        # 输入序号 + 当前看到的快照tick，服务器按这个tick结算射击
+        return self.command_seq.to_bytes(4, 'big') + max(self.latest_tick, 0).to_bytes(4, 'big')
+
+    def send_input(self, message):
+        if self.udp_sock is None:
+            self.send_message(message)
+            return
+
+        # 未确认的输入保留最近几条，每个数据报都重复带上
+        with self.udp_lock:
+            self.pending_inputs.append((self.input_seq, message))
+            self.input_seq += 1
+            del self.pending_inputs[:-UDP_INPUT_REDUNDANCY]
+        self.send_datagram()
+
+    def start_udp(self, token):
+        self.udp_token = token
+        self.udp_sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.udp_sock.connect((self.server_ip, SERVER_PORT))
+        self.udp_sock.settimeout(0.2)
+        self.udp_thread = threading.Thread(target=self.receive_udp)
+        self.udp_thread.daemon = True
+        self.udp_thread.start()
+        self.send_datagram()
+
+    def send_datagram(self):
+        # 令牌 + 序号 + 确认序号 + 确认位图 + 首个输入序号 + 输入条数 + 带长度前缀的输入
+        with self.udp_lock:
+            self.udp_seq += 1
+            inputs = list(self.pending_inputs)
+            first = inputs[0][0] if inputs else self.input_seq
+            packet = (self.udp_token.to_bytes(8, 'big') + self.udp_seq.to_bytes(4, 'big') +
+                      self.udp_recv_seq.to_bytes(4, 'big') + self.udp_recv_bits.to_bytes(4, 'big') +
+                      (first & 0xFFFFFFFF).to_bytes(4, 'big') + bytes([len(inputs)]))
+            packet += b''.join(len(m).to_bytes(FRAME_HEADER_SIZE, 'big') + m for _, m in inputs)
+            if inputs:
+                self.sent_inputs[self.udp_seq] = inputs[-1][0]
+                self.sent_inputs.pop(self.udp_seq - UDP_ACK_WINDOW, None)
+
+        if random.random() < self.udp_loss:
+            return
+        try:
+            self.udp_sock.send(packet)
+        except OSError as e:
+            print(f"Error sending datagram: {e}")
+
+    def receive_udp(self):
+        while self.running and self.connected:
+            try:
+                packet = self.udp_sock.recv(BUFFER_SIZE)
+            except socket.timeout:
+                # 空闲时也定期发一个数据报，保持绑定并重发未确认的输入
+                self.send_datagram()
+                continue
+            except OSError:
+                break
+
+            if len(packet) < 13 or random.random() < self.udp_loss:
+                continue
+
+            seq = int.from_bytes(packet[0:4], 'big')
+            ack = int.from_bytes(packet[4:8], 'big')
+            ack_bits = int.from_bytes(packet[8:12], 'big')
+
+            with self.udp_lock:
+                # 服务器确认过的数据报里最新的输入之前都已送达
+                confirmed = -1
+                for sent_seq, last_input in self.sent_inputs.items():
+                    diff = ack - sent_seq
+                    if diff == 0 or (0 < diff <= 32 and (ack_bits >> (diff - 1)) & 1):
+                        confirmed = max(confirmed, last_input)
+                self.pending_inputs = [(n, m) for n, m in self.pending_inputs if n > confirmed]
+
+            applied = False
+            with self.state_lock:
+                if packet[12] == CMD_DELTA and self.room_assigned and not self.game_over:
+                    try:
+                        applied = self.process_delta(packet[12:], via_udp=True)
+                    except Exception as e:
+                        print(f"Error processing delta data: {e}")
+
+            # 只确认真正用上的增量帧，服务器据此推进基线
+            if applied:
+                with self.udp_lock:
+                    diff = seq - self.udp_recv_seq
+                    if diff > 0:
+                        self.udp_recv_bits = ((self.udp_recv_bits << diff) | (1 << (diff - 1))) & 0xFFFFFFFF if diff <= 32 else 0
+                        self.udp_recv_seq = seq
+                    elif -32 <= diff < 0:
+                        self.udp_recv_bits |= 1 << (-diff - 1)
+            self.send_datagram()
+
+    def send_ack(self, tick):
+        try:
+            self.send_message(CMD_ACK + tick.to_bytes(4, 'big'))
+        except Exception as e:
+            print(f"Error sending ack: {e}")
+            self.connected = False
+
+    def store_snapshot(self, tick, players, bullet_slots, ack=True):
+        self.players = players
+        me = next((p for p in players if p['id'] == self.player_id), None)
+        if me:
+            with self.input_lock:
+                self.pending_moves = [(seq, d) for seq, d in self.pending_moves if seq > me.get('input_seq', 0)]
+        self.bullet_slots = bullet_slots
+        self.bullets = [bullet_slots[slot] for slot in sorted(bullet_slots)]
+        self.latest_tick = tick
+        # 没有窗口循环时（比如无界面测试）靠快照到达的节奏把排队的输入发出去
+        if self.queued_move is not None or self.queued_shot:
+            self.flush_inputs()
+
+        # 只保留最近的快照作为增量基线
+        self.snapshots[tick] = (players, bullet_slots)
+        while len(self.snapshots) > SNAPSHOT_HISTORY:
+            del self.snapshots[min(self.snapshots)]
+
+        # 经UDP收到的增量帧由数据报确认位图确认
+        if ack:
+            self.send_ack(tick)
+
+    def apply_game_state(self, data, offset):
+        if offset + 2 >= len(data):
+            print("Invalid data format: game state missing")
+            return
+
+        # 如果游戏已经结束，不会接受覆盖它的状态更新
+        if not self.game_over:
+            self.game_started = data[offset]
+            offset += 1
+            game_over_state = data[offset]
+            offset += 1
+
+            # 只有从游戏进行中到游戏结束的转变才会被处理
+            if not self.game_over and game_over_state:
+                self.game_over = game_over_state
+                self.winner_id = data[offset]
+                print(f"Game over! Winner: Player {self.winner_id}")
+            # 如果游戏正在进行，更新状态
+            elif not self.game_over:
+                self.winner_id = data[offset]
+
+    def process_delta(self, data, via_udp=False):
+        if len(data) < 15:
+            print("Invalid data format: delta header missing")
+            return False
+
+        if int.from_bytes(data[1:5], 'big') != self.room_id:
+            return False
+
+        tick = int.from_bytes(data[5:9], 'big')
+        base_tick = int.from_bytes(data[9:13], 'big')
+        steps = data[13]
+        offset = 14
+
+        if tick <= self.latest_tick:
+            return False
+
+        base = self.snapshots.get(base_tick)
+        if base is None:
+            print(f"Missing baseline {base_tick} for delta {tick}")
+            return False
+
+        change_count, offset = read_varint(data, offset)
+
+        # 地图变更按顺序重放是幂等的，直接作用在当前地图上
+        for _ in range(change_count):
+            x, offset = read_varint(data, offset)
+            y, offset = read_varint(data, offset)
+            cell = data[offset]
+            offset += 1
+            if 0 <= x < self.map_width and 0 <= y < self.map_height:
+                self.map[y][x] = cell
+
+        # 新进入视野的地图块整块下发
+        chunk_count, offset = read_varint(data, offset)
+        for _ in range(chunk_count):
+            chunk_x, offset = read_varint(data, offset)
+            chunk_y, offset = read_varint(data, offset)
+            offset = self.read_cells(data, offset, chunk_x * MAP_CHUNK_SIZE, chunk_y * MAP_CHUNK_SIZE,
+                                     MAP_CHUNK_SIZE, MAP_CHUNK_SIZE)
+
+        players = [dict(player) for player in base[0]]
+        tank_count, offset = read_varint(data, offset)
+        for _ in range(tank_count):
+            index, offset = read_varint(data, offset)
+            x, offset = read_varint(data, offset)
+            y, offset = read_varint(data, offset)
+            direction = data[offset]
+            alive = data[offset + 1]
+            input_seq, offset = read_varint(data, offset + 2)
+            if index < len(players):
+                players[index].update({
+                    'x': x,
+                    'y': y,
+                    'direction': direction,
+                    'alive': alive,
+                    'input_seq': input_seq
+                })
+
+        # 离开视野或被击毁的坦克
+        left_count, offset = read_varint(data, offset)
+        for _ in range(left_count):
+            index, offset = read_varint(data, offset)
+            if index < len(players):
+                players[index]['alive'] = 0
+
+        bullet_slots = {}
+        for slot, bullet in base[1].items():
+            bullet = dict(bullet)
+            direction = bullet['direction']
+            if direction == UP:
+                bullet['y'] -= steps
+            elif direction == RIGHT:
+                bullet['x'] += steps
+            elif direction == DOWN:
+                bullet['y'] += steps
+            elif direction == LEFT:
+                bullet['x'] -= steps
+            bullet_slots[slot] = bullet
+
+        removed_count, offset = read_varint(data, offset)
+        for _ in range(removed_count):
+            slot, offset = read_varint(data, offset)
+            bullet_slots.pop(slot, None)
+
+        added_count, offset = read_varint(data, offset)
+        for _ in range(added_count):
+            slot, offset = self.read_bullet(data, offset, bullet_slots)
+
+        self.store_snapshot(tick, players, bullet_slots, ack=not via_udp)
+        self.apply_game_state(data, offset)
+        return True
+
+    def read_bullet(self, data, offset, bullet_slots):
+        slot, offset = read_varint(data, offset)
+        x, offset = read_varint(data, offset)
+        y, offset = read_varint(data, offset)
+        direction = data[offset]
+        owner_id, offset = read_varint(data, offset + 1)
+        bullet_slots[slot] = {
+            'x': x,
+            'y': y,
+            'direction': direction,
+            'owner_id': owner_id
+        }
+        return slot, offset
+
+    def read_cells(self, data, offset, origin_x, origin_y, width, height):
+        # 每格2位，按行优先每字节4格，低位在前；地图外的格子忽略
+        packed_len = (width * height + 3) // 4
+        if offset + packed_len > len(data):
+            raise ValueError("map data missing")
+
+        for y in range(height):
+            if not 0 <= origin_y + y < self.map_height:
+                continue
+            row = self.map[origin_y + y]
+            for x in range(width):
+                if 0 <= origin_x + x < self.map_width:
+                    n = y * width + x
+                    row[origin_x + x] = (data[offset + n // 4] >> ((n % 4) * 2)) & 3
+        return offset + packed_len
+
+    def read_map(self, data, offset):
+        # 关键帧只带视野内的地图块，视野外的格子当作空地
+        width, offset = read_varint(data, offset)
+        height, offset = read_varint(data, offset)
+        chunk_x0, offset = read_varint(data, offset)
+        chunk_y0, offset = read_varint(data, offset)
+        chunk_x1, offset = read_varint(data, offset)
+        chunk_y1, offset = read_varint(data, offset)
+
+        self.map = [[EMPTY] * width for _ in range(height)]
+        self.map_width = width
+        self.map_height = height
+
+        x0, y0 = chunk_x0 * MAP_CHUNK_SIZE, chunk_y0 * MAP_CHUNK_SIZE
+        x1 = min(chunk_x1 * MAP_CHUNK_SIZE, width)
+        y1 = min(chunk_y1 * MAP_CHUNK_SIZE, height)
+        return self.read_cells(data, offset, x0, y0, max(x1 - x0, 0), max(y1 - y0, 0))
+
+    def predicted_players(self):
+        # 在最新快照上重放还没被服务器处理的移动，规则与服务器的move_tank相同
+        players = self.players
+        index = next((i for i, p in enumerate(players) if p['id'] == self.player_id), None)
+        if index is None or not players[index].get('alive') or not self.pending_moves:
+            return players
+
+        me = dict(players[index])
+        occupied = {(p['x'], p['y']) for i, p in enumerate(players) if i != index and p.get('alive')}
+        for _, direction in self.pending_moves:
+            me['direction'] = direction
+            x, y = me['x'], me['y']
+            if direction == UP:
+                y -= 1
+            elif direction == RIGHT:
+                x += 1
+            elif direction == DOWN:
+                y += 1
+            elif direction == LEFT:
+                x -= 1
+            if (0 <= x < self.map_width and 0 <= y < self.map_height and
+                    self.map[y][x] == EMPTY and (x, y) not in occupied):
+                me['x'], me['y'] = x, y
+
+        return players[:index] + [me] + players[index + 1:]
+
+    def camera_origin(self, players):
+        # 镜头以自己的坦克为中心（观战时以地图中心），到地图边缘为止
+        center_x, center_y = self.map_width // 2, self.map_height // 2
+        player = next((p for p in players if p['id'] == self.player_id), None)
+        if player:
+            center_x, center_y = player['x'], player['y']
+
+        origin_x = min(max(center_x - VIEW_WIDTH // 2, 0), max(self.map_width - VIEW_WIDTH, 0))
+        origin_y = min(max(center_y - VIEW_HEIGHT // 2, 0), max(self.map_height - VIEW_HEIGHT, 0))
+        return origin_x, origin_y
+
     def receive_data(self):
+        pending = b''
         while self.running and self.connected:
             try:
                 data = self.sock.recv(BUFFER_SIZE)
@@ -272,7 +688,17 @@ class TankGameClient:
                     self.connected = False
                     break
 
-                self.process_data(data)
+                pending += data
+                offset = 0
+                while len(pending) - offset >= FRAME_HEADER_SIZE:
+                    length = int.from_bytes(pending[offset:offset + FRAME_HEADER_SIZE], 'big')
+                    if len(pending) - offset - FRAME_HEADER_SIZE < length:
+                        break
+                    start = offset + FRAME_HEADER_SIZE
+                    with self.state_lock:
+                        self.process_data(pending[start:start + length])
+                    offset = start + length
+                pending = pending[offset:]
             except ConnectionResetError:
                 print("Connection reset by server")
                 self.connected = False
@@ -289,11 +715,21 @@ class TankGameClient:
         cmd = data[0]
 
         if cmd == CMD_ROOM_ASSIGN:
-            if len(data) >= 3:
-                self.room_id = data[1]
-                self.player_id = data[2]
+            if len(data) >= 6:
+                self.room_id = int.from_bytes(data[1:5], 'big')
+                self.player_id = data[5]
                 self.room_assigned = True
-                print(f"Assigned to Room {self.room_id} as Player {self.player_id}")
+                if self.player_id == 0:
+                    print(f"Spectating Room {self.room_id}")
+                else:
+                    print(f"Assigned to Room {self.room_id} as Player {self.player_id}")
+
+        elif cmd == CMD_TOKEN:
+            if len(data) >= 12:
+                self.tick_interval = 1.0 / data[9] if data[9] else 0
+                self.input_rate = int.from_bytes(data[10:12], 'big')
+            if len(data) >= 9 and self.use_udp and self.udp_sock is None:
+                self.start_udp(int.from_bytes(data[1:9], 'big'))
 
         elif cmd == CMD_UPDATE:
             # 游戏结束后不再处理更新
@@ -303,54 +739,38 @@ class TankGameClient:
             try:
                 offset = 1
 
-                if offset >= len(data):
+                if offset + 4 > len(data):
                     print("Invalid data format: room ID missing")
                     return
 
-                received_room_id = data[offset]
-                offset += 1
+                received_room_id = int.from_bytes(data[offset:offset + 4], 'big')
+                offset += 4
 
                 if received_room_id != self.room_id:
                     print(f"Received update for Room {received_room_id}, but we're in Room {self.room_id}")
                     return
 
-                map_size = MAP_HEIGHT * MAP_WIDTH
-                if offset + map_size > len(data):
-                    print("Invalid data format: map data missing")
+                if offset + 4 > len(data):
+                    print("Invalid data format: tick missing")
                     return
 
-                map_data = data[offset:offset + map_size]
-                offset += map_size
+                tick = int.from_bytes(data[offset:offset + 4], 'big')
+                offset += 4
 
-                for y in range(MAP_HEIGHT):
-                    for x in range(MAP_WIDTH):
-                        idx = y * MAP_WIDTH + x
-                        if idx < len(map_data):
-                            self.map[y][x] = map_data[idx]
-
-                if offset >= len(data):
-                    print("Invalid data format: player count missing")
-                    return
+                offset = self.read_map(data, offset)
 
-                player_count = data[offset]
-                offset += 1
+                player_count, offset = read_varint(data, offset)
 
-                self.players = []
+                players = []
                 for _ in range(player_count):
-                    if offset + 5 >= len(data):
-                        print("Invalid data format: incomplete player data")
-                        break
-
-                    x = data[offset]
-                    offset += 1
-                    y = data[offset]
-                    offset += 1
+                    x, offset = read_varint(data, offset)
+                    y, offset = read_varint(data, offset)
                     direction = data[offset]
                     offset += 1
                     alive = data[offset]
                     offset += 1
-                    player_id = data[offset]
-                    offset += 1
+                    input_seq, offset = read_varint(data, offset)
+                    player_id, offset = read_varint(data, offset)
 
                     if offset >= len(data):
                         print("Invalid data format: username length missing")
@@ -371,60 +791,39 @@ class TankGameClient:
                         'y': y,
                         'direction': direction,
                         'alive': alive,
+                        'input_seq': input_seq,
                         'id': player_id,
                         'username': username
                     }
-                    self.players.append(player)
-
-                if offset >= len(data):
-                    print("Invalid data format: bullet count missing")
-                    return
+                    players.append(player)
 
-                bullet_count = data[offset]
-                offset += 1
+                bullet_count, offset = read_varint(data, offset)
 
-                self.bullets = []
+                bullet_slots = {}
                 for _ in range(bullet_count):
-                    if offset + 4 > len(data):
-                        print("Invalid data format: incomplete bullet data")
-                        break
+                    _, offset = self.read_bullet(data, offset, bullet_slots)
 
-                    bullet = {
-                        'x': data[offset],
-                        'y': data[offset + 1],
-                        'direction': data[offset + 2],
-                        'owner_id': data[offset + 3]
-                    }
-                    offset += 4
-                    self.bullets.append(bullet)
+                # 关键帧重置增量基线
+                self.snapshots.clear()
+                self.store_snapshot(tick, players, bullet_slots)
+                self.apply_game_state(data, offset)
 
-                if offset + 2 >= len(data):
-                    print("Invalid data format: game state missing")
-                    return
-
-                # 如果游戏已经结束，不会接受覆盖它的状态更新
-                if not self.game_over:
-                    self.game_started = data[offset]
-                    offset += 1
-                    game_over_state = data[offset]
-                    offset += 1
+            except Exception as e:
+                print(f"Error processing update data: {e}")
 
-                    # 只有从游戏进行中到游戏结束的转变才会被处理
-                    if not self.game_over and game_over_state:
-                        self.game_over = game_over_state
-                        self.winner_id = data[offset]
-                        print(f"Game over! Winner: Player {self.winner_id}")
-                    # 如果游戏正在进行，更新状态
-                    elif not self.game_over:
-                        self.winner_id = data[offset]
+        elif cmd == CMD_DELTA:
+            if not self.room_assigned or self.game_over:
+                return
 
+            try:
+                self.process_delta(data)
             except Exception as e:
-                print(f"Error processing update data: {e}")
+                print(f"Error processing delta data: {e}")
 
         elif cmd == CMD_GAME_START:
             # 游戏结束后不再接受新游戏开始命令
-            if len(data) >= 2 and not self.game_over:
-                received_room_id = data[1]
+            if len(data) >= 5 and not self.game_over:
+                received_room_id = int.from_bytes(data[1:5], 'big')
 
                 if received_room_id == self.room_id:
                     self.game_started = True
@@ -455,16 +854,23 @@ class TankGameClient:
 
         self.screen.fill(WHITE)
 
-        for y in range(MAP_HEIGHT):
-            for x in range(MAP_WIDTH):
+        players = self.predicted_players()
+        origin_x, origin_y = self.camera_origin(players)
+
+        for y in range(origin_y, min(origin_y + VIEW_HEIGHT, self.map_height)):
+            for x in range(origin_x, min(origin_x + VIEW_WIDTH, self.map_width)):
+                screen_pos = ((x - origin_x) * TILE_SIZE, (y - origin_y) * TILE_SIZE)
                 if self.map[y][x] == WALL:
-                    self.screen.blit(self.wall_img, (x * TILE_SIZE, y * TILE_SIZE))
+                    self.screen.blit(self.wall_img, screen_pos)
                 elif self.map[y][x] == DESTRUCTIBLE_WALL:
-                    self.screen.blit(self.destructible_wall_img, (x * TILE_SIZE, y * TILE_SIZE))
+                    self.screen.blit(self.destructible_wall_img, screen_pos)
 
-        for player in self.players:
+        for player in players:
             if player.get('alive', 0):
-                player_idx = min(player['id'] - 1, len(self.tank_images) - 1)
+                if not (origin_x <= player['x'] < origin_x + VIEW_WIDTH and
+                        origin_y <= player['y'] < origin_y + VIEW_HEIGHT):
+                    continue
+                player_idx = (player['id'] - 1) % len(self.tank_images)
                 direction = player['direction']
                 try:
                     tank_img = self.tank_images[player_idx][direction]
@@ -472,21 +878,27 @@ class TankGameClient:
                     tank_img = pygame.Surface((TILE_SIZE, TILE_SIZE))
                     tank_img.fill(TANK_COLORS[player_idx % len(TANK_COLORS)])
 
-                self.screen.blit(tank_img, (player['x'] * TILE_SIZE, player['y'] * TILE_SIZE))
+                tank_x = (player['x'] - origin_x) * TILE_SIZE
+                tank_y = (player['y'] - origin_y) * TILE_SIZE
+                self.screen.blit(tank_img, (tank_x, tank_y))
 
                 font = pygame.font.Font(None, 20)
                 text = font.render(player.get('username', f"Player {player['id']}"), True, BLACK)
-                self.screen.blit(text, (player['x'] * TILE_SIZE, player['y'] * TILE_SIZE - 20))
+                self.screen.blit(text, (tank_x, tank_y - 20))
 
         for bullet in self.bullets:
             direction = bullet.get('direction', 0)
             bullet_img = self.bullet_images[direction % len(self.bullet_images)]
 
-            bullet_x = bullet['x'] * TILE_SIZE + TILE_SIZE / 2 - bullet_img.get_width() / 2
-            bullet_y = bullet['y'] * TILE_SIZE + TILE_SIZE / 2 - bullet_img.get_height() / 2
+            if not (origin_x <= bullet['x'] < origin_x + VIEW_WIDTH and
+                    origin_y <= bullet['y'] < origin_y + VIEW_HEIGHT):
+                continue
+
+            bullet_x = (bullet['x'] - origin_x) * TILE_SIZE + TILE_SIZE / 2 - bullet_img.get_width() / 2
+            bullet_y = (bullet['y'] - origin_y) * TILE_SIZE + TILE_SIZE / 2 - bullet_img.get_height() / 2
             self.screen.blit(bullet_img, (bullet_x, bullet_y))
 
-        pygame.draw.rect(self.screen, LIGHT_BLUE, (0, MAP_HEIGHT * TILE_SIZE, SCREEN_WIDTH, 40))
+        pygame.draw.rect(self.screen, LIGHT_BLUE, (0, VIEW_HEIGHT * TILE_SIZE, SCREEN_WIDTH, 40))
         font = pygame.font.Font(None, 24)
 
         if not self.connected:
@@ -494,13 +906,13 @@ class TankGameClient:
                 text = font.render(f"Connection error: {self.connection_error}", True, RED)
             else:
                 text = font.render("Disconnected from server", True, RED)
-            self.screen.blit(text, (10, MAP_HEIGHT * TILE_SIZE + 10))
+            self.screen.blit(text, (10, VIEW_HEIGHT * TILE_SIZE + 10))
         elif not self.room_assigned:
             text = font.render("Waiting for room assignment...", True, BLACK)
-            self.screen.blit(text, (10, MAP_HEIGHT * TILE_SIZE + 10))
+            self.screen.blit(text, (10, VIEW_HEIGHT * TILE_SIZE + 10))
         elif not self.game_started:
             text = font.render(f"In Room {self.room_id}. Waiting for players...", True, BLACK)
-            self.screen.blit(text, (10, MAP_HEIGHT * TILE_SIZE + 10))
+            self.screen.blit(text, (10, VIEW_HEIGHT * TILE_SIZE + 10))
 
             big_font = pygame.font.Font(None, 36)
             big_text = big_font.render(f"Room {self.room_id}: Waiting for more players to join...", True, BLACK)
@@ -508,17 +920,19 @@ class TankGameClient:
             self.screen.blit(big_text, text_rect)
         else:
             controls = font.render(f"Room {self.room_id}: Arrow keys to move, Space to shoot", True, BLACK)
-            self.screen.blit(controls, (10, MAP_HEIGHT * TILE_SIZE + 10))
+            self.screen.blit(controls, (10, VIEW_HEIGHT * TILE_SIZE + 10))
 
             status = ""
             player = next((p for p in self.players if p['id'] == self.player_id), None)
-            if player:
+            if self.player_id == 0:
+                status = "Spectating"
+            elif player:
                 if player['alive']:
                     status = f"Playing as: {player['username']} (Player {self.player_id})"
                 else:
                     status = f"You were eliminated! Spectating..."
             status_text = font.render(status, True, BLACK)
-            self.screen.blit(status_text, (SCREEN_WIDTH - status_text.get_width() - 10, MAP_HEIGHT * TILE_SIZE + 10))
+            self.screen.blit(status_text, (SCREEN_WIDTH - status_text.get_width() - 10, VIEW_HEIGHT * TILE_SIZE + 10))
 
         if self.game_over:
             overlay = pygame.Surface((SCREEN_WIDTH, SCREEN_HEIGHT), pygame.SRCALPHA)
@@ -569,6 +983,8 @@ class TankGameClient:
                     elif event.key == pygame.K_SPACE:
                         self.send_shoot()
 
+            if self.connected and self.room_assigned and not self.game_over:
+                self.flush_inputs()
             self.draw_game()
 
             self.clock.tick(30)
@@ -584,12 +1000,24 @@ class TankGameClient:
 
 
 if __name__ == "__main__":
-    if len(sys.argv) > 1:
-        server_ip = sys.argv[1]
+    # --udp 让增量帧和操作走UDP，--udp-loss P 按比例(0~1)模拟丢包
+    args = sys.argv[1:]
+    use_udp = '--udp' in args
+    udp_loss = 0.0
+    if '--udp-loss' in args:
+        udp_loss = float(args[args.index('--udp-loss') + 1])
+        del args[args.index('--udp-loss'):args.index('--udp-loss') + 2]
+    args = [arg for arg in args if arg != '--udp']
+
+    if len(args) > 0:
+        server_ip = args[0]
     else:
         server_ip = input("Enter server IP address (default 127.0.0.1): ")
         if not server_ip:
             server_ip = "127.0.0.1"
 
-    game = TankGameClient(server_ip)
+    # 第二个参数是房间号时以观战者身份加入
+    spectate_room = int(args[1]) if len(args) > 1 else None
+
+    game = TankGameClient(server_ip, spectate_room, use_udp, udp_loss)
     game.run()